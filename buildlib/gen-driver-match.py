@@ -0,0 +1,64 @@
+#!/usr/bin/env python
+# Licensed under BSD (MIT variant) or GPLv2. See COPYING.
+"""Produce the match index lines for a provider's libibverbs.d driver file.
+
+The provider sources are scanned for the entries of their verbs_match_ent
+table. VERBS_DRIVER_ID() entries are resolved to the numeric value of the
+kernel's enum rdma_driver_id, while VERBS_NAME_MATCH() and
+VERBS_MODALIAS_MATCH() entries are emitted as the fnmatch pattern libibverbs
+uses for them. Entries built from other macros, such as PCI ID tables, are
+not indexed; libibverbs falls back to loading every provider for devices
+that match nothing in the index."""
+
+import argparse
+import os
+import re
+
+def parse_driver_ids(header):
+    """Return a dict of the enum rdma_driver_id names to their values"""
+    with open(header) as F:
+        text = F.read()
+    m = re.search(r"enum\s+rdma_driver_id\s*{([^}]*)}", text)
+    if m is None:
+        raise ValueError("enum rdma_driver_id not found in %s" % (header))
+
+    ids = {}
+    value = 0
+    for item in m.group(1).split(","):
+        item = re.sub(r"/\*.*?\*/", "", item, flags=re.DOTALL).strip()
+        if not item:
+            continue
+        name, _, expr = (s.strip() for s in item.partition("="))
+        if expr:
+            value = ids[expr] if expr in ids else int(expr, 0)
+        ids[name] = value
+        value = value + 1
+    return ids
+
+def scan_source(fn, ids):
+    """Yield the match directives for the match table entries in fn"""
+    with open(fn) as F:
+        text = F.read()
+    for m in re.finditer(r"\bVERBS_DRIVER_ID\(\s*(\w+)\s*\)", text):
+        yield "match driver_id %u" % (ids[m.group(1)])
+    for m in re.finditer(r'\bVERBS_NAME_MATCH\(\s*"([^"]*)"', text):
+        yield "match modalias rdma_device:*N%s*" % (m.group(1))
+    for m in re.finditer(r'\bVERBS_MODALIAS_MATCH\(\s*"([^"]*)"', text):
+        yield "match modalias %s" % (m.group(1))
+
+parser = argparse.ArgumentParser(description="Generate driver match index")
+parser.add_argument("--header", required=True,
+                    help="kernel header defining enum rdma_driver_id")
+parser.add_argument("sources", nargs="*", help="provider source files")
+args = parser.parse_args()
+
+ids = parse_driver_ids(args.header)
+lines = []
+for fn in args.sources:
+    if not fn.endswith(".c") or not os.path.exists(fn):
+        continue
+    for line in scan_source(fn, ids):
+        if line not in lines:
+            lines.append(line)
+for line in lines:
+    print(line)
@@ -120,18 +120,42 @@ function(rdma_library DEST VERSION_SCRIPT SOVERSION VERSION)
   install(TARGETS ${DEST} DESTINATION "${CMAKE_INSTALL_LIBDIR}")
 endfunction()
 
-# Create a special provider with exported symbols in it The shared provider
-# exists as a normal system library with the normal shared library SONAME and
-# other convections. The system library is symlinked into the
-# VERBS_PROVIDER_DIR so it can be dlopened as a provider as well.
-function(rdma_shared_provider DEST VERSION_SCRIPT SOVERSION VERSION)
+# Write the libibverbs.d driver files for a provider. Each file names the
+# provider and carries the index of its match table, so that libibverbs can
+# load only the providers needed for the devices present.
+function(rdma_driver_files DEST)
+  set(SRCS "")
+  foreach(SRC ${ARGN})
+    if (IS_ABSOLUTE "${SRC}")
+      list(APPEND SRCS "${SRC}")
+    else()
+      list(APPEND SRCS "${CMAKE_CURRENT_SOURCE_DIR}/${SRC}")
+    endif()
+  endforeach()
+  execute_process(COMMAND ${PYTHON_EXECUTABLE} ${PROJECT_SOURCE_DIR}/buildlib/gen-driver-match.py
+    --header "${PROJECT_SOURCE_DIR}/kernel-headers/rdma/ib_user_ioctl_verbs.h"
+    ${SRCS}
+    OUTPUT_VARIABLE MATCH_INDEX
+    RESULT_VARIABLE retcode)
+  if(NOT "${retcode}" STREQUAL "0")
+    message(FATAL_ERROR "Unable to run buildlib/gen-driver-match.py for ${DEST}")
+  endif()
+
   # Installed driver file
-  file(WRITE "${CMAKE_CURRENT_BINARY_DIR}/${DEST}.driver" "driver ${DEST}\n")
+  file(WRITE "${CMAKE_CURRENT_BINARY_DIR}/${DEST}.driver" "driver ${DEST}\n${MATCH_INDEX}")
   install(FILES "${CMAKE_CURRENT_BINARY_DIR}/${DEST}.driver" DESTINATION "${CONFIG_DIR}")
 
   # Uninstalled driver file
   file(MAKE_DIRECTORY "${BUILD_ETC}/libibverbs.d/")
-  file(WRITE "${BUILD_ETC}/libibverbs.d/${DEST}.driver" "driver ${BUILD_LIB}/lib${DEST}\n")
+  file(WRITE "${BUILD_ETC}/libibverbs.d/${DEST}.driver" "driver ${BUILD_LIB}/lib${DEST}\n${MATCH_INDEX}")
+endfunction()
+
+# Create a special provider with exported symbols in it The shared provider
+# exists as a normal system library with the normal shared library SONAME and
+# other convections. The system library is symlinked into the
+# VERBS_PROVIDER_DIR so it can be dlopened as a provider as well.
+function(rdma_shared_provider DEST VERSION_SCRIPT SOVERSION VERSION)
+  rdma_driver_files(${DEST} ${ARGN})
 
   list(APPEND RDMA_PROVIDER_LIST ${DEST} ${DEST})
   set(RDMA_PROVIDER_LIST "${RDMA_PROVIDER_LIST}" CACHE INTERNAL "")
@@ -171,13 +195,7 @@ endfunction()
 
 # Create a provider shared library for libibverbs
 function(rdma_provider DEST)
-  # Installed driver file
-  file(WRITE "${CMAKE_CURRENT_BINARY_DIR}/${DEST}.driver" "driver ${DEST}\n")
-  install(FILES "${CMAKE_CURRENT_BINARY_DIR}/${DEST}.driver" DESTINATION "${CONFIG_DIR}")
-
-  # Uninstalled driver file
-  file(MAKE_DIRECTORY "${BUILD_ETC}/libibverbs.d/")
-  file(WRITE "${BUILD_ETC}/libibverbs.d/${DEST}.driver" "driver ${BUILD_LIB}/lib${DEST}\n")
+  rdma_driver_files(${DEST} ${ARGN})
 
   list(APPEND RDMA_PROVIDER_LIST ${DEST} "${DEST}-rdmav${IBVERBS_PABI_VERSION}")
   set(RDMA_PROVIDER_LIST "${RDMA_PROVIDER_LIST}" CACHE INTERNAL "")
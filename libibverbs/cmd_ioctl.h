@@ -81,6 +81,13 @@ static inline void _scrub_ptr_attr(void **ptr)
  * buffer for the kernel.
  *
  * The current range of attributes to fill is next_attr -> last_attr.
+ *
+ * Buffers are deliberately not cached in the context for reuse. Filling one
+ * is a handful of stores into stack memory that is already hot, so the
+ * system call dominates every verb. Keeping them on the stack also means
+ * that concurrent callers on the same context share no state. The kernel
+ * executes exactly one method per RDMA_VERBS_IOCTL, so there is no
+ * multi-command submission to batch into.
  */
 struct ibv_command_buffer {
 	struct ibv_command_buffer *next;
@@ -45,15 +45,68 @@
 
 #include "ibverbs.h"
 
+/*
+ * A driver config file names a provider and may follow it with the index of
+ * the provider's match table, one "match driver_id <id>" or
+ * "match modalias <pattern>" line per entry. Providers with an index are
+ * only loaded once a device matches it.
+ */
 struct ibv_driver_name {
 	struct list_node entry;
 	char *name;
+	struct verbs_match_ent *match_table;
+	unsigned int num_match;
+	bool loaded;
 };
 
 static LIST_HEAD(driver_name_list);
+static bool config_loaded;
+
+static int add_match(struct ibv_driver_name *driver_name, char *config)
+{
+	struct verbs_match_ent *table, *ent;
+	unsigned long driver_id;
+	char *kind, *value, *end;
+
+	config += strspn(config, "\t ");
+	kind = strsep(&config, "\n\t ");
+	if (!config)
+		return -1;
+	config += strspn(config, "\t ");
+	value = strsep(&config, "\n\t ");
+	if (!*value)
+		return -1;
+
+	/* Keep room for the sentinel that terminates the table */
+	table = realloc(driver_name->match_table,
+			(driver_name->num_match + 2) * sizeof(*table));
+	if (!table)
+		return -1;
+	driver_name->match_table = table;
+	ent = &table[driver_name->num_match];
+	memset(ent, 0, 2 * sizeof(*ent));
+
+	if (strcmp(kind, "driver_id") == 0) {
+		driver_id = strtoul(value, &end, 0);
+		if (*end || driver_id == RDMA_DRIVER_UNKNOWN)
+			return -1;
+		ent->u.driver_id = driver_id;
+		ent->kind = VERBS_MATCH_DRIVER_ID;
+	} else if (strcmp(kind, "modalias") == 0) {
+		ent->u.modalias = strdup(value);
+		if (!ent->u.modalias)
+			return -1;
+		ent->kind = VERBS_MATCH_MODALIAS;
+	} else
+		return -1;
+
+	driver_name->num_match++;
+	return 0;
+}
 
 static void read_config_file(const char *path)
 {
+	struct ibv_driver_name *cur = NULL;
 	FILE *conf;
 	char *line = NULL;
 	char *config;
@@ -81,7 +134,7 @@ static void read_config_file(const char *path)
 			config += strspn(config, "\t ");
 			field = strsep(&config, "\n\t ");
 
-			driver_name = malloc(sizeof(*driver_name));
+			driver_name = calloc(1, sizeof(*driver_name));
 			if (!driver_name) {
 				fprintf(stderr,
 					PFX
@@ -101,6 +154,14 @@ static void read_config_file(const char *path)
 			}
 
 			list_add(&driver_name_list, &driver_name->entry);
+			cur = driver_name;
+		} else if (strcmp(field, "match") == 0 && config != NULL &&
+			   cur) {
+			if (add_match(cur, config))
+				fprintf(stderr,
+					PFX
+					"Warning: ignoring bad match directive for driver '%s' in file '%s'.\n",
+					cur->name, path);
 		} else
 			fprintf(stderr,
 				PFX
@@ -209,33 +270,78 @@ out_dlopen:
 	free(so_name);
 }
 
-void load_drivers(void)
+/*
+ * Read the config files and load the drivers passed in the environment, the
+ * first time it is called. Returns true if any driver was loaded.
+ */
+static bool load_config(void)
 {
-	struct ibv_driver_name *name, *next_name;
 	const char *env;
 	char *list, *env_name;
 
+	if (config_loaded)
+		return false;
+	config_loaded = true;
+
 	read_config();
 
 	/* Only use drivers passed in through the calling user's environment
 	 * if we're not running setuid.
 	 */
 	if (getuid() == geteuid()) {
-		if ((env = getenv("RDMAV_DRIVERS"))) {
-			list = strdupa(env);
-			while ((env_name = strsep(&list, ":;")))
-				load_driver(env_name);
-		} else if ((env = getenv("IBV_DRIVERS"))) {
+		env = getenv("RDMAV_DRIVERS");
+		if (!env)
+			env = getenv("IBV_DRIVERS");
+		if (env) {
 			list = strdupa(env);
 			while ((env_name = strsep(&list, ":;")))
 				load_driver(env_name);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Load only the drivers whose match index matches a device in sysfs_list.
+ * Returns true if any driver was loaded.
+ */
+bool load_matching_drivers(struct list_head *sysfs_list)
+{
+	struct ibv_driver_name *name;
+	struct verbs_sysfs_dev *sysfs_dev;
+	bool loaded;
+
+	loaded = load_config();
+
+	list_for_each (&driver_name_list, name, entry) {
+		if (name->loaded || !name->match_table)
+			continue;
+
+		list_for_each (sysfs_list, sysfs_dev, entry) {
+			if (match_sysfs_dev(name->match_table, sysfs_dev)) {
+				load_driver(name->name);
+				name->loaded = true;
+				loaded = true;
+				break;
+			}
 		}
 	}
+	return loaded;
+}
+
+/* Load every driver that has not been loaded yet */
+void load_drivers(void)
+{
+	struct ibv_driver_name *name;
 
-	list_for_each_safe (&driver_name_list, name, next_name, entry) {
+	load_config();
+
+	list_for_each (&driver_name_list, name, entry) {
+		if (name->loaded)
+			continue;
 		load_driver(name->name);
-		free(name->name);
-		free(name);
+		name->loaded = true;
 	}
 }
 #endif
@@ -33,15 +33,128 @@
 #include <config.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
 
 #include <endian.h>
 
+#include <util/compiler.h>
 #include <infiniband/verbs.h>
 
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000. + ts.tv_nsec / 1000.;
+}
+
+/*
+ * Reports the time taken to find the devices and open the first one, as
+ * seen by a starting process, followed by the average cost of looking up
+ * the device list again.
+ */
+static int time_startup(int iters)
+{
+	struct ibv_device **dev_list;
+	struct ibv_context *context;
+	double start, list_us, open_us;
+	int i;
+
+	start = now_us();
+	dev_list = ibv_get_device_list(NULL);
+	if (!dev_list) {
+		perror("Failed to get IB devices list");
+		return 1;
+	}
+	list_us = now_us() - start;
+
+	if (!dev_list[0]) {
+		fprintf(stderr, "No IB devices found\n");
+		ibv_free_device_list(dev_list);
+		return 1;
+	}
+
+	start = now_us();
+	context = ibv_open_device(dev_list[0]);
+	if (!context) {
+		fprintf(stderr, "Couldn't get context for %s\n",
+			ibv_get_device_name(dev_list[0]));
+		ibv_free_device_list(dev_list);
+		return 1;
+	}
+	open_us = now_us() - start;
+
+	printf("first device list:       %10.1f us\n", list_us);
+	printf("first open of %-11s%10.1f us\n",
+	       ibv_get_device_name(dev_list[0]), open_us);
+	printf("time to first context:   %10.1f us\n", list_us + open_us);
+
+	ibv_close_device(context);
+	ibv_free_device_list(dev_list);
+
+	start = now_us();
+	for (i = 0; i < iters; i++) {
+		dev_list = ibv_get_device_list(NULL);
+		if (!dev_list) {
+			perror("Failed to get IB devices list");
+			return 1;
+		}
+		ibv_free_device_list(dev_list);
+	}
+	printf("device list (avg of %d): %10.1f us\n", iters,
+	       (now_us() - start) / iters);
+
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage:\n");
+	printf("  %s            list RDMA devices\n", argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -t, --time=<iters>     time startup and <iters> further device list lookups\n");
+	printf("  -h, --help             print a help text and exit\n");
+}
+
 int main(int argc, char *argv[])
 {
 	struct ibv_device **dev_list;
 	int num_devices, i;
+	int iters = 0;
+
+	while (1) {
+		int ret = 1;
+		int c;
+		static struct option long_options[] = {
+			{ .name = "time",      .has_arg = 1, .val = 't' },
+			{ .name = "help",      .has_arg = 0, .val = 'h' },
+			{}
+		};
+
+		c = getopt_long(argc, argv, "t:h", long_options, NULL);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 't':
+			iters = strtol(optarg, NULL, 0);
+			if (iters > 0)
+				break;
+			usage(argv[0]);
+			return 1;
+		case 'h':
+			ret = 0;
+			SWITCH_FALLTHROUGH;
+		default:
+			usage(argv[0]);
+			return ret;
+		}
+	}
+
+	if (iters)
+		return time_startup(iters);
 
 	dev_list = ibv_get_device_list(&num_devices);
 	if (!dev_list) {
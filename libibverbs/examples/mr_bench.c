@@ -0,0 +1,292 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <util/compiler.h>
+#include <infiniband/verbs.h>
+
+/*
+ * Measures the cost of registering and deregistering memory.  Each
+ * iteration registers and deregisters every buffer once.  The test is
+ * intended to be run with and without RDMAV_MR_CACHE set, to show the
+ * effect of the registration cache.  With --remap, buffers are unmapped
+ * and mapped again after each iteration, so that cached registrations
+ * must be invalidated.  With --threads, each thread registers its own
+ * buffers concurrently, which stresses the fork range tracking when
+ * RDMAV_FORK_SAFE is set.
+ */
+
+struct bench_thread {
+	pthread_t		thread;
+	struct ibv_pd		*pd;
+	void			**bufs;
+	struct ibv_mr		**mrs;
+	unsigned long long	reg_ns;
+	unsigned long long	dereg_ns;
+	int			ret;
+};
+
+static size_t size = 65536;
+static int buffers = 16;
+static int iters = 10000;
+static int remap;
+static int access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+			  IBV_ACCESS_REMOTE_READ;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage:\n");
+	printf("  %s            run a registration benchmark\n", argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -d, --ib-dev=<dev>     use IB device <dev> (default first device found)\n");
+	printf("  -s, --size=<size>      size of each buffer (default 65536)\n");
+	printf("  -b, --buffers=<num>    number of buffers per thread (default 16)\n");
+	printf("  -n, --iters=<iters>    number of iterations (default 10000)\n");
+	printf("  -t, --threads=<num>    number of registering threads (default 1)\n");
+	printf("  -r, --remap            map the buffers again after each iteration\n");
+	printf("  -h, --help             print a help text and exit\n");
+}
+
+static void *map_buffer(void)
+{
+	void *buf;
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		return NULL;
+
+	memset(buf, 0, size);
+	return buf;
+}
+
+static void *run_bench(void *arg)
+{
+	struct bench_thread *bt = arg;
+	unsigned long long start;
+	int i, j;
+
+	bt->ret = 1;
+	for (i = 0; i < iters; i++) {
+		start = now_ns();
+		for (j = 0; j < buffers; j++) {
+			bt->mrs[j] = ibv_reg_mr(bt->pd, bt->bufs[j], size,
+						access_flags);
+			if (!bt->mrs[j]) {
+				perror("ibv_reg_mr");
+				return NULL;
+			}
+		}
+		bt->reg_ns += now_ns() - start;
+
+		start = now_ns();
+		for (j = 0; j < buffers; j++) {
+			if (ibv_dereg_mr(bt->mrs[j])) {
+				perror("ibv_dereg_mr");
+				return NULL;
+			}
+			bt->mrs[j] = NULL;
+		}
+		bt->dereg_ns += now_ns() - start;
+
+		if (!remap)
+			continue;
+
+		for (j = 0; j < buffers; j++) {
+			munmap(bt->bufs[j], size);
+			bt->bufs[j] = map_buffer();
+			if (!bt->bufs[j]) {
+				perror("mmap");
+				return NULL;
+			}
+		}
+	}
+
+	bt->ret = 0;
+	return NULL;
+}
+
+static void show_perf(const char *name, long long calls,
+		      unsigned long long nsec, unsigned long long elapsed)
+{
+	/* op calls ns/call calls/sec */
+	printf("%-8s%-12lld%10.1f%14.0f\n", name, calls,
+	       (double)nsec / calls, calls * 1000000000. / elapsed);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ibv_device **dev_list;
+	struct ibv_context *context;
+	struct bench_thread *bt;
+	struct ibv_pd *pd;
+	char *ib_devname = NULL;
+	unsigned long long start, elapsed, reg_ns = 0, dereg_ns = 0;
+	long long calls;
+	int threads = 1;
+	int i, j, ret = 1;
+
+	while (1) {
+		int c;
+		static struct option long_options[] = {
+			{ .name = "ib-dev",    .has_arg = 1, .val = 'd' },
+			{ .name = "size",      .has_arg = 1, .val = 's' },
+			{ .name = "buffers",   .has_arg = 1, .val = 'b' },
+			{ .name = "iters",     .has_arg = 1, .val = 'n' },
+			{ .name = "threads",   .has_arg = 1, .val = 't' },
+			{ .name = "remap",     .has_arg = 0, .val = 'r' },
+			{ .name = "help",      .has_arg = 0, .val = 'h' },
+			{}
+		};
+
+		c = getopt_long(argc, argv, "d:s:b:n:t:rh", long_options, NULL);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'd':
+			ib_devname = strdupa(optarg);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			buffers = strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			iters = strtol(optarg, NULL, 0);
+			break;
+		case 't':
+			threads = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			remap = 1;
+			break;
+		case 'h':
+			ret = 0;
+			SWITCH_FALLTHROUGH;
+		default:
+			usage(argv[0]);
+			return ret;
+		}
+	}
+
+	if (!size || buffers < 1 || iters < 1 || threads < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	dev_list = ibv_get_device_list(NULL);
+	if (!dev_list) {
+		perror("Failed to get IB devices list");
+		return 1;
+	}
+
+	for (i = 0; dev_list[i]; ++i) {
+		if (!ib_devname ||
+		    !strcmp(ibv_get_device_name(dev_list[i]), ib_devname))
+			break;
+	}
+	if (!dev_list[i]) {
+		fprintf(stderr, "IB device %s not found\n",
+			ib_devname ? ib_devname : "");
+		goto free_list;
+	}
+
+	context = ibv_open_device(dev_list[i]);
+	if (!context) {
+		fprintf(stderr, "Couldn't get context for %s\n",
+			ibv_get_device_name(dev_list[i]));
+		goto free_list;
+	}
+
+	pd = ibv_alloc_pd(context);
+	if (!pd) {
+		fprintf(stderr, "Couldn't allocate PD\n");
+		goto close_dev;
+	}
+
+	bt = calloc(threads, sizeof(*bt));
+	if (!bt)
+		goto dealloc_pd;
+
+	for (i = 0; i < threads; i++) {
+		bt[i].pd = pd;
+		bt[i].bufs = calloc(buffers, sizeof(*bt[i].bufs));
+		bt[i].mrs = calloc(buffers, sizeof(*bt[i].mrs));
+		if (!bt[i].bufs || !bt[i].mrs)
+			goto free_bufs;
+
+		for (j = 0; j < buffers; j++) {
+			bt[i].bufs[j] = map_buffer();
+			if (!bt[i].bufs[j]) {
+				perror("mmap");
+				goto free_bufs;
+			}
+		}
+	}
+
+	start = now_ns();
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&bt[i].thread, NULL, run_bench, &bt[i])) {
+			perror("pthread_create");
+			threads = i;
+			break;
+		}
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(bt[i].thread, NULL);
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < threads; i++) {
+		if (bt[i].ret)
+			goto free_bufs;
+		reg_ns += bt[i].reg_ns;
+		dereg_ns += bt[i].dereg_ns;
+	}
+	if (!threads)
+		goto free_bufs;
+
+	/* calls/sec is the rate of all threads over the whole run */
+	calls = (long long)iters * buffers * threads;
+	printf("%-8s%-12s%10s%14s\n", "op", "calls", "ns/call", "calls/sec");
+	show_perf("reg", calls, reg_ns, elapsed);
+	show_perf("dereg", calls, dereg_ns, elapsed);
+	ret = 0;
+
+free_bufs:
+	for (i = 0; i < threads; i++) {
+		for (j = 0; bt[i].bufs && j < buffers; j++) {
+			if (bt[i].mrs && bt[i].mrs[j])
+				ibv_dereg_mr(bt[i].mrs[j]);
+			if (bt[i].bufs[j])
+				munmap(bt[i].bufs[j], size);
+		}
+		free(bt[i].mrs);
+		free(bt[i].bufs);
+	}
+	free(bt);
+dealloc_pd:
+	ibv_dealloc_pd(pd);
+close_dev:
+	ibv_close_device(context);
+free_list:
+	ibv_free_device_list(dev_list);
+	return ret;
+}
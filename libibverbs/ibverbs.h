@@ -61,12 +61,32 @@ int __lib_query_port(struct ibv_context *context, uint8_t port_num,
 int setup_sysfs_uverbs(int uv_dirfd, const char *uverbs,
 		       struct verbs_sysfs_dev *sysfs_dev);
 
+struct ibv_mr *__ibv_reg_mr_iova2(struct ibv_pd *pd, void *addr, size_t length,
+				  uint64_t iova, unsigned int access);
+int __ibv_dereg_mr(struct ibv_mr *mr);
+
+bool mr_cache_enabled(void);
+struct ibv_mr *mr_cache_reg(struct ibv_pd *pd, void *addr, size_t length,
+			    unsigned int access);
+bool mr_cache_put(struct ibv_mr *mr);
+bool mr_cache_owns(struct ibv_mr *mr);
+void mr_cache_flush_pd(struct ibv_pd *pd);
+
+const struct verbs_match_ent *
+match_sysfs_dev(const struct verbs_match_ent *table,
+		struct verbs_sysfs_dev *sysfs_dev);
+
 #ifdef _STATIC_LIBRARY_BUILD_
 static inline void load_drivers(void)
 {
 }
+static inline bool load_matching_drivers(struct list_head *sysfs_list)
+{
+	return false;
+}
 #else
 void load_drivers(void);
+bool load_matching_drivers(struct list_head *sysfs_list);
 #endif
 
 struct verbs_ex_private {
@@ -49,6 +49,8 @@
 #include <assert.h>
 #include <fnmatch.h>
 #include <sys/sysmacros.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
 
 #include <rdma/rdma_netlink.h>
 
@@ -275,7 +277,7 @@ static bool match_modalias(const struct verbs_match_ent *ent, const char *value)
  * that matches the device the verbs sysfs device is bound to or NULL.
  */
 static const struct verbs_match_ent *
-match_modalias_device(const struct verbs_device_ops *ops,
+match_modalias_device(const struct verbs_match_ent *table,
 		      struct verbs_sysfs_dev *sysfs_dev)
 {
 	const struct verbs_match_ent *i;
@@ -290,7 +292,7 @@ match_modalias_device(const struct verbs_device_ops *ops,
 		}
 	}
 
-	for (i = ops->match_table; i->kind != VERBS_MATCH_SENTINEL; i++)
+	for (i = table; i->kind != VERBS_MATCH_SENTINEL; i++)
 		if (match_modalias(i, sysfs_dev->modalias))
 			return i;
 
@@ -299,8 +301,8 @@ match_modalias_device(const struct verbs_device_ops *ops,
 
 /* Match the device name itself */
 static const struct verbs_match_ent *
-match_name(const struct verbs_device_ops *ops,
-		      struct verbs_sysfs_dev *sysfs_dev)
+match_name(const struct verbs_match_ent *table,
+	   struct verbs_sysfs_dev *sysfs_dev)
 {
 	char name_ma[100];
 	const struct verbs_match_ent *i;
@@ -309,7 +311,7 @@ match_name(const struct verbs_device_ops *ops,
 			    "rdma_device:N%s", sysfs_dev->ibdev_name))
 		return NULL;
 
-	for (i = ops->match_table; i->kind != VERBS_MATCH_SENTINEL; i++)
+	for (i = table; i->kind != VERBS_MATCH_SENTINEL; i++)
 		if (match_modalias(i, name_ma))
 			return i;
 
@@ -318,7 +320,7 @@ match_name(const struct verbs_device_ops *ops,
 
 /* Match the driver id we get from netlink */
 static const struct verbs_match_ent *
-match_driver_id(const struct verbs_device_ops *ops,
+match_driver_id(const struct verbs_match_ent *table,
 		struct verbs_sysfs_dev *sysfs_dev)
 {
 	const struct verbs_match_ent *i;
@@ -326,25 +328,37 @@ match_driver_id(const struct verbs_device_ops *ops,
 	if (sysfs_dev->driver_id == RDMA_DRIVER_UNKNOWN)
 		return NULL;
 
-	for (i = ops->match_table; i->kind != VERBS_MATCH_SENTINEL; i++)
+	for (i = table; i->kind != VERBS_MATCH_SENTINEL; i++)
 		if (i->kind == VERBS_MATCH_DRIVER_ID &&
 		    i->u.driver_id == sysfs_dev->driver_id)
 			return i;
 	return NULL;
 }
 
+/*
+ * Search a match table for sysfs_dev. This is also used for the match index
+ * in the driver config files, so that it selects the same provider.
+ */
+const struct verbs_match_ent *
+match_sysfs_dev(const struct verbs_match_ent *table,
+		struct verbs_sysfs_dev *sysfs_dev)
+{
+	const struct verbs_match_ent *ent;
+
+	ent = match_driver_id(table, sysfs_dev);
+	if (!ent)
+		ent = match_name(table, sysfs_dev);
+	if (!ent)
+		ent = match_modalias_device(table, sysfs_dev);
+	return ent;
+}
+
 /* True if the provider matches the selected rdma sysfs device */
 static bool match_device(const struct verbs_device_ops *ops,
 			 struct verbs_sysfs_dev *sysfs_dev)
 {
-	if (ops->match_table) {
-		sysfs_dev->match = match_driver_id(ops, sysfs_dev);
-		if (!sysfs_dev->match)
-			sysfs_dev->match = match_name(ops, sysfs_dev);
-		if (!sysfs_dev->match)
-			sysfs_dev->match =
-			    match_modalias_device(ops, sysfs_dev);
-	}
+	if (ops->match_table)
+		sysfs_dev->match = match_sysfs_dev(ops->match_table, sysfs_dev);
 
 	if (ops->match_device) {
 		/* If a matching function is provided then it is called
@@ -447,7 +461,9 @@ static struct verbs_device *try_drivers(struct verbs_sysfs_dev *sysfs_dev)
 	 */
 	if (sysfs_dev->driver_id != RDMA_DRIVER_UNKNOWN) {
 		list_for_each (&driver_list, driver, entry) {
-			if (match_driver_id(driver->ops, sysfs_dev)) {
+			if (driver->ops->match_table &&
+			    match_driver_id(driver->ops->match_table,
+					    sysfs_dev)) {
 				dev = try_driver(driver->ops, sysfs_dev);
 				if (dev)
 					return dev;
@@ -548,6 +564,94 @@ static void try_all_drivers(struct list_head *sysfs_list,
 	}
 }
 
+/*
+ * With RDMAV_DEVICE_CACHE set, the device list is only scanned again after
+ * the kernel reports that an RDMA device has changed.  Changes are reported
+ * through kobject uevents for the infiniband and infiniband_verbs classes.
+ */
+static bool device_cache;
+static bool device_list_valid;
+static int uevent_fd = -1;
+static pid_t uevent_pid;
+
+/*
+ * The kernel only sends kobject uevents to network namespaces owned by the
+ * initial user namespace.  Elsewhere, such as in a rootless container, the
+ * uevent socket binds but never receives anything, so the cache cannot be
+ * used.  The initial user namespace maps the full range of uids.
+ */
+static bool in_initial_user_ns(void)
+{
+	unsigned int inside, outside, count;
+	bool ret;
+	FILE *f;
+
+	f = fopen("/proc/self/uid_map", "re");
+	if (!f)
+		return false;
+
+	ret = fscanf(f, "%u %u %u", &inside, &outside, &count) == 3 &&
+	      inside == 0 && outside == 0 && count == UINT32_MAX;
+	fclose(f);
+	return ret;
+}
+
+static void open_uevent_monitor(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1,
+	};
+
+	if (uevent_fd >= 0)
+		close(uevent_fd);
+
+	uevent_pid = getpid();
+	uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			   NETLINK_KOBJECT_UEVENT);
+	if (uevent_fd < 0)
+		return;
+
+	if (bind(uevent_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(uevent_fd);
+		uevent_fd = -1;
+	}
+}
+
+/* Returns true if no RDMA device has changed since the last scan. */
+static bool devices_unchanged(void)
+{
+	char buf[4096];
+	bool changed = false;
+	ssize_t len;
+	char *p;
+
+	/* The socket is shared with the parent after fork */
+	if (uevent_fd < 0 || uevent_pid != getpid())
+		return false;
+
+	while (1) {
+		len = recv(uevent_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			/* ENOBUFS means that events were lost */
+			if (errno != EAGAIN)
+				changed = true;
+			break;
+		}
+
+		buf[len] = 0;
+		for (p = buf; p < buf + len; p += strlen(p) + 1) {
+			if (!strcmp(p, "SUBSYSTEM=infiniband") ||
+			    !strcmp(p, "SUBSYSTEM=infiniband_verbs"))
+				changed = true;
+		}
+	}
+
+	return !changed;
+}
+
 int ibverbs_get_device_list(struct list_head *device_list)
 {
 	LIST_HEAD(sysfs_list);
@@ -557,6 +661,19 @@ int ibverbs_get_device_list(struct list_head *device_list)
 	unsigned int num_devices = 0;
 	int ret;
 
+	if (device_cache) {
+		if (device_list_valid && devices_unchanged()) {
+			list_for_each(device_list, vdev, entry)
+				num_devices++;
+			return num_devices;
+		}
+
+		/* Listen before scanning, so that no change is missed */
+		device_list_valid = false;
+		if (uevent_fd < 0 || uevent_pid != getpid())
+			open_uevent_monitor();
+	}
+
 	ret = find_sysfs_devs_nl(&sysfs_list);
 	if (ret) {
 		ret = find_sysfs_devs(&sysfs_list);
@@ -599,6 +716,16 @@ int ibverbs_get_device_list(struct list_head *device_list)
 	if (list_empty(&sysfs_list) || drivers_loaded)
 		goto out;
 
+	/*
+	 * Try the providers indexed for the remaining devices first, and only
+	 * load every provider if that leaves a device without a driver.
+	 */
+	if (load_matching_drivers(&sysfs_list)) {
+		try_all_drivers(&sysfs_list, device_list, &num_devices);
+		if (list_empty(&sysfs_list))
+			goto out;
+	}
+
 	load_drivers();
 	drivers_loaded = 1;
 
@@ -617,6 +744,7 @@ out:
 		free(sysfs_dev);
 	}
 
+	device_list_valid = device_cache && uevent_fd >= 0;
 	return num_devices;
 }
 
@@ -670,6 +798,8 @@ int ibverbs_init(void)
 			fprintf(stderr, PFX "Warning: fork()-safety requested "
 				"but init failed\n");
 
+	device_cache = check_env("RDMAV_DEVICE_CACHE") && in_initial_user_ns();
+
 	verbs_allow_disassociate_destroy = check_env("RDMAV_ALLOW_DISASSOC_DESTROY")
 		/* Backward compatibility for the mlx4 driver env */
 		|| check_env("MLX4_DEVICE_FATAL_CLEANUP");
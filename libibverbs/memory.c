@@ -47,19 +47,31 @@
 #include "ibverbs.h"
 #include "util/rdma_nl.h"
 
-struct ibv_mem_node {
-	enum {
-		IBV_RED,
-		IBV_BLACK
-	}			color;
-	struct ibv_mem_node    *parent;
-	struct ibv_mem_node    *left, *right;
-	uintptr_t		start, end;
-	int			refcnt;
+/*
+ * Fork ranges are tracked with a reference count for each page.  The counts
+ * are kept in segments of MM_SEG_SIZE bytes, which are found through a
+ * hash table and have their own lock, so that registrations of unrelated
+ * memory do not serialize.  A range holds the locks of all of its segments,
+ * taken in address order, while its pages are updated and madvise() is
+ * called on the pages whose count becomes or leaves zero.
+ */
+#define MM_SEG_SHIFT	21
+#define MM_SEG_SIZE	(1UL << MM_SEG_SHIFT)
+#define MM_BUCKETS	1024
+
+struct ibv_mem_seg {
+	struct ibv_mem_seg     *next;
+	uintptr_t		index;
+	pthread_mutex_t		mutex;
+	uint32_t		refcnt[];
+};
+
+struct ibv_mem_bucket {
+	pthread_mutex_t		mutex;
+	struct ibv_mem_seg     *head;
 };
 
-static struct ibv_mem_node *mm_root;
-static pthread_mutex_t mm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ibv_mem_bucket *mm_buckets;
 static int page_size;
 static int huge_page_enabled;
 static int too_late;
@@ -124,14 +136,15 @@ out:
 
 int ibv_fork_init(void)
 {
+	struct ibv_mem_bucket *buckets;
 	void *tmp, *tmp_aligned;
-	int ret;
+	int i, ret;
 	unsigned long size;
 
 	if (getenv("RDMAV_HUGEPAGES_SAFE"))
 		huge_page_enabled = 1;
 
-	if (mm_root)
+	if (mm_buckets)
 		return 0;
 
 	if (too_late)
@@ -160,17 +173,13 @@ int ibv_fork_init(void)
 	if (ret)
 		return ENOSYS;
 
-	mm_root = malloc(sizeof *mm_root);
-	if (!mm_root)
+	buckets = calloc(MM_BUCKETS, sizeof(*buckets));
+	if (!buckets)
 		return ENOMEM;
 
-	mm_root->parent = NULL;
-	mm_root->left   = NULL;
-	mm_root->right  = NULL;
-	mm_root->color  = IBV_BLACK;
-	mm_root->start  = 0;
-	mm_root->end    = UINTPTR_MAX;
-	mm_root->refcnt = 0;
+	for (i = 0; i < MM_BUCKETS; i++)
+		pthread_mutex_init(&buckets[i].mutex, NULL);
+	mm_buckets = buckets;
 
 	return 0;
 }
@@ -180,420 +189,44 @@ enum ibv_fork_status ibv_is_fork_initialized(void)
 	if (get_copy_on_fork())
 		return IBV_FORK_UNNEEDED;
 
-	return mm_root ? IBV_FORK_ENABLED : IBV_FORK_DISABLED;
-}
-
-static struct ibv_mem_node *__mm_prev(struct ibv_mem_node *node)
-{
-	if (node->left) {
-		node = node->left;
-		while (node->right)
-			node = node->right;
-	} else {
-		while (node->parent && node == node->parent->left)
-			node = node->parent;
-
-		node = node->parent;
-	}
-
-	return node;
-}
-
-static struct ibv_mem_node *__mm_next(struct ibv_mem_node *node)
-{
-	if (node->right) {
-		node = node->right;
-		while (node->left)
-			node = node->left;
-	} else {
-		while (node->parent && node == node->parent->right)
-			node = node->parent;
-
-		node = node->parent;
-	}
-
-	return node;
-}
-
-static void __mm_rotate_right(struct ibv_mem_node *node)
-{
-	struct ibv_mem_node *tmp;
-
-	tmp = node->left;
-
-	node->left = tmp->right;
-	if (node->left)
-		node->left->parent = node;
-
-	if (node->parent) {
-		if (node->parent->right == node)
-			node->parent->right = tmp;
-		else
-			node->parent->left = tmp;
-	} else
-		mm_root = tmp;
-
-	tmp->parent = node->parent;
-
-	tmp->right = node;
-	node->parent = tmp;
-}
-
-static void __mm_rotate_left(struct ibv_mem_node *node)
-{
-	struct ibv_mem_node *tmp;
-
-	tmp = node->right;
-
-	node->right = tmp->left;
-	if (node->right)
-		node->right->parent = node;
-
-	if (node->parent) {
-		if (node->parent->right == node)
-			node->parent->right = tmp;
-		else
-			node->parent->left = tmp;
-	} else
-		mm_root = tmp;
-
-	tmp->parent = node->parent;
-
-	tmp->left = node;
-	node->parent = tmp;
-}
-
-#if 0
-static int verify(struct ibv_mem_node *node)
-{
-	int hl, hr;
-
-	if (!node)
-		return 1;
-
-	hl = verify(node->left);
-	hr = verify(node->left);
-
-	if (!hl || !hr)
-		return 0;
-	if (hl != hr)
-		return 0;
-
-	if (node->color == IBV_RED) {
-		if (node->left && node->left->color != IBV_BLACK)
-			return 0;
-		if (node->right && node->right->color != IBV_BLACK)
-			return 0;
-		return hl;
-	}
-
-	return hl + 1;
-}
-#endif
-
-static void __mm_add_rebalance(struct ibv_mem_node *node)
-{
-	struct ibv_mem_node *parent, *gp, *uncle;
-
-	while (node->parent && node->parent->color == IBV_RED) {
-		parent = node->parent;
-		gp     = node->parent->parent;
-
-		if (parent == gp->left) {
-			uncle = gp->right;
-
-			if (uncle && uncle->color == IBV_RED) {
-				parent->color = IBV_BLACK;
-				uncle->color  = IBV_BLACK;
-				gp->color     = IBV_RED;
-
-				node = gp;
-			} else {
-				if (node == parent->right) {
-					__mm_rotate_left(parent);
-					node   = parent;
-					parent = node->parent;
-				}
-
-				parent->color = IBV_BLACK;
-				gp->color     = IBV_RED;
-
-				__mm_rotate_right(gp);
-			}
-		} else {
-			uncle = gp->left;
-
-			if (uncle && uncle->color == IBV_RED) {
-				parent->color = IBV_BLACK;
-				uncle->color  = IBV_BLACK;
-				gp->color     = IBV_RED;
-
-				node = gp;
-			} else {
-				if (node == parent->left) {
-					__mm_rotate_right(parent);
-					node   = parent;
-					parent = node->parent;
-				}
-
-				parent->color = IBV_BLACK;
-				gp->color     = IBV_RED;
-
-				__mm_rotate_left(gp);
-			}
-		}
-	}
-
-	mm_root->color = IBV_BLACK;
-}
-
-static void __mm_add(struct ibv_mem_node *new)
-{
-	struct ibv_mem_node *node, *parent = NULL;
-
-	node = mm_root;
-	while (node) {
-		parent = node;
-		if (node->start < new->start)
-			node = node->right;
-		else
-			node = node->left;
-	}
-
-	if (parent->start < new->start)
-		parent->right = new;
-	else
-		parent->left = new;
-
-	new->parent = parent;
-	new->left   = NULL;
-	new->right  = NULL;
-
-	new->color = IBV_RED;
-	__mm_add_rebalance(new);
+	return mm_buckets ? IBV_FORK_ENABLED : IBV_FORK_DISABLED;
 }
 
-static void __mm_remove(struct ibv_mem_node *node)
+static struct ibv_mem_seg *mm_get_seg(uintptr_t index, bool create)
 {
-	struct ibv_mem_node *child, *parent, *sib, *tmp;
-	int nodecol;
-
-	if (node->left && node->right) {
-		tmp = node->left;
-		while (tmp->right)
-			tmp = tmp->right;
-
-		nodecol    = tmp->color;
-		child      = tmp->left;
-		tmp->color = node->color;
-
-		if (tmp->parent != node) {
-			parent        = tmp->parent;
-			parent->right = tmp->left;
-			if (tmp->left)
-				tmp->left->parent = parent;
-
-			tmp->left   	   = node->left;
-			node->left->parent = tmp;
-		} else
-			parent = tmp;
-
-		tmp->right          = node->right;
-		node->right->parent = tmp;
-
-		tmp->parent = node->parent;
-		if (node->parent) {
-			if (node->parent->left == node)
-				node->parent->left = tmp;
-			else
-				node->parent->right = tmp;
-		} else
-			mm_root = tmp;
-	} else {
-		nodecol = node->color;
-
-		child  = node->left ? node->left : node->right;
-		parent = node->parent;
-
-		if (child)
-			child->parent = parent;
-		if (parent) {
-			if (parent->left == node)
-				parent->left = child;
-			else
-				parent->right = child;
-		} else
-			mm_root = child;
-	}
-
-	free(node);
-
-	if (nodecol == IBV_RED)
-		return;
-
-	while ((!child || child->color == IBV_BLACK) && child != mm_root) {
-		if (parent->left == child) {
-			sib = parent->right;
-
-			if (sib->color == IBV_RED) {
-				parent->color = IBV_RED;
-				sib->color    = IBV_BLACK;
-				__mm_rotate_left(parent);
-				sib = parent->right;
-			}
-
-			if ((!sib->left  || sib->left->color  == IBV_BLACK) &&
-			    (!sib->right || sib->right->color == IBV_BLACK)) {
-				sib->color = IBV_RED;
-				child  = parent;
-				parent = child->parent;
-			} else {
-				if (!sib->right || sib->right->color == IBV_BLACK) {
-					if (sib->left)
-						sib->left->color = IBV_BLACK;
-					sib->color = IBV_RED;
-					__mm_rotate_right(sib);
-					sib = parent->right;
-				}
-
-				sib->color    = parent->color;
-				parent->color = IBV_BLACK;
-				if (sib->right)
-					sib->right->color = IBV_BLACK;
-				__mm_rotate_left(parent);
-				child = mm_root;
-				break;
-			}
-		} else {
-			sib = parent->left;
-
-			if (sib->color == IBV_RED) {
-				parent->color = IBV_RED;
-				sib->color    = IBV_BLACK;
-				__mm_rotate_right(parent);
-				sib = parent->left;
-			}
-
-			if ((!sib->left  || sib->left->color  == IBV_BLACK) &&
-			    (!sib->right || sib->right->color == IBV_BLACK)) {
-				sib->color = IBV_RED;
-				child  = parent;
-				parent = child->parent;
-			} else {
-				if (!sib->left || sib->left->color == IBV_BLACK) {
-					if (sib->right)
-						sib->right->color = IBV_BLACK;
-					sib->color = IBV_RED;
-					__mm_rotate_left(sib);
-					sib = parent->left;
-				}
-
-				sib->color    = parent->color;
-				parent->color = IBV_BLACK;
-				if (sib->left)
-					sib->left->color = IBV_BLACK;
-				__mm_rotate_right(parent);
-				child = mm_root;
-				break;
-			}
-		}
-	}
+	struct ibv_mem_bucket *bucket = &mm_buckets[index % MM_BUCKETS];
+	struct ibv_mem_seg *seg;
 
-	if (child)
-		child->color = IBV_BLACK;
-}
-
-static struct ibv_mem_node *__mm_find_start(uintptr_t start, uintptr_t end)
-{
-	struct ibv_mem_node *node = mm_root;
-
-	while (node) {
-		if (node->start <= start && node->end >= start)
+	pthread_mutex_lock(&bucket->mutex);
+	for (seg = bucket->head; seg; seg = seg->next)
+		if (seg->index == index)
 			break;
 
-		if (node->start < start)
-			node = node->right;
-		else
-			node = node->left;
+	if (!seg && create) {
+		seg = calloc(1, sizeof(*seg) +
+			     MM_SEG_SIZE / page_size * sizeof(seg->refcnt[0]));
+		if (seg) {
+			seg->index = index;
+			pthread_mutex_init(&seg->mutex, NULL);
+			seg->next = bucket->head;
+			bucket->head = seg;
+		}
 	}
+	pthread_mutex_unlock(&bucket->mutex);
 
-	return node;
+	return seg;
 }
 
-static struct ibv_mem_node *merge_ranges(struct ibv_mem_node *node,
-					 struct ibv_mem_node *prev)
+static void mm_unlock_segs(uintptr_t first, uintptr_t last)
 {
-	prev->end = node->end;
-	prev->refcnt = node->refcnt;
-	__mm_remove(node);
-
-	return prev;
-}
-
-static struct ibv_mem_node *split_range(struct ibv_mem_node *node,
-					uintptr_t cut_line)
-{
-	struct ibv_mem_node *new_node = NULL;
-
-	new_node = malloc(sizeof *new_node);
-	if (!new_node)
-		return NULL;
-	new_node->start  = cut_line;
-	new_node->end    = node->end;
-	new_node->refcnt = node->refcnt;
-	node->end  = cut_line - 1;
-	__mm_add(new_node);
-
-	return new_node;
-}
-
-static struct ibv_mem_node *get_start_node(uintptr_t start, uintptr_t end,
-					   int inc)
-{
-	struct ibv_mem_node *node, *tmp = NULL;
-
-	node = __mm_find_start(start, end);
-	if (node->start < start)
-		node = split_range(node, start);
-	else {
-		tmp = __mm_prev(node);
-		if (tmp && tmp->refcnt == node->refcnt + inc)
-			node = merge_ranges(node, tmp);
-	}
-	return node;
-}
+	struct ibv_mem_seg *seg;
+	uintptr_t index;
 
-/*
- * This function is called if madvise() fails to undo merging/splitting
- * operations performed on the node.
- */
-static struct ibv_mem_node *undo_node(struct ibv_mem_node *node,
-				      uintptr_t start, int inc)
-{
-	struct ibv_mem_node *tmp = NULL;
-
-	/*
-	 * This condition can be true only if we merged this
-	 * node with the previous one, so we need to split them.
-	*/
-	if (start > node->start) {
-		tmp = split_range(node, start);
-		if (tmp) {
-			node->refcnt += inc;
-			node = tmp;
-		} else
-			return NULL;
+	for (index = first; index <= last; index++) {
+		seg = mm_get_seg(index, false);
+		if (seg)
+			pthread_mutex_unlock(&seg->mutex);
 	}
-
-	tmp  =  __mm_prev(node);
-	if (tmp && tmp->refcnt == node->refcnt)
-		node = merge_ranges(node, tmp);
-
-	tmp  =  __mm_next(node);
-	if (tmp && tmp->refcnt == node->refcnt)
-		node = merge_ranges(tmp, node);
-
-	return node;
 }
 
 static int do_madvise(void *addr, size_t length, int advice,
@@ -618,12 +251,59 @@ static int do_madvise(void *addr, size_t length, int advice,
 	return 0;
 }
 
+/*
+ * Adds inc to the count of each page in [start, end), and applies advice to
+ * the pages whose count leaves or reaches zero, coalescing adjacent pages
+ * into a single call.  If madvise() fails, [*fail_start, *fail_end) is set
+ * to the pages that it failed on, and pages after them are left untouched.
+ */
+static int mm_update_range(uintptr_t start, uintptr_t end, int inc, int advice,
+			   unsigned long range_page_size,
+			   uintptr_t *fail_start, uintptr_t *fail_end)
+{
+	struct ibv_mem_seg *seg = NULL;
+	uintptr_t addr, index, run = end;
+	uint32_t *cnt;
+
+	for (addr = start; addr < end; addr += page_size) {
+		index = addr >> MM_SEG_SHIFT;
+		if (!seg || seg->index != index)
+			seg = mm_get_seg(index, false);
+		cnt = seg ? &seg->refcnt[(addr & (MM_SEG_SIZE - 1)) / page_size] :
+			    NULL;
+
+		if (cnt && *cnt == (inc > 0 ? 0 : 1)) {
+			if (run == end)
+				run = addr;
+		} else if (run != end) {
+			if (advice &&
+			    do_madvise((void *) run, addr - run, advice,
+				       range_page_size))
+				goto err;
+			run = end;
+		}
+
+		if (cnt && (inc > 0 || *cnt))
+			*cnt += inc;
+	}
+
+	if (run != end && advice &&
+	    do_madvise((void *) run, end - run, advice, range_page_size))
+		goto err;
+
+	return 0;
+
+err:
+	*fail_start = run;
+	*fail_end = addr;
+	return -1;
+}
+
 static int ibv_madvise_range(void *base, size_t size, int advice)
 {
-	uintptr_t start, end;
-	struct ibv_mem_node *node, *tmp;
+	uintptr_t start, end, first, last, index, fail_start, fail_end;
+	struct ibv_mem_seg *seg;
 	int inc;
-	int rolling_back = 0;
 	int ret = 0;
 	unsigned long range_page_size;
 
@@ -636,85 +316,44 @@ static int ibv_madvise_range(void *base, size_t size, int advice)
 		range_page_size = page_size;
 
 	start = (uintptr_t) base & ~(range_page_size - 1);
-	end   = ((uintptr_t) (base + size + range_page_size - 1) &
-		 ~(range_page_size - 1)) - 1;
-
-	pthread_mutex_lock(&mm_mutex);
-again:
+	end   = (uintptr_t) (base + size + range_page_size - 1) &
+		~(range_page_size - 1);
 	inc = advice == MADV_DONTFORK ? 1 : -1;
 
-	node = get_start_node(start, end, inc);
-	if (!node) {
-		ret = -1;
-		goto out;
-	}
-
-	while (node && node->start <= end) {
-		if (node->end > end) {
-			if (!split_range(node, end + 1)) {
-				ret = -1;
-				goto out;
-			}
-		}
-
-		if ((inc == -1 && node->refcnt == 1) ||
-		    (inc ==  1 && node->refcnt == 0)) {
-			/*
-			 * If this is the first time through the loop,
-			 * and we merged this node with the previous
-			 * one, then we only want to do the madvise()
-			 * on start ... node->end (rather than
-			 * starting at node->start).
-			 *
-			 * Otherwise we end up doing madvise() on
-			 * bigger region than we're being asked to,
-			 * and that may lead to a spurious failure.
-			 */
-			if (start > node->start)
-				ret = do_madvise((void *) start,
-						 node->end - start + 1,
-						 advice, range_page_size);
-			else
-				ret = do_madvise((void *) node->start,
-						 node->end - node->start + 1,
-						 advice, range_page_size);
-			if (ret) {
-				node = undo_node(node, start, inc);
-
-				if (rolling_back || !node)
-					goto out;
-
-				/* madvise failed, roll back previous changes */
-				rolling_back = 1;
-				advice = advice == MADV_DONTFORK ?
-					MADV_DOFORK : MADV_DONTFORK;
-				end = node->end;
-				goto again;
-			}
+	first = start >> MM_SEG_SHIFT;
+	last  = (end - 1) >> MM_SEG_SHIFT;
+	for (index = first; index <= last; index++) {
+		/* Pages of missing segments are not forked anyway */
+		seg = mm_get_seg(index, inc > 0);
+		if (!seg && inc > 0) {
+			if (index > first)
+				mm_unlock_segs(first, index - 1);
+			return -1;
 		}
-
-		node->refcnt += inc;
-		node = __mm_next(node);
+		if (seg)
+			pthread_mutex_lock(&seg->mutex);
 	}
 
-	if (node) {
-		tmp = __mm_prev(node);
-		if (tmp && node->refcnt == tmp->refcnt)
-			node = merge_ranges(node, tmp);
+	ret = mm_update_range(start, end, inc, advice, range_page_size,
+			      &fail_start, &fail_end);
+	if (ret) {
+		/* madvise failed, roll back previous changes */
+		mm_update_range(fail_start, fail_end, -inc, 0, range_page_size,
+				&fail_start, &fail_end);
+		mm_update_range(start, fail_start, -inc,
+				advice == MADV_DONTFORK ?
+				MADV_DOFORK : MADV_DONTFORK,
+				range_page_size, &fail_start, &fail_end);
 	}
 
-out:
-	if (rolling_back)
-		ret = -1;
-
-	pthread_mutex_unlock(&mm_mutex);
+	mm_unlock_segs(first, last);
 
 	return ret;
 }
 
 int ibv_dontfork_range(void *base, size_t size)
 {
-	if (mm_root)
+	if (mm_buckets)
 		return ibv_madvise_range(base, size, MADV_DONTFORK);
 	else {
 		too_late = 1;
@@ -724,7 +363,7 @@ int ibv_dontfork_range(void *base, size_t size)
 
 int ibv_dofork_range(void *base, size_t size)
 {
-	if (mm_root)
+	if (mm_buckets)
 		return ibv_madvise_range(base, size, MADV_DOFORK);
 	else {
 		too_late = 1;
@@ -0,0 +1,535 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+#include <ccan/list.h>
+#include <ccan/minmax.h>
+#include <util/cl_qmap.h>
+
+#include "ibverbs.h"
+
+/*
+ * Memory registration cache.
+ *
+ * When enabled through RDMAV_MR_CACHE, MRs released by ibv_dereg_mr are kept
+ * registered, and a later ibv_reg_mr of a range that lies within a cached MR
+ * with the same PD and access flags returns that MR instead of registering
+ * the memory again.  Unused MRs are kept on an LRU list and deregistered once
+ * the memory pinned by the cache exceeds RDMAV_MR_CACHE_SIZE bytes.
+ *
+ * Cached memory is registered with a userfaultfd, which reports munmap,
+ * mremap and madvise(MADV_DONTNEED) of the range.  A monitor thread reads
+ * these events and drops the affected MRs from the cache.  Pages are
+ * unregistered again once no cached MR covers them.  The userfaultfd must
+ * be able to handle faults taken by the kernel, so the cache is disabled
+ * if only a user mode fd is available.  The kernel holds
+ * the unmapping thread until the event has been read, and lookups wait while
+ * the monitor has read events that it has not yet applied, so a lookup that
+ * follows an unmap never returns an MR for the old pages.
+ *
+ * The monitor never deregisters MRs itself: freeing memory from that thread
+ * could unmap a registered range and wait on its own event.  Dropped MRs are
+ * deregistered by the next thread to use the cache, outside of the lock.
+ */
+
+#define MR_CACHE_DEFAULT_SIZE	(1ULL << 30)
+#define MR_CACHE_EVENTS		16
+
+struct mr_cache_entry {
+	cl_map_item_t		addr_item;	/* by start address, if indexed */
+	cl_map_item_t		mr_item;	/* by ibv_mr pointer */
+	struct list_node	lru;		/* lru_list or zombie_list */
+	struct ibv_mr		*mr;
+	uintptr_t		start;
+	uintptr_t		end;
+	size_t			pinned;
+	unsigned int		access;
+	int			refcnt;
+	bool			indexed;
+};
+
+static pthread_once_t mr_cache_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t mr_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool mr_cache_on;
+static int mr_cache_fd = -1;
+static long page_size;
+static size_t cache_budget;
+static size_t cache_pinned;
+static uintptr_t max_len;
+static unsigned int events_seq;
+static _Atomic(int) events_pending;
+static cl_qmap_t addr_map;
+static cl_qmap_t mr_map;
+static LIST_HEAD(lru_list);
+static LIST_HEAD(zombie_list);
+
+static uintptr_t page_start(uintptr_t addr)
+{
+	return addr & ~(page_size - 1);
+}
+
+static uintptr_t page_end(uintptr_t addr)
+{
+	return (addr + page_size - 1) & ~(page_size - 1);
+}
+
+static struct mr_cache_entry *addr_entry(cl_map_item_t *item)
+{
+	if (item == cl_qmap_end(&addr_map))
+		return NULL;
+	return container_of(item, struct mr_cache_entry, addr_item);
+}
+
+/* Returns the indexed entry with the highest start address below addr. */
+static struct mr_cache_entry *mr_cache_below(uintptr_t addr)
+{
+	return addr_entry(cl_qmap_prev(cl_qmap_get_next(&addr_map, addr - 1)));
+}
+
+/*
+ * Unregisters the pages in [start, end) from the userfaultfd, except those
+ * still covered by an indexed entry.  Indexed entries are visited in order
+ * of their start address, and the gaps between them are unregistered.
+ */
+static void mr_cache_unregister(uintptr_t start, uintptr_t end)
+{
+	struct mr_cache_entry *ent;
+	struct uffdio_range range;
+	uintptr_t pos = page_start(start);
+
+	end = page_end(end);
+	for (ent = addr_entry(cl_qmap_get_next(&addr_map,
+					       pos > max_len ? pos - max_len : 0));
+	     ent && pos < end && ent->start < end;
+	     ent = addr_entry(cl_qmap_next(&ent->addr_item))) {
+		if (page_end(ent->end) <= pos)
+			continue;
+
+		if (page_start(ent->start) > pos) {
+			range.start = pos;
+			range.len = page_start(ent->start) - pos;
+			ioctl(mr_cache_fd, UFFDIO_UNREGISTER, &range);
+		}
+		pos = page_end(ent->end);
+	}
+
+	if (pos < end) {
+		range.start = pos;
+		range.len = end - pos;
+		ioctl(mr_cache_fd, UFFDIO_UNREGISTER, &range);
+	}
+}
+
+/* An entry that is no longer indexed is deregistered once unused. */
+static void mr_cache_unindex(struct mr_cache_entry *ent)
+{
+	cl_qmap_remove_item(&addr_map, &ent->addr_item);
+	ent->indexed = false;
+	mr_cache_unregister(ent->start, ent->end);
+	if (cl_is_qmap_empty(&addr_map))
+		max_len = 0;
+}
+
+static void mr_cache_drop(struct mr_cache_entry *ent)
+{
+	cl_qmap_remove_item(&mr_map, &ent->mr_item);
+	cache_pinned -= ent->pinned;
+	list_add_tail(&zombie_list, &ent->lru);
+}
+
+static void mr_cache_evict(struct mr_cache_entry *ent)
+{
+	mr_cache_unindex(ent);
+	list_del(&ent->lru);
+	mr_cache_drop(ent);
+}
+
+static void mr_cache_invalidate(uintptr_t start, uintptr_t end)
+{
+	struct mr_cache_entry *ent, *prev;
+
+	for (ent = mr_cache_below(end); ent; ent = prev) {
+		if (ent->start + max_len <= start)
+			break;
+
+		prev = addr_entry(cl_qmap_prev(&ent->addr_item));
+		if (ent->end <= start)
+			continue;
+
+		if (ent->refcnt)
+			mr_cache_unindex(ent);
+		else
+			mr_cache_evict(ent);
+	}
+}
+
+static struct mr_cache_entry *mr_cache_find(struct ibv_pd *pd, uintptr_t start,
+					    uintptr_t end, unsigned int access)
+{
+	struct mr_cache_entry *ent;
+
+	for (ent = mr_cache_below(start + 1); ent;
+	     ent = addr_entry(cl_qmap_prev(&ent->addr_item))) {
+		if (ent->start + max_len < end)
+			break;
+
+		if (ent->end >= end && ent->mr->pd == pd &&
+		    ent->access == access)
+			return ent;
+	}
+	return NULL;
+}
+
+/*
+ * Waits for the monitor to apply any events that it has read, so that the
+ * unmapping threads that it has released cannot find stale MRs.
+ */
+static void mr_cache_lock(void)
+{
+	pthread_mutex_lock(&mr_cache_mutex);
+	while (atomic_load(&events_pending)) {
+		pthread_mutex_unlock(&mr_cache_mutex);
+		sched_yield();
+		pthread_mutex_lock(&mr_cache_mutex);
+	}
+}
+
+static void mr_cache_unlock(void)
+{
+	struct mr_cache_entry *ent, *tmp;
+	LIST_HEAD(zombies);
+
+	list_append_list(&zombies, &zombie_list);
+	pthread_mutex_unlock(&mr_cache_mutex);
+
+	list_for_each_safe(&zombies, ent, tmp, lru) {
+		__ibv_dereg_mr(ent->mr);
+		free(ent);
+	}
+}
+
+static bool mr_cache_insert(struct mr_cache_entry *ent)
+{
+	struct mr_cache_entry *old;
+
+	old = addr_entry(cl_qmap_get(&addr_map, ent->start));
+	if (old) {
+		if (old->refcnt)
+			return false;
+		mr_cache_evict(old);
+	}
+
+	while (cache_pinned + ent->pinned > cache_budget &&
+	       !list_empty(&lru_list))
+		mr_cache_evict(list_top(&lru_list, struct mr_cache_entry, lru));
+	if (cache_pinned + ent->pinned > cache_budget)
+		return false;
+
+	cl_qmap_insert(&addr_map, ent->start, &ent->addr_item);
+	cl_qmap_insert(&mr_map, (uintptr_t)ent->mr, &ent->mr_item);
+	ent->indexed = true;
+	ent->refcnt = 1;
+	cache_pinned += ent->pinned;
+	max_len = max(max_len, ent->end - ent->start);
+	return true;
+}
+
+/*
+ * Pages of a cached range only go missing after an unmap or remove event,
+ * which has already invalidated the cache, so the fault is resolved by
+ * dropping the registration.  Hugetlb mappings must be unregistered in
+ * units of their page size.
+ */
+static void mr_cache_fault(uintptr_t addr)
+{
+	struct uffdio_range range;
+	uint64_t size;
+
+	for (size = page_size; size <= (1ULL << 30); size <<= 9) {
+		range.start = addr & ~(size - 1);
+		range.len = size;
+		if (!ioctl(mr_cache_fd, UFFDIO_UNREGISTER, &range))
+			break;
+	}
+	ioctl(mr_cache_fd, UFFDIO_WAKE, &range);
+}
+
+static void mr_cache_event(struct uffd_msg *msg)
+{
+	uintptr_t start, end;
+
+	switch (msg->event) {
+	case UFFD_EVENT_PAGEFAULT:
+		mr_cache_fault(msg->arg.pagefault.address);
+		return;
+	case UFFD_EVENT_REMAP:
+		start = msg->arg.remap.from;
+		end = start + msg->arg.remap.len;
+		break;
+	case UFFD_EVENT_REMOVE:
+	case UFFD_EVENT_UNMAP:
+		start = msg->arg.remove.start;
+		end = msg->arg.remove.end;
+		break;
+	default:
+		return;
+	}
+
+	/*
+	 * Invalidated entries unregister their pages, so removed pages fault
+	 * back in without involving the monitor.  The registration moves with
+	 * a remapped range, which is no longer cached at its new address.
+	 */
+	pthread_mutex_lock(&mr_cache_mutex);
+	events_seq++;
+	mr_cache_invalidate(start, end);
+	if (msg->event == UFFD_EVENT_REMAP)
+		mr_cache_unregister(msg->arg.remap.to,
+				    msg->arg.remap.to + msg->arg.remap.len);
+	pthread_mutex_unlock(&mr_cache_mutex);
+}
+
+static void *mr_cache_monitor(void *arg)
+{
+	struct pollfd fds = { .fd = mr_cache_fd, .events = POLLIN };
+	struct uffd_msg msg[MR_CACHE_EVENTS];
+	ssize_t len;
+	int i, n;
+
+	while (1) {
+		if (poll(&fds, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		atomic_fetch_add(&events_pending, 1);
+		while ((len = read(mr_cache_fd, msg, sizeof(msg))) > 0) {
+			n = len / sizeof(msg[0]);
+			for (i = 0; i < n; i++)
+				mr_cache_event(&msg[i]);
+		}
+		atomic_fetch_sub(&events_pending, 1);
+	}
+	return NULL;
+}
+
+static void mr_cache_atfork_prepare(void)
+{
+	pthread_mutex_lock(&mr_cache_mutex);
+}
+
+static void mr_cache_atfork_parent(void)
+{
+	pthread_mutex_unlock(&mr_cache_mutex);
+}
+
+/* The child has no monitor, and its mappings are not registered. */
+static void mr_cache_atfork_child(void)
+{
+	mr_cache_on = false;
+	pthread_mutex_unlock(&mr_cache_mutex);
+}
+
+static void mr_cache_init(void)
+{
+	struct uffdio_api api = {
+		.api = UFFD_API,
+		.features = UFFD_FEATURE_EVENT_REMAP |
+			    UFFD_FEATURE_EVENT_REMOVE |
+			    UFFD_FEATURE_EVENT_UNMAP,
+	};
+	sigset_t set, old_set;
+	struct rlimit rlim;
+	pthread_t thread;
+	int fd, ret;
+	char *env;
+
+	env = getenv("RDMAV_MR_CACHE");
+	if (!env || !atoi(env))
+		return;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if (page_size < 0)
+		return;
+
+	cache_budget = MR_CACHE_DEFAULT_SIZE;
+	if (!getrlimit(RLIMIT_MEMLOCK, &rlim) && rlim.rlim_cur != RLIM_INFINITY)
+		cache_budget = min_t(size_t, cache_budget, rlim.rlim_cur / 2);
+	env = getenv("RDMAV_MR_CACHE_SIZE");
+	if (env)
+		cache_budget = strtoull(env, NULL, 0);
+
+	/*
+	 * A user mode only fd would make system calls that touch a cached
+	 * range fail with EFAULT, so there is no fallback to one.
+	 */
+	fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (fd < 0)
+		return;
+
+	if (ioctl(fd, UFFDIO_API, &api))
+		goto err;
+
+	cl_qmap_init(&addr_map);
+	cl_qmap_init(&mr_map);
+	mr_cache_fd = fd;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old_set);
+	ret = pthread_create(&thread, NULL, mr_cache_monitor, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	if (ret) {
+		mr_cache_fd = -1;
+		goto err;
+	}
+
+	pthread_detach(thread);
+	pthread_atfork(mr_cache_atfork_prepare, mr_cache_atfork_parent,
+		       mr_cache_atfork_child);
+	mr_cache_on = true;
+	return;
+
+err:
+	close(fd);
+}
+
+bool mr_cache_enabled(void)
+{
+	pthread_once(&mr_cache_once, mr_cache_init);
+	return mr_cache_on;
+}
+
+struct ibv_mr *mr_cache_reg(struct ibv_pd *pd, void *addr, size_t length,
+			    unsigned int access)
+{
+	struct uffdio_register reg = {};
+	struct mr_cache_entry *ent;
+	unsigned int seq;
+	struct ibv_mr *mr;
+
+	mr_cache_lock();
+	ent = mr_cache_find(pd, (uintptr_t)addr, (uintptr_t)addr + length,
+			    access);
+	if (ent) {
+		if (!ent->refcnt++)
+			list_del(&ent->lru);
+		mr = ent->mr;
+		mr_cache_unlock();
+		return mr;
+	}
+	seq = events_seq;
+	mr_cache_unlock();
+
+	mr = __ibv_reg_mr_iova2(pd, addr, length, (uintptr_t)addr, access);
+	if (!mr)
+		return NULL;
+
+	ent = calloc(1, sizeof(*ent));
+	if (!ent)
+		return mr;
+
+	ent->mr = mr;
+	ent->start = (uintptr_t)addr;
+	ent->end = ent->start + length;
+	ent->access = access;
+
+	/*
+	 * The pages are registered with the userfaultfd after they have been
+	 * pinned, since faults taken while pinning them cannot be handled.
+	 * Any event between the two drops the new MR from the cache, so that
+	 * an unmap that raced with the registration cannot be missed.  The
+	 * range is registered once the entry is indexed, so that entries
+	 * evicted to make room cannot unregister it.
+	 */
+	reg.range.start = page_start(ent->start);
+	reg.range.len = page_end(ent->end) - reg.range.start;
+	reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+	ent->pinned = reg.range.len;
+
+	mr_cache_lock();
+	if (seq != events_seq || !mr_cache_insert(ent))
+		goto uncached;
+
+	if (ioctl(mr_cache_fd, UFFDIO_REGISTER, &reg)) {
+		cl_qmap_remove_item(&mr_map, &ent->mr_item);
+		cache_pinned -= ent->pinned;
+		mr_cache_unindex(ent);
+		goto uncached;
+	}
+	mr_cache_unlock();
+	return mr;
+
+uncached:
+	mr_cache_unlock();
+	free(ent);
+	return mr;
+}
+
+bool mr_cache_put(struct ibv_mr *mr)
+{
+	struct mr_cache_entry *ent;
+	cl_map_item_t *item;
+
+	if (mr_cache_fd < 0)
+		return false;
+
+	pthread_mutex_lock(&mr_cache_mutex);
+	item = cl_qmap_get(&mr_map, (uintptr_t)mr);
+	if (item == cl_qmap_end(&mr_map)) {
+		pthread_mutex_unlock(&mr_cache_mutex);
+		return false;
+	}
+
+	ent = container_of(item, struct mr_cache_entry, mr_item);
+	if (!--ent->refcnt) {
+		if (ent->indexed)
+			list_add_tail(&lru_list, &ent->lru);
+		else
+			mr_cache_drop(ent);
+	}
+	mr_cache_unlock();
+	return true;
+}
+
+bool mr_cache_owns(struct ibv_mr *mr)
+{
+	bool ret;
+
+	if (mr_cache_fd < 0)
+		return false;
+
+	pthread_mutex_lock(&mr_cache_mutex);
+	ret = cl_qmap_get(&mr_map, (uintptr_t)mr) != cl_qmap_end(&mr_map);
+	pthread_mutex_unlock(&mr_cache_mutex);
+	return ret;
+}
+
+void mr_cache_flush_pd(struct ibv_pd *pd)
+{
+	struct mr_cache_entry *ent, *tmp;
+
+	if (mr_cache_fd < 0)
+		return;
+
+	pthread_mutex_lock(&mr_cache_mutex);
+	list_for_each_safe(&lru_list, ent, tmp, lru) {
+		if (ent->mr->pd == pd)
+			mr_cache_evict(ent);
+	}
+	mr_cache_unlock();
+}
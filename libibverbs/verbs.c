@@ -304,11 +304,12 @@ LATEST_SYMVER_FUNC(ibv_dealloc_pd, 1_1, "IBVERBS_1.1",
 		   int,
 		   struct ibv_pd *pd)
 {
+	mr_cache_flush_pd(pd);
 	return get_ops(pd->context)->dealloc_pd(pd);
 }
 
-struct ibv_mr *ibv_reg_mr_iova2(struct ibv_pd *pd, void *addr, size_t length,
-				uint64_t iova, unsigned int access)
+struct ibv_mr *__ibv_reg_mr_iova2(struct ibv_pd *pd, void *addr, size_t length,
+				  uint64_t iova, unsigned int access)
 {
 	struct verbs_device *device = verbs_get_device(pd->context->device);
 	bool odp_mr = access & IBV_ACCESS_ON_DEMAND;
@@ -334,6 +335,16 @@ struct ibv_mr *ibv_reg_mr_iova2(struct ibv_pd *pd, void *addr, size_t length,
 	return mr;
 }
 
+struct ibv_mr *ibv_reg_mr_iova2(struct ibv_pd *pd, void *addr, size_t length,
+				uint64_t iova, unsigned int access)
+{
+	if (addr && length && iova == (uintptr_t)addr &&
+	    !(access & IBV_ACCESS_ON_DEMAND) && mr_cache_enabled())
+		return mr_cache_reg(pd, addr, length, access);
+
+	return __ibv_reg_mr_iova2(pd, addr, length, iova, access);
+}
+
 #undef ibv_reg_mr
 LATEST_SYMVER_FUNC(ibv_reg_mr, 1_1, "IBVERBS_1.1",
 		   struct ibv_mr *,
@@ -424,7 +435,8 @@ LATEST_SYMVER_FUNC(ibv_rereg_mr, 1_1, "IBVERBS_1.1",
 	void *old_addr;
 	size_t old_len;
 
-	if (verbs_get_mr(mr)->mr_type != IBV_MR_TYPE_MR) {
+	/* Cached MRs may be shared by several registrations */
+	if (verbs_get_mr(mr)->mr_type != IBV_MR_TYPE_MR || mr_cache_owns(mr)) {
 		errno = EINVAL;
 		return IBV_REREG_MR_ERR_INPUT;
 	}
@@ -478,9 +490,7 @@ LATEST_SYMVER_FUNC(ibv_rereg_mr, 1_1, "IBVERBS_1.1",
 	return err;
 }
 
-LATEST_SYMVER_FUNC(ibv_dereg_mr, 1_1, "IBVERBS_1.1",
-		   int,
-		   struct ibv_mr *mr)
+int __ibv_dereg_mr(struct ibv_mr *mr)
 {
 	int ret;
 	void *addr		= mr->addr;
@@ -495,6 +505,16 @@ LATEST_SYMVER_FUNC(ibv_dereg_mr, 1_1, "IBVERBS_1.1",
 	return ret;
 }
 
+LATEST_SYMVER_FUNC(ibv_dereg_mr, 1_1, "IBVERBS_1.1",
+		   int,
+		   struct ibv_mr *mr)
+{
+	if (mr_cache_put(mr))
+		return 0;
+
+	return __ibv_dereg_mr(mr);
+}
+
 struct ibv_comp_channel *ibv_create_comp_channel(struct ibv_context *context)
 {
 	struct ibv_create_comp_channel req;
@@ -277,6 +277,7 @@ int rdma_getaddrinfo(const char *node, const char *service,
 			goto err;
 	}
 
+	rai->ai_flags |= hints->ai_flags & RAI_POOL;
 	if (!(rai->ai_flags & RAI_PASSIVE))
 		ucma_ib_resolve(&rai, hints);
 
@@ -47,6 +47,7 @@
 #include <netdb.h>
 #include <syslog.h>
 #include <limits.h>
+#include <time.h>
 #include <sys/sysmacros.h>
 
 #include "cma.h"
@@ -96,6 +97,31 @@ struct cma_device {
 	uint8_t		    max_responder_resources;
 	int		    ibv_idx;
 	uint8_t		    is_device_dead : 1;
+	struct list_head    qp_pool;
+	int		    qp_pool_cnt;
+};
+
+/*
+ * UD QPs and CQs of endpoints created with RAI_POOL are reset and kept per
+ * device when the endpoint is destroyed, so that rdma_create_ep can reuse
+ * them for a new endpoint that asks for the same QP type and capabilities.
+ * Connected QPs are destroyed, but their CQs and completion channels are
+ * kept, with qp set to NULL.  Each pool entry holds a reference on its
+ * device, which keeps the device's PD allocated.
+ */
+#define CMA_QP_POOL_MAX	16
+
+struct cma_pooled_qp {
+	struct list_node	entry;
+	struct ibv_qp		*qp;
+	enum ibv_qp_type	qp_type;
+	struct ibv_cq		*send_cq;
+	struct ibv_cq		*recv_cq;
+	struct ibv_comp_channel	*send_cq_channel;
+	struct ibv_comp_channel	*recv_cq_channel;
+	int			sq_sig_all;
+	struct ibv_qp_cap	req_cap;
+	struct ibv_qp_cap	cap;
 };
 
 struct cma_id_private {
@@ -115,6 +141,11 @@ struct cma_id_private {
 	uint8_t			responder_resources;
 	struct ibv_ece		local_ece;
 	struct ibv_ece		remote_ece;
+	int			pool;
+	int			qp_poolable;
+	int			qp_sq_sig_all;
+	struct ibv_qp_cap	qp_req_cap;
+	struct ibv_qp_cap	qp_cap;
 };
 
 struct cma_multicast {
@@ -135,8 +166,53 @@ struct cma_event {
 	uint8_t			private_data[RDMA_MAX_PRIVATE_DATA];
 	struct cma_id_private	*id_priv;
 	struct cma_multicast	*mc;
+	struct cma_event_channel *chan;
+	struct cma_event	*next;
+};
+
+/*
+ * Acknowledged events are kept on a per channel free list for reuse.  The
+ * channel is released once it has been destroyed and all of its events
+ * have been acknowledged.
+ */
+#define CMA_EVENT_CACHE_MAX	64
+
+struct cma_event_channel {
+	struct rdma_event_channel channel;
+	pthread_mutex_t		mut;
+	struct cma_event	*free_list;
+	int			free_cnt;
+	int			events;
+	int			destroyed;
+};
+
+/*
+ * If RDMA_CM_PATH_CACHE is set, IB paths returned by ibacm are cached by
+ * source and destination GID and pkey, so that resolving a route to a
+ * recently used destination does not need to go through ibacm and the SA.
+ * ibacm resolves paths from the addresses alone, so the key covers
+ * everything its answer depends on.  Paths resolved by the kernel also
+ * depend on the id's TOS and service ID, and are not cached.  Entries
+ * expire after CMA_PATH_CACHE_TTL seconds, and are dropped when a
+ * connection using them fails or the local addresses change.
+ */
+#define CMA_PATH_CACHE_SIZE	256
+#define CMA_PATH_CACHE_PATHS	2
+#define CMA_PATH_CACHE_TTL	30
+
+struct cma_path_entry {
+	union ibv_gid		sgid;
+	union ibv_gid		dgid;
+	__be16			pkey;
+	int			num_paths;
+	time_t			expires;
+	struct ibv_path_data	path[CMA_PATH_CACHE_PATHS];
 };
 
+static struct cma_path_entry path_cache[CMA_PATH_CACHE_SIZE];
+static bool path_cache_enabled;
+static pthread_mutex_t path_mut = PTHREAD_MUTEX_INITIALIZER;
+
 static LIST_HEAD(cma_dev_list);
 /* sorted based or index or guid, depends on kernel support */
 static struct ibv_device **dev_list;
@@ -273,6 +349,7 @@ static struct cma_device *insert_cma_dev(struct ibv_device *dev)
 	cma_dev->guid = ibv_get_device_guid(dev);
 	cma_dev->ibv_idx = ibv_get_device_index(dev);
 	cma_dev->dev = dev;
+	list_head_init(&cma_dev->qp_pool);
 
 	/* reverse iteration, optimized to ibv_idx which is growing */
 	list_for_each_rev(&cma_dev_list, p, entry) {
@@ -381,6 +458,7 @@ out:
 
 int ucma_init(void)
 {
+	char *env;
 	int ret;
 
 	/*
@@ -397,6 +475,9 @@ int ucma_init(void)
 		return 0;
 	}
 
+	env = getenv("RDMA_CM_PATH_CACHE");
+	path_cache_enabled = env && atoi(env);
+
 	fastlock_init(&idm_lock);
 	ret = check_abi_version();
 	if (ret) {
@@ -566,29 +647,99 @@ void rdma_free_devices(struct ibv_context **list)
 
 struct rdma_event_channel *rdma_create_event_channel(void)
 {
-	struct rdma_event_channel *channel;
+	struct cma_event_channel *chan;
 
 	if (ucma_init())
 		return NULL;
 
-	channel = malloc(sizeof(*channel));
-	if (!channel)
+	chan = calloc(1, sizeof(*chan));
+	if (!chan)
 		return NULL;
 
-	channel->fd = open_cdev(dev_name, dev_cdev);
-	if (channel->fd < 0) {
+	chan->channel.fd = open_cdev(dev_name, dev_cdev);
+	if (chan->channel.fd < 0) {
 		goto err;
 	}
-	return channel;
+	pthread_mutex_init(&chan->mut, NULL);
+	return &chan->channel;
 err:
-	free(channel);
+	free(chan);
 	return NULL;
 }
 
+static void ucma_free_channel(struct cma_event_channel *chan)
+{
+	struct cma_event *evt;
+
+	while ((evt = chan->free_list)) {
+		chan->free_list = evt->next;
+		free(evt);
+	}
+	pthread_mutex_destroy(&chan->mut);
+	free(chan);
+}
+
 void rdma_destroy_event_channel(struct rdma_event_channel *channel)
 {
+	struct cma_event_channel *chan;
+	int events;
+
+	chan = container_of(channel, struct cma_event_channel, channel);
 	close(channel->fd);
-	free(channel);
+
+	pthread_mutex_lock(&chan->mut);
+	chan->destroyed = 1;
+	events = chan->events;
+	pthread_mutex_unlock(&chan->mut);
+
+	if (!events)
+		ucma_free_channel(chan);
+}
+
+static void ucma_release_event(struct cma_event_channel *chan,
+			       struct cma_event *evt)
+{
+	int release;
+
+	pthread_mutex_lock(&chan->mut);
+	if (evt && !chan->destroyed && chan->free_cnt < CMA_EVENT_CACHE_MAX) {
+		evt->next = chan->free_list;
+		chan->free_list = evt;
+		chan->free_cnt++;
+		evt = NULL;
+	}
+	release = !--chan->events && chan->destroyed;
+	pthread_mutex_unlock(&chan->mut);
+
+	free(evt);
+	if (release)
+		ucma_free_channel(chan);
+}
+
+static struct cma_event *ucma_alloc_event(struct rdma_event_channel *channel)
+{
+	struct cma_event_channel *chan;
+	struct cma_event *evt;
+
+	chan = container_of(channel, struct cma_event_channel, channel);
+	pthread_mutex_lock(&chan->mut);
+	evt = chan->free_list;
+	if (evt) {
+		chan->free_list = evt->next;
+		chan->free_cnt--;
+	}
+	chan->events++;
+	pthread_mutex_unlock(&chan->mut);
+
+	if (!evt) {
+		evt = malloc(sizeof(*evt));
+		if (!evt) {
+			ucma_release_event(chan, NULL);
+			return NULL;
+		}
+	}
+	evt->chan = chan;
+	return evt;
 }
 
 static struct cma_device *ucma_get_cma_device(__be64 guid, uint32_t idx)
@@ -956,6 +1107,116 @@ static void ucma_convert_path(struct ibv_path_data *path_data,
 	sa_path->preference = (uint8_t) path_data->flags;
 }
 
+static bool ucma_path_cacheable(struct rdma_cm_id *id)
+{
+	struct cma_id_private *id_priv;
+
+	id_priv = container_of(id, struct cma_id_private, id);
+	return path_cache_enabled && id_priv->cma_dev && id->port_num &&
+	       id_priv->cma_dev->port[id->port_num - 1].link_layer ==
+	       IBV_LINK_LAYER_INFINIBAND;
+}
+
+static struct cma_path_entry *ucma_path_slot(struct rdma_ib_addr *ibaddr)
+{
+	uint8_t *key = ibaddr->dgid.raw;
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < sizeof(ibaddr->dgid); i++)
+		hash = (hash ^ key[i]) * 16777619;
+	hash ^= ibaddr->sgid.global.interface_id ^ ibaddr->pkey;
+	return &path_cache[hash % CMA_PATH_CACHE_SIZE];
+}
+
+static bool ucma_path_match(struct cma_path_entry *entry,
+			    struct rdma_ib_addr *ibaddr)
+{
+	return entry->num_paths && entry->pkey == ibaddr->pkey &&
+	       !memcmp(&entry->sgid, &ibaddr->sgid, sizeof(entry->sgid)) &&
+	       !memcmp(&entry->dgid, &ibaddr->dgid, sizeof(entry->dgid));
+}
+
+static int ucma_lookup_path(struct rdma_cm_id *id, struct ibv_path_data *path)
+{
+	struct rdma_ib_addr *ibaddr = &id->route.addr.addr.ibaddr;
+	struct cma_path_entry *entry;
+	int num_paths = 0;
+
+	if (!ucma_path_cacheable(id))
+		return 0;
+
+	pthread_mutex_lock(&path_mut);
+	entry = ucma_path_slot(ibaddr);
+	if (ucma_path_match(entry, ibaddr)) {
+		if (entry->expires > time(NULL)) {
+			num_paths = entry->num_paths;
+			memcpy(path, entry->path, sizeof(*path) * num_paths);
+		} else {
+			entry->num_paths = 0;
+		}
+	}
+	pthread_mutex_unlock(&path_mut);
+	return num_paths;
+}
+
+/*
+ * An unexpired entry is not refreshed, so that a path is resolved again
+ * at least every CMA_PATH_CACHE_TTL seconds.
+ */
+static void ucma_cache_path(struct rdma_cm_id *id, struct ibv_path_data *path,
+			    int num_paths)
+{
+	struct rdma_ib_addr *ibaddr = &id->route.addr.addr.ibaddr;
+	struct cma_path_entry *entry;
+	time_t now;
+
+	if (!num_paths || !ucma_path_cacheable(id))
+		return;
+
+	now = time(NULL);
+	num_paths = min(num_paths, CMA_PATH_CACHE_PATHS);
+	pthread_mutex_lock(&path_mut);
+	entry = ucma_path_slot(ibaddr);
+	if (!ucma_path_match(entry, ibaddr) || entry->expires <= now) {
+		entry->sgid = ibaddr->sgid;
+		entry->dgid = ibaddr->dgid;
+		entry->pkey = ibaddr->pkey;
+		entry->expires = now + CMA_PATH_CACHE_TTL;
+		entry->num_paths = num_paths;
+		memcpy(entry->path, path, sizeof(*path) * num_paths);
+	}
+	pthread_mutex_unlock(&path_mut);
+}
+
+static void ucma_invalidate_path(struct rdma_cm_id *id)
+{
+	struct rdma_ib_addr *ibaddr = &id->route.addr.addr.ibaddr;
+	struct cma_path_entry *entry;
+
+	if (!ucma_path_cacheable(id))
+		return;
+
+	pthread_mutex_lock(&path_mut);
+	entry = ucma_path_slot(ibaddr);
+	if (ucma_path_match(entry, ibaddr))
+		entry->num_paths = 0;
+	pthread_mutex_unlock(&path_mut);
+}
+
+/* Drop all paths from a local GID, or every path if sgid is NULL. */
+static void ucma_flush_paths(union ibv_gid *sgid)
+{
+	int i;
+
+	pthread_mutex_lock(&path_mut);
+	for (i = 0; i < CMA_PATH_CACHE_SIZE; i++) {
+		if (!sgid || !memcmp(&path_cache[i].sgid, sgid, sizeof(*sgid)))
+			path_cache[i].num_paths = 0;
+	}
+	pthread_mutex_unlock(&path_mut);
+}
+
 static int ucma_query_path(struct rdma_cm_id *id)
 {
 	struct ucma_abi_query_path_resp *resp;
@@ -1185,9 +1446,15 @@ int rdma_resolve_addr(struct rdma_cm_id *id, struct sockaddr *src_addr,
 
 static int ucma_set_ib_route(struct rdma_cm_id *id)
 {
+	struct ibv_path_data path[CMA_PATH_CACHE_PATHS];
 	struct rdma_addrinfo hint, *rai;
 	int ret;
 
+	ret = ucma_lookup_path(id, path);
+	if (ret)
+		return rdma_set_option(id, RDMA_OPTION_IB, RDMA_OPTION_IB_PATH,
+				       path, sizeof(*path) * ret);
+
 	memset(&hint, 0, sizeof hint);
 	hint.ai_flags = RAI_ROUTEONLY;
 	hint.ai_family = id->route.addr.src_addr.sa_family;
@@ -1200,11 +1467,15 @@ static int ucma_set_ib_route(struct rdma_cm_id *id)
 	if (ret)
 		return ret;
 
-	if (rai->ai_route_len)
+	if (rai->ai_route_len) {
 		ret = rdma_set_option(id, RDMA_OPTION_IB, RDMA_OPTION_IB_PATH,
 				      rai->ai_route, rai->ai_route_len);
-	else
+		if (!ret)
+			ucma_cache_path(id, rai->ai_route, rai->ai_route_len /
+					sizeof(struct ibv_path_data));
+	} else {
 		ret = -1;
+	}
 
 	rdma_freeaddrinfo(rai);
 	return ret;
@@ -1493,6 +1764,178 @@ err:
 	return -1;
 }
 
+static bool ucma_qp_poolable(struct cma_id_private *id_priv,
+			     struct ibv_qp_init_attr_ex *attr)
+{
+	struct rdma_cm_id *id = &id_priv->id;
+
+	if (!id_priv->pool || !id_priv->cma_dev ||
+	    id_priv->cma_dev->is_device_dead)
+		return false;
+
+	/*
+	 * A connected QP cannot be reused until the CM timewait of its last
+	 * connection has expired, or the peer may treat a new connection from
+	 * the same QPN as stale.  The id that would report the end of timewait
+	 * is destroyed with the endpoint, so for RC and UC only the CQs and
+	 * completion channels are pooled; ucma_pool_qp destroys the QP.
+	 */
+	if (attr->qp_type != IBV_QPT_UD && attr->qp_type != IBV_QPT_RC &&
+	    attr->qp_type != IBV_QPT_UC)
+		return false;
+
+	return attr->comp_mask == IBV_QP_INIT_ATTR_PD &&
+	       attr->pd == id_priv->cma_dev->pd &&
+	       !attr->send_cq && !attr->recv_cq && !attr->srq &&
+	       !id->send_cq && !id->recv_cq && !id->srq &&
+	       attr->cap.max_send_wr && attr->cap.max_recv_wr;
+}
+
+static struct ibv_qp *ucma_get_pooled_qp(struct cma_id_private *id_priv,
+					 struct ibv_qp_init_attr_ex *attr)
+{
+	struct cma_device *cma_dev = id_priv->cma_dev;
+	struct rdma_cm_id *id = &id_priv->id;
+	struct cma_pooled_qp *pqp;
+	struct ibv_qp *qp;
+
+	pthread_mutex_lock(&mut);
+	list_for_each(&cma_dev->qp_pool, pqp, entry) {
+		if (pqp->qp_type == attr->qp_type &&
+		    pqp->sq_sig_all == attr->sq_sig_all &&
+		    !memcmp(&pqp->req_cap, &attr->cap, sizeof(attr->cap))) {
+			list_del(&pqp->entry);
+			cma_dev->qp_pool_cnt--;
+			goto found;
+		}
+	}
+	pthread_mutex_unlock(&mut);
+	return NULL;
+
+found:
+	pthread_mutex_unlock(&mut);
+	id->send_cq_channel = pqp->send_cq_channel;
+	id->recv_cq_channel = pqp->recv_cq_channel;
+	id->send_cq = pqp->send_cq;
+	id->recv_cq = pqp->recv_cq;
+	id->send_cq->cq_context = id;
+	id->recv_cq->cq_context = id;
+	attr->send_cq = id->send_cq;
+	attr->recv_cq = id->recv_cq;
+
+	/* Connected entries only carry CQs; the caller creates a new QP. */
+	qp = pqp->qp;
+	if (qp) {
+		qp->qp_context = attr->qp_context;
+		attr->cap = pqp->cap;
+		id_priv->qp_cap = pqp->cap;
+	}
+	free(pqp);
+
+	/* The id holds its own reference on the device. */
+	ucma_put_device(cma_dev);
+	return qp;
+}
+
+static void ucma_drain_cq(struct ibv_cq *cq)
+{
+	struct ibv_wc wc[16];
+
+	while (ibv_poll_cq(cq, 16, wc) > 0)
+		;
+}
+
+static int ucma_pool_qp(struct cma_id_private *id_priv)
+{
+	struct cma_device *cma_dev = id_priv->cma_dev;
+	struct rdma_cm_id *id = &id_priv->id;
+	struct cma_pooled_qp *pqp;
+	struct ibv_qp_attr qp_attr;
+
+	if (!id_priv->qp_poolable || cma_dev->is_device_dead)
+		return -1;
+
+	pqp = malloc(sizeof(*pqp));
+	if (!pqp)
+		return -1;
+
+	pqp->qp_type = id->qp->qp_type;
+	if (pqp->qp_type == IBV_QPT_UD) {
+		qp_attr.qp_state = IBV_QPS_RESET;
+		if (ibv_modify_qp(id->qp, &qp_attr, IBV_QP_STATE))
+			goto err;
+		pqp->qp = id->qp;
+	} else {
+		if (ibv_destroy_qp(id->qp))
+			goto err;
+		id->qp = NULL;
+		pqp->qp = NULL;
+	}
+
+	ucma_drain_cq(id->send_cq);
+	if (id->recv_cq != id->send_cq)
+		ucma_drain_cq(id->recv_cq);
+
+	pqp->send_cq = id->send_cq;
+	pqp->recv_cq = id->recv_cq;
+	pqp->send_cq_channel = id->send_cq_channel;
+	pqp->recv_cq_channel = id->recv_cq_channel;
+	pqp->sq_sig_all = id_priv->qp_sq_sig_all;
+	pqp->req_cap = id_priv->qp_req_cap;
+	pqp->cap = id_priv->qp_cap;
+
+	pthread_mutex_lock(&mut);
+	if (cma_dev->qp_pool_cnt >= CMA_QP_POOL_MAX || cma_dev->is_device_dead) {
+		pthread_mutex_unlock(&mut);
+		if (pqp->qp)
+			goto err;
+		/* The QP is already gone, so finish the teardown here. */
+		ucma_destroy_cqs(id);
+		free(pqp);
+		return 0;
+	}
+	cma_dev->refcnt++;
+	cma_dev->qp_pool_cnt++;
+	list_add(&cma_dev->qp_pool, &pqp->entry);
+	pthread_mutex_unlock(&mut);
+
+	id->qp = NULL;
+	id->send_cq = NULL;
+	id->recv_cq = NULL;
+	id->send_cq_channel = NULL;
+	id->recv_cq_channel = NULL;
+	return 0;
+err:
+	free(pqp);
+	return -1;
+}
+
+static void ucma_flush_qp_pool(struct cma_device *cma_dev)
+{
+	struct cma_pooled_qp *pqp;
+
+	for (;;) {
+		pthread_mutex_lock(&mut);
+		pqp = list_pop(&cma_dev->qp_pool, struct cma_pooled_qp, entry);
+		if (pqp)
+			cma_dev->qp_pool_cnt--;
+		pthread_mutex_unlock(&mut);
+		if (!pqp)
+			break;
+
+		if (pqp->qp)
+			ibv_destroy_qp(pqp->qp);
+		ibv_destroy_cq(pqp->recv_cq);
+		if (pqp->send_cq != pqp->recv_cq)
+			ibv_destroy_cq(pqp->send_cq);
+		ibv_destroy_comp_channel(pqp->recv_cq_channel);
+		if (pqp->send_cq_channel != pqp->recv_cq_channel)
+			ibv_destroy_comp_channel(pqp->send_cq_channel);
+		free(pqp);
+		ucma_put_device(cma_dev);
+	}
+}
+
 int rdma_create_srq_ex(struct rdma_cm_id *id, struct ibv_srq_init_attr_ex *attr)
 {
 	struct cma_id_private *id_priv;
@@ -1649,6 +2092,15 @@ int rdma_create_qp_ex(struct rdma_cm_id *id,
 		}
 	}
 
+	id_priv->qp_poolable = ucma_qp_poolable(id_priv, attr);
+	if (id_priv->qp_poolable) {
+		id_priv->qp_sq_sig_all = attr->sq_sig_all;
+		id_priv->qp_req_cap = attr->cap;
+		qp = ucma_get_pooled_qp(id_priv, attr);
+		if (qp)
+			goto init;
+	}
+
 	ret = ucma_create_cqs(id, attr->send_cq || id->send_cq ? 0 : attr->cap.max_send_wr,
 				  attr->recv_cq || id->recv_cq ? 0 : attr->cap.max_recv_wr);
 	if (ret)
@@ -1665,6 +2117,9 @@ int rdma_create_qp_ex(struct rdma_cm_id *id,
 		ret = -1;
 		goto err1;
 	}
+	id_priv->qp_cap = attr->cap;
+
+init:
 
 	ret = init_ece(id, qp);
 	if (ret)
@@ -2240,7 +2695,7 @@ int rdma_ack_cm_event(struct rdma_cm_event *event)
 		ucma_complete_mc_event(evt->mc);
 	else
 		ucma_complete_event(evt->id_priv);
-	free(evt);
+	ucma_release_event(evt->chan, evt);
 	return 0;
 }
 
@@ -2313,6 +2768,7 @@ static int ucma_process_conn_req(struct cma_event *evt, uint32_t handle,
 	evt->event.listen_id = &evt->id_priv->id;
 	evt->event.id = &id_priv->id;
 	id_priv->handle = handle;
+	id_priv->pool = evt->id_priv->pool;
 	ucma_insert_id(id_priv);
 	id_priv->initiator_depth = evt->event.param.conn.initiator_depth;
 	id_priv->responder_resources = evt->event.param.conn.responder_resources;
@@ -2476,33 +2932,21 @@ int rdma_establish(struct rdma_cm_id *id)
 						   id));
 }
 
-int rdma_get_cm_event(struct rdma_event_channel *channel,
-		      struct rdma_cm_event **event)
+static int ucma_get_event(struct rdma_event_channel *channel,
+			  struct cma_event *evt)
 {
 	struct ucma_abi_event_resp resp = {};
 	struct ucma_abi_get_event cmd;
-	struct cma_event *evt;
+	struct cma_event_channel *chan = evt->chan;
 	int ret;
 
-	ret = ucma_init();
-	if (ret)
-		return ret;
-
-	if (!event)
-		return ERR(EINVAL);
-
-	evt = malloc(sizeof(*evt));
-	if (!evt)
-		return ERR(ENOMEM);
-
 retry:
 	memset(evt, 0, sizeof(*evt));
+	evt->chan = chan;
 	CMA_INIT_CMD_RESP(&cmd, sizeof cmd, GET_EVENT, &resp, sizeof resp);
 	ret = write(channel->fd, &cmd, sizeof cmd);
-	if (ret != sizeof cmd) {
-		free(evt);
+	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
-	}
 
 	VALGRIND_MAKE_MEM_DEFINED(&resp, sizeof resp);
 
@@ -2617,10 +3061,101 @@ retry:
 		break;
 	}
 
+	switch (resp.event) {
+	case RDMA_CM_EVENT_UNREACHABLE:
+	case RDMA_CM_EVENT_CONNECT_ERROR:
+		ucma_invalidate_path(evt->event.id);
+		break;
+	case RDMA_CM_EVENT_ADDR_CHANGE:
+		ucma_flush_paths(&evt->event.id->route.addr.addr.ibaddr.sgid);
+		break;
+	case RDMA_CM_EVENT_DEVICE_REMOVAL:
+		ucma_flush_paths(NULL);
+		if (evt->id_priv->cma_dev)
+			ucma_flush_qp_pool(evt->id_priv->cma_dev);
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+int rdma_get_cm_event(struct rdma_event_channel *channel,
+		      struct rdma_cm_event **event)
+{
+	struct cma_event *evt;
+	int ret;
+
+	ret = ucma_init();
+	if (ret)
+		return ret;
+
+	if (!event)
+		return ERR(EINVAL);
+
+	evt = ucma_alloc_event(channel);
+	if (!evt)
+		return ERR(ENOMEM);
+
+	ret = ucma_get_event(channel, evt);
+	if (ret) {
+		ucma_release_event(evt->chan, evt);
+		return ret;
+	}
+
 	*event = &evt->event;
 	return 0;
 }
 
+static bool ucma_event_pending(struct rdma_event_channel *channel)
+{
+	struct pollfd fds;
+
+	fds.fd = channel->fd;
+	fds.events = POLLIN;
+	return poll(&fds, 1, 0) > 0;
+}
+
+/*
+ * The kernel reports one event per command, so a batch is built by
+ * retrieving events for as long as the channel has more pending.  Only the
+ * first event may block.
+ */
+int rdma_get_cm_events(struct rdma_event_channel *channel,
+		       struct rdma_cm_event **events, int max)
+{
+	struct cma_event *evt;
+	int cnt, ret;
+
+	ret = ucma_init();
+	if (ret)
+		return ret;
+
+	if (!events || max < 1)
+		return ERR(EINVAL);
+
+	for (cnt = 0; cnt < max; cnt++) {
+		if (cnt && !ucma_event_pending(channel))
+			break;
+
+		evt = ucma_alloc_event(channel);
+		if (!evt) {
+			ret = ERR(ENOMEM);
+			break;
+		}
+
+		ret = ucma_get_event(channel, evt);
+		if (ret) {
+			ucma_release_event(evt->chan, evt);
+			break;
+		}
+		events[cnt] = &evt->event;
+	}
+
+	return cnt ? cnt : ret;
+}
+
 const char *rdma_event_str(enum rdma_cm_event_type event)
 {
 	switch (event) {
@@ -2778,6 +3313,11 @@ int rdma_create_ep(struct rdma_cm_id **id, struct rdma_addrinfo *res,
 	if (ret)
 		return ret;
 
+	if (res->ai_flags & RAI_POOL) {
+		id_priv = container_of(cm_id, struct cma_id_private, id);
+		id_priv->pool = 1;
+	}
+
 	if (res->ai_flags & RAI_PASSIVE) {
 		ret = ucma_passive_ep(cm_id, res, pd, qp_init_attr);
 		if (ret)
@@ -2835,13 +3375,13 @@ void rdma_destroy_ep(struct rdma_cm_id *id)
 {
 	struct cma_id_private *id_priv;
 
-	if (id->qp)
+	id_priv = container_of(id, struct cma_id_private, id);
+	if (id->qp && ucma_pool_qp(id_priv))
 		rdma_destroy_qp(id);
 
 	if (id->srq)
 		rdma_destroy_srq(id);
 
-	id_priv = container_of(id, struct cma_id_private, id);
 	if (id_priv->qp_init_attr)
 		free(id_priv->qp_init_attr);
 
@@ -2921,3 +3461,249 @@ int rdma_get_remote_ece(struct rdma_cm_id *id, struct ibv_ece *ece)
 
 	return 0;
 }
+
+#define CMA_PEERS_WINDOW	64
+#define CMA_PEERS_EVENT_BATCH	16
+
+enum {
+	CMA_PEER_IDLE,
+	CMA_PEER_ADDR,
+	CMA_PEER_ROUTE,
+	CMA_PEER_CONNECT,
+	CMA_PEER_DONE
+};
+
+struct cma_peer {
+	struct rdma_cm_peer	*peer;
+	int			step;
+	int			retries;
+	uint64_t		start;
+};
+
+static uint64_t ucma_time_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/* Returns the time spent in the current step and starts the next one */
+static uint32_t ucma_peer_next_step(struct cma_peer *p, int step)
+{
+	uint64_t now = ucma_time_us();
+	uint32_t us = now - p->start;
+
+	p->start = now;
+	p->step = step;
+	return us;
+}
+
+static int ucma_peer_start(struct rdma_event_channel *channel,
+			   struct cma_peer *p, struct rdma_cm_peers_attr *attr)
+{
+	struct rdma_cm_peer *peer = p->peer;
+	int ret;
+
+	ret = rdma_create_id(channel, &peer->id, p, attr->ps);
+	if (ret)
+		return ret;
+
+	p->step = CMA_PEER_ADDR;
+	p->retries = attr->retries;
+	p->start = ucma_time_us();
+	ret = rdma_resolve_addr(peer->id, peer->src_addr, peer->dst_addr,
+				attr->timeout_ms);
+	if (ret) {
+		rdma_destroy_id(peer->id);
+		peer->id = NULL;
+	}
+	return ret;
+}
+
+static int ucma_peer_error(struct rdma_cm_event *event, int err)
+{
+	return ERR(event->status < 0 ? -event->status : err);
+}
+
+/*
+ * Advances a peer to its next step.  Returns 1 if the peer has completed,
+ * with its status set, or has been disconnected after completing.
+ */
+static int ucma_peer_event(struct cma_peer *p, struct rdma_cm_event *event,
+			   struct rdma_cm_peers_attr *attr)
+{
+	struct rdma_cm_peer *peer = p->peer;
+	struct ibv_qp_init_attr qp_attr;
+	int ret;
+
+	if (p->step == CMA_PEER_DONE) {
+		if (event->event != RDMA_CM_EVENT_DISCONNECTED)
+			return 0;
+
+		peer->status = ECONNRESET;
+		return 1;
+	}
+
+	switch (event->event) {
+	case RDMA_CM_EVENT_ADDR_RESOLVED:
+		peer->resolve_addr_us = ucma_peer_next_step(p, CMA_PEER_ROUTE);
+		p->retries = attr->retries;
+		ret = rdma_resolve_route(peer->id, attr->timeout_ms);
+		break;
+	case RDMA_CM_EVENT_ADDR_ERROR:
+		if (p->retries-- > 0)
+			ret = rdma_resolve_addr(peer->id, peer->src_addr,
+						peer->dst_addr, attr->timeout_ms);
+		else
+			ret = ucma_peer_error(event, EHOSTUNREACH);
+		break;
+	case RDMA_CM_EVENT_ROUTE_RESOLVED:
+		peer->resolve_route_us = ucma_peer_next_step(p, CMA_PEER_CONNECT);
+		if (attr->qp_init_attr) {
+			qp_attr = *attr->qp_init_attr;
+			ret = rdma_create_qp(peer->id, attr->pd, &qp_attr);
+			if (ret)
+				break;
+		}
+		ret = rdma_connect(peer->id, attr->conn_param);
+		break;
+	case RDMA_CM_EVENT_ROUTE_ERROR:
+		if (p->retries-- > 0)
+			ret = rdma_resolve_route(peer->id, attr->timeout_ms);
+		else
+			ret = ucma_peer_error(event, EHOSTUNREACH);
+		break;
+	case RDMA_CM_EVENT_ESTABLISHED:
+		peer->connect_us = ucma_peer_next_step(p, CMA_PEER_DONE);
+		peer->status = 0;
+		return 1;
+	case RDMA_CM_EVENT_REJECTED:
+		ret = ERR(ECONNREFUSED);
+		break;
+	case RDMA_CM_EVENT_CONNECT_ERROR:
+	case RDMA_CM_EVENT_UNREACHABLE:
+		ret = ucma_peer_error(event, ENETUNREACH);
+		break;
+	default:
+		return 0;
+	}
+
+	if (!ret)
+		return 0;
+
+	peer->status = errno;
+	return 1;
+}
+
+static void ucma_peer_destroy(struct rdma_cm_peer *peer)
+{
+	if (!peer->id)
+		return;
+
+	if (peer->id->qp)
+		rdma_destroy_qp(peer->id);
+	rdma_destroy_id(peer->id);
+	peer->id = NULL;
+}
+
+int rdma_connect_peers(struct rdma_event_channel *channel,
+		       struct rdma_cm_peer *peers, int cnt,
+		       struct rdma_cm_peers_attr *attr)
+{
+	struct rdma_cm_event *events[CMA_PEERS_EVENT_BATCH];
+	struct rdma_event_channel *private;
+	struct cma_peer *p, *states;
+	int i, n, window, next, active, done, err, connected = 0, ret = 0;
+
+	if (!channel || !peers || cnt < 0 || !attr)
+		return ERR(EINVAL);
+
+	states = calloc(cnt ? cnt : 1, sizeof(*states));
+	if (!states)
+		return ERR(ENOMEM);
+
+	/*
+	 * Drive the peers on a private channel, so that events for other ids
+	 * on the caller's channel are left for the caller.  Connected ids are
+	 * migrated to the caller's channel on return.
+	 */
+	private = rdma_create_event_channel();
+	if (!private) {
+		free(states);
+		return -1;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		states[i].peer = &peers[i];
+		peers[i].id = NULL;
+		peers[i].status = 0;
+		peers[i].resolve_addr_us = 0;
+		peers[i].resolve_route_us = 0;
+		peers[i].connect_us = 0;
+	}
+
+	window = attr->window > 0 ? attr->window : CMA_PEERS_WINDOW;
+	for (next = active = 0; next < cnt || active; ) {
+		for (; next < cnt && active < window; next++) {
+			if (ucma_peer_start(private, &states[next], attr)) {
+				states[next].step = CMA_PEER_DONE;
+				peers[next].status = errno;
+			} else {
+				active++;
+			}
+		}
+		if (!active)
+			break;
+
+		n = rdma_get_cm_events(private, events, CMA_PEERS_EVENT_BATCH);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -1;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			p = events[i]->id->context;
+			done = (p->step == CMA_PEER_DONE);
+			if (!ucma_peer_event(p, events[i], attr)) {
+				rdma_ack_cm_event(events[i]);
+				continue;
+			}
+
+			if (done) {
+				connected--;
+			} else {
+				p->step = CMA_PEER_DONE;
+				active--;
+				if (!p->peer->status)
+					connected++;
+			}
+
+			/* The event must be acknowledged before the id is destroyed */
+			rdma_ack_cm_event(events[i]);
+			if (p->peer->status)
+				ucma_peer_destroy(p->peer);
+		}
+	}
+
+	err = errno;
+	for (i = 0; i < cnt; i++) {
+		if (states[i].step != CMA_PEER_DONE) {
+			peers[i].status = err;
+			ucma_peer_destroy(&peers[i]);
+		} else if (peers[i].id) {
+			peers[i].id->context = peers[i].context;
+			if (rdma_migrate_id(peers[i].id, channel)) {
+				peers[i].status = errno;
+				ucma_peer_destroy(&peers[i]);
+				connected--;
+			}
+		}
+	}
+
+	rdma_destroy_event_channel(private);
+	free(states);
+	return ret ? ERR(err) : connected;
+}
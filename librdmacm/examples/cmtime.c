@@ -52,6 +52,8 @@ static char *dst_addr;
 static char *src_addr;
 static int timeout = 2000;
 static int retries = 2;
+static int req_threads = 1;
+static int window;
 
 enum step {
 	STEP_CREATE_ID,
@@ -96,12 +98,15 @@ struct work_list {
 };
 
 #define INIT_LIST(x) ((x)->prev = (x)->next = (x))
+#define EVENT_BATCH 16
 
 static struct work_list req_work;
 static struct work_list disc_work;
 static struct node *nodes;
 static struct timeval times[STEP_CNT][2];
 static int connections = 100;
+static int accepts;
+static struct timeval accept_start;
 static volatile int started[STEP_CNT];
 static volatile int completed[STEP_CNT];
 static struct ibv_qp_init_attr init_qp_attr;
@@ -145,7 +150,7 @@ static inline void list_add_tail(struct work_list *work_list, struct list_head *
 	req->next = &work_list->list;
 	req->prev->next = work_list->list.prev = req;
 	pthread_mutex_unlock(&work_list->lock);
-	if (empty)
+	if (empty || req_threads > 1)
 		pthread_cond_signal(&work_list->cond);
 }
 
@@ -183,6 +188,9 @@ static void show_perf(void)
 	for (i = 0; i < STEP_CNT; i++) {
 		if (i == STEP_BIND && !src_addr)
 			continue;
+		if (window && (i == STEP_RESOLVE_ADDR ||
+			       i == STEP_RESOLVE_ROUTE || i == STEP_CREATE_QP))
+			continue;
 
 		us = diff_us(&times[i][1], &times[i][0]);
 		printf("%-13s: %11.2f%11.2f%11.2f%11.2f\n", step_str[i], us / 1000.,
@@ -214,6 +222,23 @@ static void disc_handler(struct node *n)
 	completed[STEP_DISCONNECT]++;
 }
 
+/* Reports the server's accept rate after each set of connections */
+static void accept_handler(void)
+{
+	struct timeval end;
+	float us;
+
+	if (++accepts < connections)
+		return;
+
+	gettimeofday(&end, NULL);
+	us = diff_us(&end, &accept_start);
+	printf("%-4d threads: %d accepts in %.2f ms, %.0f accepts/sec\n",
+	       req_threads, accepts, us / 1000., accepts * 1000000. / us);
+	accepts = 0;
+	timerclear(&accept_start);
+}
+
 static void __req_handler(struct rdma_cm_id *id)
 {
 	int ret;
@@ -244,7 +269,7 @@ static void *req_handler_thread(void *arg)
 	struct list_head *work;
 	do {
 		pthread_mutex_lock(&req_work.lock);
-		if (__list_empty(&req_work))
+		while (__list_empty(&req_work))
 			pthread_cond_wait(&req_work.cond, &req_work.lock);
 		work = __list_remove_head(&req_work);
 		pthread_mutex_unlock(&req_work.lock);
@@ -284,6 +309,8 @@ static void cma_handler(struct rdma_cm_id *id, struct rdma_cm_event *event)
 		route_handler(n);
 		break;
 	case RDMA_CM_EVENT_CONNECT_REQUEST:
+		if (!timerisset(&accept_start))
+			gettimeofday(&accept_start, NULL);
 		request = malloc(sizeof *request);
 		if (!request) {
 			perror("out of memory accepting connect request");
@@ -298,6 +325,8 @@ static void cma_handler(struct rdma_cm_id *id, struct rdma_cm_event *event)
 	case RDMA_CM_EVENT_ESTABLISHED:
 		if (n)
 			conn_handler(n);
+		else
+			accept_handler();
 		break;
 	case RDMA_CM_EVENT_ADDR_ERROR:
 		if (n->retries--) {
@@ -363,7 +392,7 @@ static int alloc_nodes(void)
 	start_time(STEP_CREATE_ID);
 	for (i = 0; i < connections; i++) {
 		start_perf(&nodes[i], STEP_CREATE_ID);
-		if (dst_addr) {
+		if (dst_addr && !window) {
 			ret = rdma_create_id(channel, &nodes[i].id, &nodes[i],
 					     hints.ai_port_space);
 			if (ret)
@@ -398,18 +427,17 @@ static void cleanup_nodes(void)
 
 static void *process_events(void *arg)
 {
-	struct rdma_cm_event *event;
-	int ret = 0;
+	struct rdma_cm_event *events[EVENT_BATCH];
+	int i, cnt;
 
-	while (!ret) {
-		ret = rdma_get_cm_event(channel, &event);
-		if (!ret) {
-			cma_handler(event->id, event);
-		} else {
-			perror("failure in rdma_get_cm_event in process_server_events");
-			ret = errno;
-		}
-	}
+	do {
+		cnt = rdma_get_cm_events(channel, events, EVENT_BATCH);
+		if (cnt < 0)
+			perror("failure in rdma_get_cm_events in process_server_events");
+
+		for (i = 0; i < cnt; i++)
+			cma_handler(events[i]->id, events[i]);
+	} while (cnt > 0);
 	return NULL;
 }
 
@@ -417,7 +445,7 @@ static int run_server(void)
 {
 	pthread_t req_thread, disc_thread;
 	struct rdma_cm_id *listen_id;
-	int ret;
+	int i, ret;
 
 	INIT_LIST(&req_work.list);
 	INIT_LIST(&disc_work.list);
@@ -445,10 +473,12 @@ static int run_server(void)
 		return ret;
 	}
 
-	ret = pthread_create(&req_thread, NULL, req_handler_thread, NULL);
-	if (ret) {
-		perror("failed to create req handler thread");
-		return ret;
+	for (i = 0; i < req_threads; i++) {
+		ret = pthread_create(&req_thread, NULL, req_handler_thread, NULL);
+		if (ret) {
+			perror("failed to create req handler thread");
+			return ret;
+		}
 	}
 
 	ret = pthread_create(&disc_thread, NULL, disc_handler_thread, NULL);
@@ -487,6 +517,75 @@ static int run_server(void)
 	return ret;
 }
 
+/*
+ * Resolves and connects to the server using rdma_connect_peers, which
+ * overlaps the steps for up to window connections at a time.
+ */
+static int connect_peers(void)
+{
+	struct rdma_cm_peers_attr attr = {};
+	struct rdma_cm_peer *peers;
+	float addr_us = 0, route_us = 0, conn_us = 0;
+	long us;
+	int i, ret;
+
+	peers = calloc(connections, sizeof(*peers));
+	if (!peers)
+		return -ENOMEM;
+
+	for (i = 0; i < connections; i++) {
+		peers[i].src_addr = rai->ai_src_addr;
+		peers[i].dst_addr = rai->ai_dst_addr;
+		peers[i].context = &nodes[i];
+	}
+
+	attr.ps = hints.ai_port_space;
+	attr.qp_init_attr = &init_qp_attr;
+	attr.conn_param = &conn_param;
+	attr.timeout_ms = timeout;
+	attr.retries = retries;
+	attr.window = window;
+
+	printf("connecting (window %d)\n", window);
+	start_time(STEP_CONNECT);
+	ret = rdma_connect_peers(channel, peers, connections, &attr);
+	end_time(STEP_CONNECT);
+	if (ret < 0) {
+		perror("failure connecting peers");
+		ret = 0;
+	}
+
+	for (i = 0; i < connections; i++) {
+		nodes[i].id = peers[i].id;
+		if (peers[i].status) {
+			nodes[i].error = 1;
+			continue;
+		}
+
+		addr_us += peers[i].resolve_addr_us;
+		route_us += peers[i].resolve_route_us;
+		conn_us += peers[i].connect_us;
+
+		us = peers[i].resolve_addr_us + peers[i].resolve_route_us +
+		     peers[i].connect_us;
+		nodes[i].times[STEP_CONNECT][0] = times[STEP_CONNECT][0];
+		nodes[i].times[STEP_CONNECT][1].tv_sec =
+			times[STEP_CONNECT][0].tv_sec + us / 1000000;
+		nodes[i].times[STEP_CONNECT][1].tv_usec =
+			times[STEP_CONNECT][0].tv_usec + us % 1000000;
+	}
+
+	printf("%d of %d connected\n", ret, connections);
+	if (ret) {
+		printf("us / conn: resolve addr %.2f, resolve route %.2f, "
+		       "connect %.2f\n", addr_us / ret, route_us / ret,
+		       conn_us / ret);
+	}
+
+	free(peers);
+	return 0;
+}
+
 static int run_client(void)
 {
 	pthread_t event_thread;
@@ -504,12 +603,21 @@ static int run_client(void)
 	conn_param.private_data = rai->ai_connect;
 	conn_param.private_data_len = rai->ai_connect_len;
 
+	if (window) {
+		ret = connect_peers();
+		if (ret)
+			return ret;
+	}
+
 	ret = pthread_create(&event_thread, NULL, process_events, NULL);
 	if (ret) {
 		perror("failure creating event thread");
 		return ret;
 	}
 
+	if (window)
+		goto disconnect;
+
 	if (src_addr) {
 		printf("binding source address\n");
 		start_time(STEP_BIND);
@@ -596,6 +704,7 @@ static int run_client(void)
 	while (started[STEP_CONNECT] != completed[STEP_CONNECT]) sched_yield();
 	end_time(STEP_CONNECT);
 
+disconnect:
 	printf("disconnecting\n");
 	start_time(STEP_DISCONNECT);
 	for (i = 0; i < connections; i++) {
@@ -618,7 +727,7 @@ int main(int argc, char **argv)
 
 	hints.ai_port_space = RDMA_PS_TCP;
 	hints.ai_qp_type = IBV_QPT_RC;
-	while ((op = getopt(argc, argv, "s:b:c:p:r:t:")) != -1) {
+	while ((op = getopt(argc, argv, "s:b:c:p:r:t:n:w:")) != -1) {
 		switch (op) {
 		case 's':
 			dst_addr = optarg;
@@ -638,6 +747,14 @@ int main(int argc, char **argv)
 		case 't':
 			timeout = atoi(optarg);
 			break;
+		case 'n':
+			req_threads = atoi(optarg);
+			if (req_threads < 1)
+				req_threads = 1;
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
 		default:
 			printf("usage: %s\n", argv[0]);
 			printf("\t[-s server_address]\n");
@@ -646,6 +763,8 @@ int main(int argc, char **argv)
 			printf("\t[-p port_number]\n");
 			printf("\t[-r retries]\n");
 			printf("\t[-t timeout_ms]\n");
+			printf("\t[-n request_threads]\n");
+			printf("\t[-w pipeline_window]\n");
 			exit(1);
 		}
 	}
@@ -0,0 +1,342 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include <rdma/rdma_cma.h>
+#include <rdma/rsocket.h>
+#include <util/compiler.h>
+#include "common.h"
+
+/*
+ * Measures how rsocket setup, teardown and data transfers scale with the
+ * number of threads.  Each client thread repeatedly opens an rsocket,
+ * connects to the server, sends a number of messages, and closes the
+ * rsocket.  The open test only creates and closes rsockets, and does not
+ * require a server.
+ */
+
+enum {
+	test_open,
+	test_conn,
+	test_send
+};
+
+struct thread_ctx {
+	pthread_t id;
+	long long opens;
+	long long msgs;
+	int ret;
+};
+
+static int test = test_send;
+static int thread_cnt = 1;
+static int iterations = 1000;
+static int transfer_count = 100;
+static int transfer_size = 64;
+static const char *port = "7471";
+static char *dst_addr;
+static char *src_addr;
+static struct addrinfo *ai;
+static struct timeval start, end;
+
+static void show_perf(struct thread_ctx *ctx)
+{
+	char str[32];
+	long long opens = 0, msgs = 0;
+	float usec;
+	int i;
+
+	for (i = 0; i < thread_cnt; i++) {
+		opens += ctx[i].opens;
+		msgs += ctx[i].msgs;
+	}
+
+	usec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+
+	/* threads opens msgs seconds opens/sec msgs/sec */
+	printf("%-8d", thread_cnt);
+	cnt_str(str, sizeof str, opens);
+	printf("%-8s", str);
+	cnt_str(str, sizeof str, msgs);
+	printf("%-8s", str);
+	printf("%8.2fs%12.0f%12.0f\n", usec / 1000000.,
+	       opens * 1000000. / usec, msgs * 1000000. / usec);
+}
+
+static int open_close(struct thread_ctx *ctx)
+{
+	int rs;
+
+	rs = rs_socket(ai->ai_family, SOCK_STREAM, 0);
+	if (rs < 0)
+		return rs;
+
+	ctx->opens++;
+	rs_close(rs);
+	return 0;
+}
+
+static int connect_send(struct thread_ctx *ctx, void *buf)
+{
+	int rs, i, offset, ret;
+
+	rs = rs_socket(ai->ai_family, SOCK_STREAM, 0);
+	if (rs < 0)
+		return rs;
+
+	ret = rs_connect(rs, ai->ai_addr, ai->ai_addrlen);
+	if (ret) {
+		perror("rconnect");
+		goto close;
+	}
+	ctx->opens++;
+
+	for (i = 0; test == test_send && i < transfer_count; i++) {
+		for (offset = 0; offset < transfer_size; offset += ret) {
+			ret = rs_send(rs, buf + offset, transfer_size - offset, 0);
+			if (ret <= 0) {
+				perror("rsend");
+				ret = -1;
+				goto shutdown;
+			}
+		}
+		ctx->msgs++;
+	}
+	ret = 0;
+
+shutdown:
+	rs_shutdown(rs, SHUT_RDWR);
+close:
+	rs_close(rs);
+	return ret;
+}
+
+static void *client_thread(void *arg)
+{
+	struct thread_ctx *ctx = arg;
+	void *buf;
+	int i;
+
+	buf = calloc(1, transfer_size);
+	if (!buf) {
+		ctx->ret = -1;
+		return NULL;
+	}
+
+	for (i = 0; i < iterations && !ctx->ret; i++) {
+		ctx->ret = (test == test_open) ? open_close(ctx) :
+						 connect_send(ctx, buf);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int run_client(void)
+{
+	struct thread_ctx *ctx;
+	int i, ret = 0;
+
+	ctx = calloc(thread_cnt, sizeof(*ctx));
+	if (!ctx)
+		return -1;
+
+	printf("%-8s%-8s%-8s%8s %12s%12s\n",
+	       "threads", "opens", "msgs", "time", "opens/sec", "msgs/sec");
+	gettimeofday(&start, NULL);
+	for (i = 0; i < thread_cnt; i++) {
+		ret = pthread_create(&ctx[i].id, NULL, client_thread, &ctx[i]);
+		if (ret) {
+			perror("pthread_create");
+			thread_cnt = i;
+			break;
+		}
+	}
+
+	for (i = 0; i < thread_cnt; i++) {
+		pthread_join(ctx[i].id, NULL);
+		if (ctx[i].ret)
+			ret = ctx[i].ret;
+	}
+	gettimeofday(&end, NULL);
+	show_perf(ctx);
+
+	free(ctx);
+	return ret;
+}
+
+static void *server_thread(void *arg)
+{
+	int rs = (int) (uintptr_t) arg;
+	void *buf;
+
+	buf = malloc(transfer_size);
+	if (buf) {
+		while (rs_recv(rs, buf, transfer_size, 0) > 0)
+			;
+		free(buf);
+	}
+
+	rs_shutdown(rs, SHUT_RDWR);
+	rs_close(rs);
+	return NULL;
+}
+
+static int run_server(void)
+{
+	pthread_attr_t attr;
+	pthread_t id;
+	int lrs, rs, val, ret;
+
+	lrs = rs_socket(ai->ai_family, SOCK_STREAM, 0);
+	if (lrs < 0)
+		return lrs;
+
+	val = 1;
+	ret = rs_setsockopt(lrs, SOL_SOCKET, SO_REUSEADDR, &val, sizeof val);
+	if (ret) {
+		perror("rsetsockopt SO_REUSEADDR");
+		goto close;
+	}
+
+	ret = rs_bind(lrs, ai->ai_addr, ai->ai_addrlen);
+	if (ret) {
+		perror("rbind");
+		goto close;
+	}
+
+	ret = rs_listen(lrs, 1024);
+	if (ret) {
+		perror("rlisten");
+		goto close;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while ((rs = rs_accept(lrs, NULL, NULL)) >= 0) {
+		ret = pthread_create(&id, &attr, server_thread,
+				     (void *) (uintptr_t) rs);
+		if (ret) {
+			perror("pthread_create");
+			rs_close(rs);
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+	perror("raccept");
+
+close:
+	rs_close(lrs);
+	return ret;
+}
+
+static int set_test_opt(const char *arg)
+{
+	if (strlen(arg) == 1) {
+		switch (arg[0]) {
+		case 's':
+			use_rs = 0;
+			break;
+		case 'o':
+			test = test_open;
+			break;
+		case 'c':
+			test = test_conn;
+			break;
+		default:
+			return -1;
+		}
+	} else {
+		if (!strncasecmp("socket", arg, 6)) {
+			use_rs = 0;
+		} else if (!strncasecmp("open", arg, 4)) {
+			test = test_open;
+		} else if (!strncasecmp("connect", arg, 7)) {
+			test = test_conn;
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct addrinfo hints;
+	int op, ret;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_socktype = SOCK_STREAM;
+	while ((op = getopt(argc, argv, "s:b:t:I:C:S:p:T:")) != -1) {
+		switch (op) {
+		case 's':
+			dst_addr = optarg;
+			break;
+		case 'b':
+			src_addr = optarg;
+			break;
+		case 't':
+			thread_cnt = atoi(optarg);
+			break;
+		case 'I':
+			iterations = atoi(optarg);
+			break;
+		case 'C':
+			transfer_count = atoi(optarg);
+			break;
+		case 'S':
+			transfer_size = atoi(optarg);
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'T':
+			if (!set_test_opt(optarg))
+				break;
+			/* invalid option - fall through */
+			SWITCH_FALLTHROUGH;
+		default:
+			printf("usage: %s\n", argv[0]);
+			printf("\t[-s server_address]\n");
+			printf("\t[-b bind_address]\n");
+			printf("\t[-t thread_count]\n");
+			printf("\t[-I iterations per thread]\n");
+			printf("\t[-C transfer_count per connection]\n");
+			printf("\t[-S transfer_size]\n");
+			printf("\t[-p port_number]\n");
+			printf("\t[-T test_option]\n");
+			printf("\t    s|sockets - use standard tcp/ip sockets\n");
+			printf("\t    o|open - only open and close rsockets\n");
+			printf("\t    c|connect - connect without sending data\n");
+			exit(1);
+		}
+	}
+
+	if (thread_cnt < 1 || transfer_size < 1) {
+		fprintf(stderr, "invalid thread count or transfer size\n");
+		exit(1);
+	}
+
+	if (!dst_addr)
+		hints.ai_flags |= AI_PASSIVE;
+	ret = getaddrinfo(dst_addr ? dst_addr : src_addr, port, &hints, &ai);
+	if (ret) {
+		printf("getaddrinfo: %s\n", gai_strerror(ret));
+		exit(1);
+	}
+
+	ret = (dst_addr || test == test_open) ? run_client() : run_server();
+	freeaddrinfo(ai);
+	return ret;
+}
@@ -28,6 +28,7 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -78,6 +79,7 @@ static int rs, lrs;
 static int use_async;
 static int use_rgai;
 static int verify;
+static int use_mmsg;
 static int flags = MSG_DONTWAIT;
 static int poll_timeout = 0;
 static int custom;
@@ -145,6 +147,46 @@ static void init_bandwidth_test(int size)
 	transfer_count = size_to_count(transfer_size);
 }
 
+#define MMSG_CNT 8
+
+/*
+ * Send the rest of the buffer as a batch of messages.  Only the last message
+ * counted by sendmmsg may be short, anything else means that data was
+ * skipped in the stream.
+ */
+static int send_mmsg(int offset, int size)
+{
+	struct mmsghdr msgs[MMSG_CNT];
+	struct iovec iov[MMSG_CNT];
+	int i, cnt, len, sent, ret;
+
+	len = (size - offset + MMSG_CNT - 1) / MMSG_CNT;
+	memset(msgs, 0, sizeof msgs);
+	for (cnt = 0; cnt < MMSG_CNT && offset < size; cnt++) {
+		iov[cnt].iov_base = buf + offset;
+		iov[cnt].iov_len = size - offset < len ? size - offset : len;
+		msgs[cnt].msg_hdr.msg_iov = &iov[cnt];
+		msgs[cnt].msg_hdr.msg_iovlen = 1;
+		offset += iov[cnt].iov_len;
+	}
+
+	ret = rs_sendmmsg(rs, msgs, cnt, flags);
+	if (ret <= 0)
+		return ret;
+
+	for (i = 0, sent = 0; i < ret; i++) {
+		if (msgs[i].msg_len < iov[i].iov_len && i != ret - 1) {
+			fprintf(stderr, "rsendmmsg: message %d of %d sent short\n",
+				i + 1, ret);
+			errno = EIO;
+			return -1;
+		}
+		sent += msgs[i].msg_len;
+	}
+
+	return sent;
+}
+
 static int send_xfer(int size)
 {
 	struct pollfd fds;
@@ -165,11 +207,14 @@ static int send_xfer(int size)
 				return ret;
 		}
 
-		ret = rs_send(rs, buf + offset, size - offset, flags);
+		if (use_mmsg)
+			ret = send_mmsg(offset, size);
+		else
+			ret = rs_send(rs, buf + offset, size - offset, flags);
 		if (ret > 0) {
 			offset += ret;
 		} else if (errno != EWOULDBLOCK && errno != EAGAIN) {
-			perror("rsend");
+			perror(use_mmsg ? "rsendmmsg" : "rsend");
 			return ret;
 		}
 	}
@@ -583,6 +628,9 @@ static int set_test_opt(const char *arg)
 			use_fork = 1;
 			use_rs = 0;
 			break;
+		case 'm':
+			use_mmsg = 1;
+			break;
 		case 'n':
 			flags |= MSG_DONTWAIT;
 			break;
@@ -611,6 +659,8 @@ static int set_test_opt(const char *arg)
 		} else if (!strncasecmp("fork", arg, 4)) {
 			use_fork = 1;
 			use_rs = 0;
+		} else if (!strncasecmp("mmsg", arg, 4)) {
+			use_mmsg = 1;
 		} else {
 			return -1;
 		}
@@ -694,6 +744,7 @@ int main(int argc, char **argv)
 			printf("\t    a|async - asynchronous operation (use poll)\n");
 			printf("\t    b|blocking - use blocking calls\n");
 			printf("\t    f|fork - fork server processing\n");
+			printf("\t    m|mmsg - send in batches with sendmmsg\n");
 			printf("\t    n|nonblocking - use nonblocking calls\n");
 			printf("\t    r|resolve - use rdma cm to resolve address\n");
 			printf("\t    v|verify - verify data\n");
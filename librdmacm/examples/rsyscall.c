@@ -0,0 +1,242 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <util/compiler.h>
+
+/*
+ * Measures the cost of write() calls on normal files and pipes.  The test
+ * is intended to be run with and without the rsocket preload library, in
+ * order to show the overhead that the preload library adds to calls that
+ * it passes through.  Optionally, a number of sockets are opened first, so
+ * that the preload library is tracking fds while the test runs.
+ */
+
+enum {
+	test_file = 1 << 0,
+	test_pipe = 1 << 1
+};
+
+#define PIPE_BATCH 256
+
+static int tests = test_file | test_pipe;
+static int iterations = 1000000;
+static int transfer_size = 64;
+static int socket_cnt;
+static const char *file_name;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void show_perf(const char *name, long long calls,
+		      unsigned long long nsec)
+{
+	/* test calls seconds ns/call calls/sec */
+	printf("%-8s%-12lld%8.2fs%10.1f%14.0f\n", name, calls,
+	       nsec / 1000000000., (double) nsec / calls,
+	       calls * 1000000000. / nsec);
+}
+
+static int run_file(void *buf)
+{
+	char tmp_name[] = "/tmp/rsyscall.XXXXXX";
+	unsigned long long start, end;
+	int fd, i, ret = 0;
+
+	if (file_name) {
+		fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	} else {
+		fd = mkstemp(tmp_name);
+		if (fd >= 0)
+			unlink(tmp_name);
+	}
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	start = now_ns();
+	for (i = 0; i < iterations; i++) {
+		/* keep the file within the page cache */
+		if (!(i % 4096) && lseek(fd, 0, SEEK_SET) < 0) {
+			perror("lseek");
+			ret = -1;
+			goto close;
+		}
+
+		if (write(fd, buf, transfer_size) != transfer_size) {
+			perror("write");
+			ret = -1;
+			goto close;
+		}
+	}
+	end = now_ns();
+	show_perf("file", iterations, end - start);
+
+close:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Writes to the pipe are timed in batches that fit in the pipe buffer,
+ * which is drained between batches.
+ */
+static int run_pipe(void *buf)
+{
+	unsigned long long start, nsec = 0;
+	int fds[2], i, j, batch, ret = 0;
+
+	if (pipe(fds)) {
+		perror("pipe");
+		return -1;
+	}
+
+	for (i = 0; i < iterations; i += batch) {
+		batch = iterations - i < PIPE_BATCH ? iterations - i : PIPE_BATCH;
+
+		start = now_ns();
+		for (j = 0; j < batch; j++) {
+			if (write(fds[1], buf, transfer_size) != transfer_size) {
+				perror("write");
+				ret = -1;
+				goto close;
+			}
+		}
+		nsec += now_ns() - start;
+
+		for (j = 0; j < batch; j++) {
+			if (read(fds[0], buf, transfer_size) != transfer_size) {
+				perror("read");
+				ret = -1;
+				goto close;
+			}
+		}
+	}
+	show_perf("pipe", iterations, nsec);
+
+close:
+	close(fds[0]);
+	close(fds[1]);
+	return ret;
+}
+
+static int set_test_opt(const char *arg)
+{
+	if (strlen(arg) == 1) {
+		switch (arg[0]) {
+		case 'f':
+			tests = test_file;
+			break;
+		case 'p':
+			tests = test_pipe;
+			break;
+		default:
+			return -1;
+		}
+	} else {
+		if (!strncasecmp("file", arg, 4)) {
+			tests = test_file;
+		} else if (!strncasecmp("pipe", arg, 4)) {
+			tests = test_pipe;
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int *sockets = NULL;
+	int op, i, ret = 0;
+	void *buf;
+
+	while ((op = getopt(argc, argv, "I:S:n:f:T:")) != -1) {
+		switch (op) {
+		case 'I':
+			iterations = atoi(optarg);
+			break;
+		case 'S':
+			transfer_size = atoi(optarg);
+			break;
+		case 'n':
+			socket_cnt = atoi(optarg);
+			break;
+		case 'f':
+			file_name = optarg;
+			break;
+		case 'T':
+			if (!set_test_opt(optarg))
+				break;
+			/* invalid option - fall through */
+			SWITCH_FALLTHROUGH;
+		default:
+			printf("usage: %s\n", argv[0]);
+			printf("\t[-I iterations]\n");
+			printf("\t[-S transfer_size]\n");
+			printf("\t[-n socket_count]\n");
+			printf("\t[-f file_name]\n");
+			printf("\t[-T test_option]\n");
+			printf("\t    f|file - only write to a file\n");
+			printf("\t    p|pipe - only write to a pipe\n");
+			exit(1);
+		}
+	}
+
+	if (iterations < 1 || transfer_size < 1 ||
+	    transfer_size * PIPE_BATCH > 65536) {
+		fprintf(stderr, "invalid iterations or transfer size\n");
+		exit(1);
+	}
+
+	buf = calloc(1, transfer_size);
+	if (!buf)
+		exit(1);
+
+	if (socket_cnt > 0) {
+		sockets = calloc(socket_cnt, sizeof(*sockets));
+		if (!sockets) {
+			ret = -1;
+			goto out;
+		}
+
+		for (i = 0; i < socket_cnt; i++) {
+			sockets[i] = socket(AF_INET, SOCK_STREAM, 0);
+			if (sockets[i] < 0) {
+				perror("socket");
+				socket_cnt = i;
+				break;
+			}
+		}
+	}
+
+	printf("%-8s%-12s%9s%10s%14s\n",
+	       "test", "calls", "time", "ns/call", "calls/sec");
+	if (tests & test_file)
+		ret = run_file(buf);
+	if (!ret && (tests & test_pipe))
+		ret = run_pipe(buf);
+
+	for (i = 0; i < socket_cnt; i++)
+		close(sockets[i]);
+	free(sockets);
+out:
+	free(buf);
+	return ret;
+}
@@ -84,6 +84,8 @@ static struct client clients[256];
 static uint8_t id;
 
 static int rs;
+static int *peer_rs;
+static int peer_cnt = 1;
 static int use_async;
 static int flags = MSG_DONTWAIT;
 static int poll_timeout;
@@ -382,12 +384,14 @@ static int run_test(void)
 	g_msg.op = echo ? msg_op_echo : msg_op_data;
 	gettimeofday(&start, NULL);
 	for (i = 0; i < transfer_count; i++) {
+		rs = peer_rs[i % peer_cnt];
 		ret = echo ? client_send_recv(&g_msg, transfer_size, 1) :
 			     client_send(&g_msg, transfer_size);
 		if (ret != transfer_size)
 			goto out;
 	}
 
+	rs = peer_rs[0];
 	g_msg.op = msg_op_end;
 	ret = client_send_recv(&g_msg, CTRL_MSG_SIZE, 1);
 	if (ret != CTRL_MSG_SIZE)
@@ -401,10 +405,15 @@ out:
 	return ret;
 }
 
+/*
+ * Additional peers use their own rsocket, and so appear to the server as
+ * separate clients.  They share the login of the first rsocket, so that
+ * the server counts their transfers together.
+ */
 static int client_connect(void)
 {
 	struct addrinfo hints, *res;
-	int ret;
+	int i, ret;
 
 	memset(&hints, 0, sizeof hints);
 	hints.ai_socktype = SOCK_DGRAM;
@@ -414,28 +423,38 @@ static int client_connect(void)
 		return ret;
 	}
 
-	rs = rs_socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-	if (rs < 0) {
-		ret = rs;
-		goto out;
-	}
+	for (i = 0; i < peer_cnt; i++) {
+		rs = rs_socket(res->ai_family, res->ai_socktype,
+			       res->ai_protocol);
+		if (rs < 0) {
+			ret = rs;
+			goto err;
+		}
 
-	set_options(rs);
-	ret = rs_connect(rs, res->ai_addr, res->ai_addrlen);
-	if (ret) {
-		if (errno == ENODEV)
-			fprintf(stderr, "No RDMA devices were detected\n");
-		else
-			perror("rconnect");
-		rs_close(rs);
-		goto out;
+		set_options(rs);
+		ret = rs_connect(rs, res->ai_addr, res->ai_addrlen);
+		if (ret) {
+			if (errno == ENODEV)
+				fprintf(stderr, "No RDMA devices were detected\n");
+			else
+				perror("rconnect");
+			rs_close(rs);
+			goto err;
+		}
+		peer_rs[i] = rs;
 	}
 
+	rs = peer_rs[0];
 	g_msg.op = msg_op_login;
 	ret = client_send_recv(&g_msg, CTRL_MSG_SIZE, 1000);
-	if (ret == CTRL_MSG_SIZE)
+	if (ret == CTRL_MSG_SIZE) {
 		ret = 0;
+		goto out;
+	}
 
+err:
+	while (i--)
+		rs_close(peer_rs[i]);
 out:
 	freeaddrinfo(res);
 	return ret;
@@ -464,7 +483,9 @@ static int client_run(void)
 	} else {
 		run_test();
 	}
-	rs_close(rs);
+
+	for (i = 0; i < peer_cnt; i++)
+		rs_close(peer_rs[i]);
 
 	return ret;
 }
@@ -513,7 +534,7 @@ int main(int argc, char **argv)
 {
 	int op, ret;
 
-	while ((op = getopt(argc, argv, "s:b:B:C:S:p:T:")) != -1) {
+	while ((op = getopt(argc, argv, "s:b:B:C:S:P:p:T:")) != -1) {
 		switch (op) {
 		case 's':
 			dst_addr = optarg;
@@ -537,6 +558,13 @@ int main(int argc, char **argv)
 				exit(1);
 			}
 			break;
+		case 'P':
+			peer_cnt = atoi(optarg);
+			if (peer_cnt < 1) {
+				printf("peer count must be at least 1\n");
+				exit(1);
+			}
+			break;
 		case 'p':
 			port = optarg;
 			break;
@@ -552,6 +580,7 @@ int main(int argc, char **argv)
 			printf("\t[-B buffer_size]\n");
 			printf("\t[-C transfer_count]\n");
 			printf("\t[-S transfer_size]\n");
+			printf("\t[-P peer_count]\n");
 			printf("\t[-p port_number]\n");
 			printf("\t[-T test_option]\n");
 			printf("\t    s|sockets - use standard tcp/ip sockets\n");
@@ -566,6 +595,11 @@ int main(int argc, char **argv)
 	if (flags)
 		poll_timeout = -1;
 
+	peer_rs = calloc(peer_cnt, sizeof(*peer_rs));
+	if (!peer_rs)
+		exit(1);
+
 	ret = dst_addr ? client_run() : svr_run();
+	free(peer_rs);
 	return ret;
 }
@@ -120,45 +120,56 @@ void idx_replace(struct indexer *idx, int index, void *item)
 }
 
 
-static int idm_grow(struct index_map *idm, int index)
+/*
+ * Index map - second level arrays are allocated on demand and published
+ * with a compare and swap, so that callers setting indices which share an
+ * array do not need to serialize against each other or against lookups.
+ */
+static _Atomic(void *) *idm_grow(struct index_map *idm, int index)
 {
-	idm->array[idx_array_index(index)] = calloc(IDX_ENTRY_SIZE, sizeof(void *));
-	if (!idm->array[idx_array_index(index)])
-		goto nomem;
+	_Atomic(void *) *entry, *cur = NULL;
 
-	return index;
+	entry = calloc(IDX_ENTRY_SIZE, sizeof(*entry));
+	if (!entry) {
+		errno = ENOMEM;
+		return NULL;
+	}
 
-nomem:
-	errno = ENOMEM;
-	return -1;
+	if (!atomic_compare_exchange_strong_explicit(
+		    &idm->array[idx_array_index(index)], &cur, entry,
+		    memory_order_acq_rel, memory_order_acquire)) {
+		free(entry);
+		entry = cur;
+	}
+	return entry;
 }
 
 int idm_set(struct index_map *idm, int index, void *item)
 {
-	void **entry;
+	_Atomic(void *) *entry;
 
-	if (index > IDX_MAX_INDEX) {
+	if (index < 0 || index > IDX_MAX_INDEX) {
 		errno = ENOMEM;
 		return -1;
 	}
 
-	if (!idm->array[idx_array_index(index)]) {
-		if (idm_grow(idm, index) < 0)
+	entry = idm_entry(idm, index);
+	if (!entry) {
+		entry = idm_grow(idm, index);
+		if (!entry)
 			return -1;
 	}
 
-	entry = idm->array[idx_array_index(index)];
-	entry[idx_entry_index(index)] = item;
+	atomic_store_explicit(&entry[idx_entry_index(index)], item,
+			      memory_order_release);
 	return index;
 }
 
 void *idm_clear(struct index_map *idm, int index)
 {
-	void **entry;
-	void *item;
+	_Atomic(void *) *entry;
 
-	entry = idm->array[idx_array_index(index)];
-	item = entry[idx_entry_index(index)];
-	entry[idx_entry_index(index)] = NULL;
-	return item;
+	entry = idm_entry(idm, index);
+	return atomic_exchange_explicit(&entry[idx_entry_index(index)], NULL,
+					memory_order_acq_rel);
 }
@@ -36,6 +36,7 @@
 
 #include <config.h>
 #include <stddef.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 
 /*
@@ -75,30 +76,46 @@ static inline void *idx_at(struct indexer *idx, int index)
 }
 
 /*
- * Index map - associates a structure with an index.  Synchronization
- * must be provided by the caller.  Caller must initialize the
- * index map by setting it to 0.
+ * Index map - associates a structure with an index.  Lookups are lock
+ * free: second level arrays are published atomically and never released,
+ * and entries are read and written atomically.  Callers must ensure that
+ * a given index is not set and cleared concurrently.  Caller must
+ * initialize the index map by setting it to 0.
  */
 
 struct index_map
 {
-	void **array[IDX_ARRAY_SIZE];
+	_Atomic(_Atomic(void *) *) array[IDX_ARRAY_SIZE];
 };
 
 int idm_set(struct index_map *idm, int index, void *item);
 void *idm_clear(struct index_map *idm, int index);
 
+static inline _Atomic(void *) *idm_entry(struct index_map *idm, int index)
+{
+	return atomic_load_explicit(&idm->array[idx_array_index(index)],
+				    memory_order_acquire);
+}
+
 static inline void *idm_at(struct index_map *idm, int index)
 {
-	void **entry;
-	entry = idm->array[idx_array_index(index)];
-	return entry[idx_entry_index(index)];
+	_Atomic(void *) *entry;
+
+	entry = idm_entry(idm, index);
+	return atomic_load_explicit(&entry[idx_entry_index(index)],
+				    memory_order_acquire);
 }
 
 static inline void *idm_lookup(struct index_map *idm, int index)
 {
-	return ((index <= IDX_MAX_INDEX) && idm->array[idx_array_index(index)]) ?
-		idm_at(idm, index) : NULL;
+	_Atomic(void *) *entry;
+
+	if (index < 0 || index > IDX_MAX_INDEX)
+		return NULL;
+
+	entry = idm_entry(idm, index);
+	return entry ? atomic_load_explicit(&entry[idx_entry_index(index)],
+					    memory_order_acquire) : NULL;
 }
 
 typedef struct _dlist_entry {
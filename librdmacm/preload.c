@@ -38,6 +38,8 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <stdarg.h>
 #include <dlfcn.h>
 #include <netdb.h>
@@ -45,11 +47,14 @@
 #include <fcntl.h>
 #include <string.h>
 #include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include <semaphore.h>
+#include <signal.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <inttypes.h>
 
 #include <sys/uio.h>
 
@@ -69,15 +74,26 @@ struct socket_calls {
 	ssize_t (*recvfrom)(int socket, void *buf, size_t len, int flags,
 			    struct sockaddr *src_addr, socklen_t *addrlen);
 	ssize_t (*recvmsg)(int socket, struct msghdr *msg, int flags);
+	int (*recvmmsg)(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags, struct timespec *timeout);
 	ssize_t (*read)(int socket, void *buf, size_t count);
 	ssize_t (*readv)(int socket, const struct iovec *iov, int iovcnt);
 	ssize_t (*send)(int socket, const void *buf, size_t len, int flags);
 	ssize_t (*sendto)(int socket, const void *buf, size_t len, int flags,
 			  const struct sockaddr *dest_addr, socklen_t addrlen);
 	ssize_t (*sendmsg)(int socket, const struct msghdr *msg, int flags);
+	int (*sendmmsg)(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags);
 	ssize_t (*write)(int socket, const void *buf, size_t count);
 	ssize_t (*writev)(int socket, const struct iovec *iov, int iovcnt);
 	int (*poll)(struct pollfd *fds, nfds_t nfds, int timeout);
+	int (*epoll_create)(int size);
+	int (*epoll_create1)(int flags);
+	int (*epoll_ctl)(int epfd, int op, int fd, struct epoll_event *event);
+	int (*epoll_wait)(int epfd, struct epoll_event *events,
+			  int maxevents, int timeout);
+	int (*epoll_pwait)(int epfd, struct epoll_event *events,
+			   int maxevents, int timeout, const sigset_t *sigmask);
 	int (*shutdown)(int socket, int how);
 	int (*close)(int socket);
 	int (*getpeername)(int socket, struct sockaddr *addr, socklen_t *addrlen);
@@ -98,14 +114,27 @@ static struct socket_calls rs;
 static struct index_map idm;
 static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * One bit per fd that is tracked in idm.  Calls on other fds, such as
+ * files and pipes, only read one word of the bitmap before being passed
+ * to the real call.
+ */
+#define FD_MAP_BITS	(8 * sizeof(unsigned long))
+static _Atomic(unsigned long) fd_map[(IDX_MAX_INDEX + 1) / FD_MAP_BITS];
+
 static int sq_size;
 static int rq_size;
 static int sq_inline;
 static int fork_support;
+static int eventfd_bridge;
+
+/* Set while calling into librdmacm, which may call back into us */
+static __thread int recursive;
 
 enum fd_type {
 	fd_normal,
-	fd_rsocket
+	fd_rsocket,
+	fd_epoll
 };
 
 enum fd_fork_state {
@@ -122,6 +151,8 @@ struct fd_info {
 	int fd;
 	int dupfd;
 	_Atomic(int) refcnt;
+	int bridged;
+	_Atomic(int) signaled;
 };
 
 struct config_entry {
@@ -134,6 +165,22 @@ struct config_entry {
 static struct config_entry *config;
 static int config_cnt;
 
+struct policy_entry {
+	enum fd_type type;
+	int family;
+	int prefix;
+	uint8_t addr[16];
+	uint16_t port_lo;
+	uint16_t port_hi;
+};
+
+static struct policy_entry *policy;
+static int policy_cnt;
+
+static FILE *stats_file;
+static struct rdma_stats stats_total;
+static int stats_cnt;
+
 static void free_config(void)
 {
 	while (config_cnt)
@@ -252,6 +299,206 @@ static int intercept_socket(int domain, int type, int protocol)
 	return 0;
 }
 
+static int policy_parse_addr(struct policy_entry *entry, char *str)
+{
+	char *slash;
+	int max;
+
+	if (!strcmp(str, "*"))
+		return 0;
+
+	slash = strchr(str, '/');
+	if (slash)
+		*slash++ = '\0';
+
+	if (inet_pton(AF_INET, str, entry->addr) == 1) {
+		entry->family = AF_INET;
+		max = 32;
+	} else if (inet_pton(AF_INET6, str, entry->addr) == 1) {
+		entry->family = AF_INET6;
+		max = 128;
+	} else {
+		return -1;
+	}
+
+	entry->prefix = slash ? atoi(slash) : max;
+	return (entry->prefix < 0 || entry->prefix > max) ? -1 : 0;
+}
+
+static int policy_parse_port(struct policy_entry *entry, char *str)
+{
+	int lo, hi;
+
+	if (!strcmp(str, "*")) {
+		entry->port_hi = UINT16_MAX;
+		return 0;
+	}
+
+	switch (sscanf(str, "%d-%d", &lo, &hi)) {
+	case 1:
+		hi = lo;
+		break;
+	case 2:
+		break;
+	default:
+		return -1;
+	}
+
+	if (lo < 0 || hi > UINT16_MAX || lo > hi)
+		return -1;
+
+	entry->port_lo = lo;
+	entry->port_hi = hi;
+	return 0;
+}
+
+static void free_policy(void)
+{
+	free(policy);
+}
+
+/*
+ * Policy file format:
+ * # Starting '#' indicates comment
+ * # type - rsocket, tcp
+ * # address - *, IPv4 or IPv6 address, with an optional prefix length
+ * # port - *, port number or range, such as 5000-5100
+ * type address port
+ *
+ * Connecting rsockets are matched against the destination address and
+ * listening rsockets against their local address.  The first matching
+ * entry is used.  Rsockets which do not match any entry are used as is.
+ */
+static void scan_policy(void)
+{
+	struct policy_entry *new_policy;
+	FILE *fp;
+	char line[120], type[16], addr[64], port[16];
+
+	fp = fopen(RS_CONF_DIR "/preload_policy", "r");
+	if (!fp)
+		return;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#')
+			continue;
+
+		if (sscanf(line, "%15s%63s%15s", type, addr, port) != 3)
+			continue;
+
+		new_policy = realloc(policy, (policy_cnt + 1) *
+					     sizeof(struct policy_entry));
+		if (!new_policy)
+			break;
+
+		policy = new_policy;
+		memset(&policy[policy_cnt], 0, sizeof(struct policy_entry));
+
+		if (!strcasecmp(type, "rsocket") || !strcasecmp(type, "rdma"))
+			policy[policy_cnt].type = fd_rsocket;
+		else if (!strcasecmp(type, "tcp"))
+			policy[policy_cnt].type = fd_normal;
+		else
+			continue;
+
+		if (policy_parse_addr(&policy[policy_cnt], addr) ||
+		    policy_parse_port(&policy[policy_cnt], port))
+			continue;
+
+		policy_cnt++;
+	}
+
+	fclose(fp);
+	if (policy)
+		atexit(free_policy);
+}
+
+static int policy_match_addr(struct policy_entry *entry, const uint8_t *addr)
+{
+	int bytes = entry->prefix / 8, bits = entry->prefix % 8;
+
+	if (memcmp(entry->addr, addr, bytes))
+		return 0;
+
+	return !bits || !((entry->addr[bytes] ^ addr[bytes]) &
+			  (0xff << (8 - bits)));
+}
+
+static enum fd_type policy_get(const struct sockaddr *addr)
+{
+	const struct sockaddr_in6 *sin6;
+	const uint8_t *ip;
+	int i, family;
+	uint16_t port;
+
+	if (!policy_cnt || !addr)
+		return fd_rsocket;
+
+	switch (addr->sa_family) {
+	case AF_INET:
+		family = AF_INET;
+		ip = (const uint8_t *) &((const struct sockaddr_in *) addr)->sin_addr;
+		port = be16toh(((const struct sockaddr_in *) addr)->sin_port);
+		break;
+	case AF_INET6:
+		sin6 = (const struct sockaddr_in6 *) addr;
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+			family = AF_INET;
+			ip = &sin6->sin6_addr.s6_addr[12];
+		} else {
+			family = AF_INET6;
+			ip = sin6->sin6_addr.s6_addr;
+		}
+		port = be16toh(sin6->sin6_port);
+		break;
+	default:
+		return fd_rsocket;
+	}
+
+	for (i = 0; i < policy_cnt; i++) {
+		if ((!policy[i].family ||
+		     (policy[i].family == family &&
+		      policy_match_addr(&policy[i], ip))) &&
+		    port >= policy[i].port_lo && port <= policy[i].port_hi)
+			return policy[i].type;
+	}
+
+	return fd_rsocket;
+}
+
+static int fd_insert(int index, struct fd_info *fdi)
+{
+	int ret;
+
+	pthread_mutex_lock(&mut);
+	ret = idm_set(&idm, index, fdi);
+	pthread_mutex_unlock(&mut);
+	if (ret >= 0)
+		atomic_fetch_or_explicit(&fd_map[index / FD_MAP_BITS],
+					 1UL << (index % FD_MAP_BITS),
+					 memory_order_release);
+	return ret;
+}
+
+static void fd_remove(int index)
+{
+	atomic_fetch_and_explicit(&fd_map[index / FD_MAP_BITS],
+				  ~(1UL << (index % FD_MAP_BITS)),
+				  memory_order_relaxed);
+	idm_clear(&idm, index);
+}
+
+static inline struct fd_info *fd_lookup(int index)
+{
+	if (index < 0 || index > IDX_MAX_INDEX ||
+	    !(atomic_load_explicit(&fd_map[index / FD_MAP_BITS],
+				   memory_order_acquire) &
+	      (1UL << (index % FD_MAP_BITS))))
+		return NULL;
+
+	return idm_at(&idm, index);
+}
+
 static int fd_open(void)
 {
 	struct fd_info *fdi;
@@ -261,7 +508,8 @@ static int fd_open(void)
 	if (!fdi)
 		return ERR(ENOMEM);
 
-	index = open("/dev/null", O_RDONLY);
+	index = eventfd_bridge ? eventfd(0, EFD_NONBLOCK) :
+				 open("/dev/null", O_RDONLY);
 	if (index < 0) {
 		ret = index;
 		goto err1;
@@ -269,9 +517,7 @@ static int fd_open(void)
 
 	fdi->dupfd = -1;
 	atomic_store(&fdi->refcnt, 1);
-	pthread_mutex_lock(&mut);
-	ret = idm_set(&idm, index, fdi);
-	pthread_mutex_unlock(&mut);
+	ret = fd_insert(index, fdi);
 	if (ret < 0)
 		goto err2;
 
@@ -298,9 +544,10 @@ static inline enum fd_type fd_get(int index, int *fd)
 {
 	struct fd_info *fdi;
 
-	fdi = idm_lookup(&idm, index);
+	fdi = fd_lookup(index);
 	if (fdi) {
-		*fd = fdi->fd;
+		/* Only repoll calls use the set's own fd, see epoll_create1 */
+		*fd = (fdi->type == fd_epoll) ? index : fdi->fd;
 		return fdi->type;
 
 	} else {
@@ -313,7 +560,7 @@ static inline int fd_getd(int index)
 {
 	struct fd_info *fdi;
 
-	fdi = idm_lookup(&idm, index);
+	fdi = fd_lookup(index);
 	return fdi ? fdi->fd : index;
 }
 
@@ -321,7 +568,7 @@ static inline enum fd_fork_state fd_gets(int index)
 {
 	struct fd_info *fdi;
 
-	fdi = idm_lookup(&idm, index);
+	fdi = fd_lookup(index);
 	return fdi ? fdi->state : fd_ready;
 }
 
@@ -329,7 +576,7 @@ static inline enum fd_type fd_gett(int index)
 {
 	struct fd_info *fdi;
 
-	fdi = idm_lookup(&idm, index);
+	fdi = fd_lookup(index);
 	return fdi ? fdi->type : fd_normal;
 }
 
@@ -338,9 +585,9 @@ static enum fd_type fd_close(int index, int *fd)
 	struct fd_info *fdi;
 	enum fd_type type;
 
-	fdi = idm_lookup(&idm, index);
+	fdi = fd_lookup(index);
 	if (fdi) {
-		idm_clear(&idm, index);
+		fd_remove(index);
 		*fd = fdi->fd;
 		type = fdi->type;
 		real.close(index);
@@ -352,6 +599,223 @@ static enum fd_type fd_close(int index, int *fd)
 	return type;
 }
 
+/*
+ * With RS_EVENTFD set, the fd returned to the application for an rsocket
+ * is an eventfd, which is readable while the rsocket is readable.  This
+ * lets rsockets be monitored by calls that cannot be intercepted, such as
+ * io_uring poll requests.  A bridge thread waits on a repoll set of all
+ * bridged rsockets, and signals the eventfd when one reports an event.
+ * Receive calls reset the eventfd once the rsocket has no more data.  The
+ * eventfd is always writable.
+ */
+#define BRIDGE_BATCH	64
+
+static int bridge_epfd = -1;
+static pthread_once_t bridge_once = PTHREAD_ONCE_INIT;
+/* Held by the bridge thread while it uses an fd_info, see fd_unbridge() */
+static pthread_mutex_t bridge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void bridge_signal(int index, struct fd_info *fdi)
+{
+	uint64_t val = 1;
+
+	atomic_store(&fdi->signaled, 1);
+	if (real.write(index, &val, sizeof val) != sizeof val)
+		atomic_store(&fdi->signaled, 0);
+}
+
+static void *bridge_run(void *arg)
+{
+	struct epoll_event events[BRIDGE_BATCH];
+	struct fd_info *fdi;
+	int i, cnt, index;
+
+	for (;;) {
+		cnt = repoll_wait(bridge_epfd, events, BRIDGE_BATCH, -1);
+		pthread_mutex_lock(&bridge_lock);
+		for (i = 0; i < cnt; i++) {
+			/* The fd may have been closed and reused since */
+			index = (int) (uint32_t) events[i].data.u64;
+			fdi = fd_lookup(index);
+			if (fdi && fdi->bridged && fdi->type == fd_rsocket &&
+			    fdi->fd == (int) (events[i].data.u64 >> 32))
+				bridge_signal(index, fdi);
+		}
+		pthread_mutex_unlock(&bridge_lock);
+	}
+	return NULL;
+}
+
+static void bridge_init(void)
+{
+	pthread_t thread;
+
+	recursive = 1;
+	bridge_epfd = repoll_create1(EPOLL_CLOEXEC);
+	recursive = 0;
+	if (bridge_epfd < 0)
+		return;
+
+	if (pthread_create(&thread, NULL, bridge_run, NULL)) {
+		rclose(bridge_epfd);
+		bridge_epfd = -1;
+		return;
+	}
+
+	pthread_detach(thread);
+}
+
+/*
+ * Add an rsocket to the bridge set, or have the bridge thread check it
+ * again after its state changes.  repoll_ctl wakes the bridge thread.
+ */
+static void fd_bridge(int index)
+{
+	struct epoll_event event;
+	struct fd_info *fdi;
+	int op;
+
+	if (!eventfd_bridge)
+		return;
+
+	pthread_once(&bridge_once, bridge_init);
+	fdi = fd_lookup(index);
+	if (bridge_epfd < 0 || !fdi || fdi->type != fd_rsocket)
+		return;
+
+	op = fdi->bridged ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	event.data.u64 = ((uint64_t) fdi->fd << 32) | (uint32_t) index;
+	if (!repoll_ctl(bridge_epfd, op, fdi->fd, &event))
+		fdi->bridged = 1;
+}
+
+/*
+ * Wait for the bridge thread to finish with a closing fd.  The caller has
+ * already removed the fd from the map, so once bridge_lock is acquired the
+ * bridge thread can no longer be using the fd_info or writing the eventfd,
+ * and both may be released.  Later events for the rsocket fail the lookup,
+ * and rclose() takes it out of the bridge set.
+ */
+static void fd_unbridge(struct fd_info *fdi)
+{
+	if (!fdi->bridged)
+		return;
+
+	pthread_mutex_lock(&bridge_lock);
+	fdi->bridged = 0;
+	pthread_mutex_unlock(&bridge_lock);
+}
+
+/*
+ * Reset a signaled eventfd, then signal it again if the rsocket is still
+ * readable.  A concurrent signal from the bridge thread is either consumed
+ * here and replaced by the readiness check, or left pending.
+ */
+static void fd_bridge_reset(int index, struct fd_info *fdi)
+{
+	struct pollfd fds;
+	uint64_t val;
+	int save_errno = errno;
+
+	atomic_store(&fdi->signaled, 0);
+	real.read(index, &val, sizeof val);
+
+	fds.fd = fdi->fd;
+	fds.events = POLLIN;
+	if (rpoll(&fds, 1, 0) > 0)
+		bridge_signal(index, fdi);
+	errno = save_errno;
+}
+
+static inline ssize_t fd_rearm(int index, ssize_t ret)
+{
+	struct fd_info *fdi;
+
+	if (eventfd_bridge) {
+		fdi = fd_lookup(index);
+		if (fdi && fdi->bridged && atomic_load(&fdi->signaled))
+			fd_bridge_reset(index, fdi);
+	}
+	return ret;
+}
+
+static void print_stats(const char *peer, struct rdma_stats *stats)
+{
+	fprintf(stats_file, "%s[%d] %s bytes_sent %" PRIu64
+		" bytes_recv %" PRIu64 " writes %" PRIu64
+		" inline_writes %" PRIu64 " iomap_writes %" PRIu64
+		" ctrl_sent %" PRIu64 " ctrl_recv %" PRIu64
+		" credit_stalls %" PRIu64 " send_stalls %" PRIu64
+		" cq_polls %" PRIu64 " cq_entries %" PRIu64
+		" resizes %" PRIu64 "\n",
+		program_invocation_short_name, getpid(), peer,
+		stats->bytes_sent, stats->bytes_recv, stats->writes,
+		stats->inline_writes, stats->iomap_writes, stats->ctrl_sent,
+		stats->ctrl_recv, stats->credit_stalls, stats->send_stalls,
+		stats->cq_polls, stats->cq_entries, stats->resizes);
+}
+
+static void close_stats(void)
+{
+	char name[32];
+
+	/* Other threads may still be closing rsockets */
+	pthread_mutex_lock(&mut);
+	snprintf(name, sizeof name, "total(%d)", stats_cnt);
+	print_stats(name, &stats_total);
+	fclose(stats_file);
+	stats_file = NULL;
+	pthread_mutex_unlock(&mut);
+}
+
+/*
+ * When RS_STATS_FILE is set, the counters of each rsocket are appended to
+ * the file when the rsocket is closed, followed by the totals at exit.
+ * The file may be a named pipe read by a monitoring tool.
+ */
+static void open_stats(const char *path)
+{
+	stats_file = fopen(path, "a");
+	if (!stats_file)
+		return;
+
+	setvbuf(stats_file, NULL, _IOLBF, 0);
+	atexit(close_stats);
+}
+
+static void record_stats(int fd)
+{
+	struct rdma_stats stats;
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof stats;
+	char host[NI_MAXHOST], serv[NI_MAXSERV], peer[sizeof host + sizeof serv];
+	uint64_t *total, *cur;
+	size_t i;
+
+	if (rgetsockopt(fd, SOL_RDMA, RDMA_STATS, &stats, &len))
+		return;
+
+	len = sizeof addr;
+	if (!rgetpeername(fd, (struct sockaddr *) &addr, &len) &&
+	    !getnameinfo((struct sockaddr *) &addr, len, host, sizeof host,
+			 serv, sizeof serv, NI_NUMERICHOST | NI_NUMERICSERV))
+		snprintf(peer, sizeof peer, "%s:%s", host, serv);
+	else
+		strcpy(peer, "-");
+
+	total = (uint64_t *) &stats_total;
+	cur = (uint64_t *) &stats;
+	pthread_mutex_lock(&mut);
+	if (stats_file) {
+		for (i = 0; i < sizeof(stats) / sizeof(*cur); i++)
+			total[i] += cur[i];
+		stats_cnt++;
+		print_stats(peer, &stats);
+	}
+	pthread_mutex_unlock(&mut);
+}
+
 static void getenv_options(void)
 {
 	char *var;
@@ -371,6 +835,14 @@ static void getenv_options(void)
 	var = getenv("RDMAV_FORK_SAFE");
 	if (var)
 		fork_support = atoi(var);
+
+	var = getenv("RS_STATS_FILE");
+	if (var)
+		open_stats(var);
+
+	var = getenv("RS_EVENTFD");
+	if (var)
+		eventfd_bridge = atoi(var);
 }
 
 static void init_preload(void)
@@ -393,14 +865,21 @@ static void init_preload(void)
 	real.recv = dlsym(RTLD_NEXT, "recv");
 	real.recvfrom = dlsym(RTLD_NEXT, "recvfrom");
 	real.recvmsg = dlsym(RTLD_NEXT, "recvmsg");
+	real.recvmmsg = dlsym(RTLD_NEXT, "recvmmsg");
 	real.read = dlsym(RTLD_NEXT, "read");
 	real.readv = dlsym(RTLD_NEXT, "readv");
 	real.send = dlsym(RTLD_NEXT, "send");
 	real.sendto = dlsym(RTLD_NEXT, "sendto");
 	real.sendmsg = dlsym(RTLD_NEXT, "sendmsg");
+	real.sendmmsg = dlsym(RTLD_NEXT, "sendmmsg");
 	real.write = dlsym(RTLD_NEXT, "write");
 	real.writev = dlsym(RTLD_NEXT, "writev");
 	real.poll = dlsym(RTLD_NEXT, "poll");
+	real.epoll_create = dlsym(RTLD_NEXT, "epoll_create");
+	real.epoll_create1 = dlsym(RTLD_NEXT, "epoll_create1");
+	real.epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+	real.epoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
+	real.epoll_pwait = dlsym(RTLD_NEXT, "epoll_pwait");
 	real.shutdown = dlsym(RTLD_NEXT, "shutdown");
 	real.close = dlsym(RTLD_NEXT, "close");
 	real.getpeername = dlsym(RTLD_NEXT, "getpeername");
@@ -420,14 +899,21 @@ static void init_preload(void)
 	rs.recv = dlsym(RTLD_DEFAULT, "rrecv");
 	rs.recvfrom = dlsym(RTLD_DEFAULT, "rrecvfrom");
 	rs.recvmsg = dlsym(RTLD_DEFAULT, "rrecvmsg");
+	rs.recvmmsg = dlsym(RTLD_DEFAULT, "rrecvmmsg");
 	rs.read = dlsym(RTLD_DEFAULT, "rread");
 	rs.readv = dlsym(RTLD_DEFAULT, "rreadv");
 	rs.send = dlsym(RTLD_DEFAULT, "rsend");
 	rs.sendto = dlsym(RTLD_DEFAULT, "rsendto");
 	rs.sendmsg = dlsym(RTLD_DEFAULT, "rsendmsg");
+	rs.sendmmsg = dlsym(RTLD_DEFAULT, "rsendmmsg");
 	rs.write = dlsym(RTLD_DEFAULT, "rwrite");
 	rs.writev = dlsym(RTLD_DEFAULT, "rwritev");
 	rs.poll = dlsym(RTLD_DEFAULT, "rpoll");
+	rs.epoll_create = dlsym(RTLD_DEFAULT, "repoll_create");
+	rs.epoll_create1 = dlsym(RTLD_DEFAULT, "repoll_create1");
+	rs.epoll_ctl = dlsym(RTLD_DEFAULT, "repoll_ctl");
+	rs.epoll_wait = dlsym(RTLD_DEFAULT, "repoll_wait");
+	rs.epoll_pwait = dlsym(RTLD_DEFAULT, "repoll_pwait");
 	rs.shutdown = dlsym(RTLD_DEFAULT, "rshutdown");
 	rs.close = dlsym(RTLD_DEFAULT, "rclose");
 	rs.getpeername = dlsym(RTLD_DEFAULT, "rgetpeername");
@@ -438,6 +924,7 @@ static void init_preload(void)
 
 	getenv_options();
 	scan_config();
+	scan_policy();
 	init = 1;
 out:
 	pthread_mutex_unlock(&mut);
@@ -475,6 +962,19 @@ static int copysockopts(int dfd, int sfd, struct socket_calls *dapi,
 	return 0;
 }
 
+/*
+ * Only stream rsockets can be moved to a normal socket, which is always a
+ * TCP socket.  Datagram rsockets ignore the policy.
+ */
+static int rs_is_stream(int fd)
+{
+	socklen_t len = sizeof(int);
+	int type;
+
+	return !rgetsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) &&
+	       type == SOCK_STREAM;
+}
+
 /*
  * Convert between an rsocket and a normal socket.
  */
@@ -531,7 +1031,6 @@ static void set_rsocket_options(int rsocket)
 
 int socket(int domain, int type, int protocol)
 {
-	static __thread int recursive;
 	int index, ret;
 
 	init_preload();
@@ -567,16 +1066,59 @@ real:
 
 int bind(int socket, const struct sockaddr *addr, socklen_t addrlen)
 {
-	int fd;
-	return (fd_get(socket, &fd) == fd_rsocket) ?
-		rbind(fd, addr, addrlen) : real.bind(fd, addr, addrlen);
+	int fd, ret;
+
+	if (fd_get(socket, &fd) != fd_rsocket)
+		return real.bind(fd, addr, addrlen);
+
+	ret = rbind(fd, addr, addrlen);
+	if (!ret)
+		fd_bridge(socket);
+	return ret;
+}
+
+/*
+ * Move a bound rsocket to a normal socket bound to the same address.
+ */
+static int transpose_bound_socket(int socket)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof addr;
+	int sfd, dfd, ret;
+
+	sfd = fd_getd(socket);
+	ret = rgetsockname(sfd, (struct sockaddr *) &addr, &len);
+	if (ret)
+		return ret;
+
+	dfd = transpose_socket(socket, fd_normal);
+	if (dfd < 0)
+		return dfd;
+
+	rclose(sfd);
+	ret = real.bind(dfd, (struct sockaddr *) &addr, len);
+	return ret ? ret : dfd;
 }
 
 int listen(int socket, int backlog)
 {
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof addr;
 	int fd, ret;
-	if (fd_get(socket, &fd) == fd_rsocket) {
+
+	if (fd_get(socket, &fd) == fd_rsocket && policy_cnt &&
+	    rs_is_stream(fd) &&
+	    !rgetsockname(fd, (struct sockaddr *) &addr, &len) &&
+	    policy_get((struct sockaddr *) &addr) == fd_normal) {
+		fd = transpose_bound_socket(socket);
+		if (fd < 0)
+			return fd;
+	}
+
+	if (fd_gett(socket) == fd_rsocket) {
 		ret = rlisten(fd, backlog);
+		if (!ret)
+			fd_bridge(socket);
 	} else {
 		ret = real.listen(fd, backlog);
 		if (!ret && fd_gets(socket) == fd_fork)
@@ -594,13 +1136,14 @@ int accept(int socket, struct sockaddr *addr, socklen_t *addrlen)
 		if (index < 0)
 			return index;
 
-		ret = raccept(fd, addr, addrlen);
+		ret = fd_rearm(socket, raccept(fd, addr, addrlen));
 		if (ret < 0) {
 			fd_close(index, &fd);
 			return ret;
 		}
 
 		fd_store(index, ret, fd_rsocket, fd_ready);
+		fd_bridge(index);
 		return index;
 	} else if (fd_gets(socket) == fd_fork_listen) {
 		index = fd_open();
@@ -749,7 +1292,7 @@ static inline enum fd_type fd_fork_get(int index, int *fd)
 {
 	struct fd_info *fdi;
 
-	fdi = idm_lookup(&idm, index);
+	fdi = fd_lookup(index);
 	if (fdi) {
 		if (fdi->state == fd_fork_passive)
 			fork_passive(index);
@@ -766,12 +1309,19 @@ static inline enum fd_type fd_fork_get(int index, int *fd)
 
 int connect(int socket, const struct sockaddr *addr, socklen_t addrlen)
 {
-	int fd, ret;
+	int fd, ret, stream;
 
 	if (fd_get(socket, &fd) == fd_rsocket) {
-		ret = rconnect(fd, addr, addrlen);
-		if (!ret || errno == EINPROGRESS)
-			return ret;
+		stream = rs_is_stream(fd);
+		if (!stream || policy_get(addr) == fd_rsocket) {
+			ret = rconnect(fd, addr, addrlen);
+			if (!ret || errno == EINPROGRESS) {
+				fd_bridge(socket);
+				return ret;
+			}
+			if (!stream)
+				return ret;
+		}
 
 		ret = transpose_socket(socket, fd_normal);
 		if (ret < 0)
@@ -790,7 +1340,8 @@ ssize_t recv(int socket, void *buf, size_t len, int flags)
 {
 	int fd;
 	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
-		rrecv(fd, buf, len, flags) : real.recv(fd, buf, len, flags);
+		fd_rearm(socket, rrecv(fd, buf, len, flags)) :
+		real.recv(fd, buf, len, flags);
 }
 
 ssize_t recvfrom(int socket, void *buf, size_t len, int flags,
@@ -798,7 +1349,8 @@ ssize_t recvfrom(int socket, void *buf, size_t len, int flags,
 {
 	int fd;
 	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
-		rrecvfrom(fd, buf, len, flags, src_addr, addrlen) :
+		fd_rearm(socket, rrecvfrom(fd, buf, len, flags,
+					   src_addr, addrlen)) :
 		real.recvfrom(fd, buf, len, flags, src_addr, addrlen);
 }
 
@@ -806,7 +1358,18 @@ ssize_t recvmsg(int socket, struct msghdr *msg, int flags)
 {
 	int fd;
 	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
-		rrecvmsg(fd, msg, flags) : real.recvmsg(fd, msg, flags);
+		fd_rearm(socket, rrecvmsg(fd, msg, flags)) :
+		real.recvmsg(fd, msg, flags);
+}
+
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	     int flags, struct timespec *timeout)
+{
+	int fd;
+	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
+		fd_rearm(socket, rrecvmmsg(fd, msgvec, vlen, flags,
+					   timeout)) :
+		real.recvmmsg(fd, msgvec, vlen, flags, timeout);
 }
 
 ssize_t read(int socket, void *buf, size_t count)
@@ -814,7 +1377,8 @@ ssize_t read(int socket, void *buf, size_t count)
 	int fd;
 	init_preload();
 	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
-		rread(fd, buf, count) : real.read(fd, buf, count);
+		fd_rearm(socket, rread(fd, buf, count)) :
+		real.read(fd, buf, count);
 }
 
 ssize_t readv(int socket, const struct iovec *iov, int iovcnt)
@@ -822,7 +1386,8 @@ ssize_t readv(int socket, const struct iovec *iov, int iovcnt)
 	int fd;
 	init_preload();
 	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
-		rreadv(fd, iov, iovcnt) : real.readv(fd, iov, iovcnt);
+		fd_rearm(socket, rreadv(fd, iov, iovcnt)) :
+		real.readv(fd, iov, iovcnt);
 }
 
 ssize_t send(int socket, const void *buf, size_t len, int flags)
@@ -848,6 +1413,14 @@ ssize_t sendmsg(int socket, const struct msghdr *msg, int flags)
 		rsendmsg(fd, msg, flags) : real.sendmsg(fd, msg, flags);
 }
 
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	int fd;
+	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
+		rsendmmsg(fd, msgvec, vlen, flags) :
+		real.sendmmsg(fd, msgvec, vlen, flags);
+}
+
 ssize_t write(int socket, const void *buf, size_t count)
 {
 	int fd;
@@ -992,6 +1565,95 @@ int select(int nfds, fd_set *readfds, fd_set *writefds,
 	return ret;
 }
 
+/*
+ * Epoll sets are always created through repoll, since the application
+ * may add rsockets to them at any time.  Normal fd's in a repoll set are
+ * handled directly by the kernel.  The application is given a duplicate
+ * of the set's kernel epoll fd, so that fcntl, close-on-exec, poll and
+ * nesting the set in another epoll set all act on a real epoll fd.
+ */
+int epoll_create1(int flags)
+{
+	struct fd_info *fdi;
+	int index, ret;
+
+	init_preload();
+	if (recursive)
+		return real.epoll_create1(flags);
+
+	fdi = calloc(1, sizeof(*fdi));
+	if (!fdi)
+		return ERR(ENOMEM);
+
+	recursive = 1;
+	ret = repoll_create1(flags);
+	recursive = 0;
+	if (ret < 0)
+		goto err1;
+
+	index = real.fcntl(ret, (flags & EPOLL_CLOEXEC) ?
+			   F_DUPFD_CLOEXEC : F_DUPFD, 0);
+	if (index < 0)
+		goto err2;
+
+	fdi->fd = ret;
+	fdi->type = fd_epoll;
+	fdi->state = fd_ready;
+	fdi->dupfd = -1;
+	atomic_store(&fdi->refcnt, 1);
+	if (fd_insert(index, fdi) < 0)
+		goto err3;
+
+	return index;
+
+err3:
+	real.close(index);
+err2:
+	rclose(ret);
+err1:
+	free(fdi);
+	return real.epoll_create1(flags);
+}
+
+int epoll_create(int size)
+{
+	if (size <= 0)
+		return ERR(EINVAL);
+
+	return epoll_create1(0);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	int efd;
+
+	init_preload();
+	return (fd_get(epfd, &efd) == fd_epoll) ?
+		repoll_ctl(fd_getd(epfd), op, fd_getd(fd), event) :
+		real.epoll_ctl(efd, op, fd, event);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	int efd;
+
+	init_preload();
+	return (fd_get(epfd, &efd) == fd_epoll) ?
+		repoll_wait(fd_getd(epfd), events, maxevents, timeout) :
+		real.epoll_wait(efd, events, maxevents, timeout);
+}
+
+int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+		int timeout, const sigset_t *sigmask)
+{
+	int efd;
+
+	init_preload();
+	return (fd_get(epfd, &efd) == fd_epoll) ?
+		repoll_pwait(fd_getd(epfd), events, maxevents, timeout, sigmask) :
+		real.epoll_pwait(efd, events, maxevents, timeout, sigmask);
+}
+
 int shutdown(int socket, int how)
 {
 	int fd;
@@ -1005,7 +1667,7 @@ int close(int socket)
 	int ret;
 
 	init_preload();
-	fdi = idm_lookup(&idm, socket);
+	fdi = fd_lookup(socket);
 	if (!fdi)
 		return real.close(socket);
 
@@ -1018,9 +1680,12 @@ int close(int socket)
 	if (atomic_fetch_sub(&fdi->refcnt, 1) != 1)
 		return 0;
 
-	idm_clear(&idm, socket);
+	fd_remove(socket);
+	fd_unbridge(fdi);
 	real.close(socket);
-	ret = (fdi->type == fd_rsocket) ? rclose(fdi->fd) : real.close(fdi->fd);
+	if (stats_file && fdi->type == fd_rsocket)
+		record_stats(fdi->fd);
+	ret = (fdi->type == fd_normal) ? real.close(fdi->fd) : rclose(fdi->fd);
 	free(fdi);
 	return ret;
 }
@@ -1109,7 +1774,7 @@ int dup2(int oldfd, int newfd)
 	int ret;
 
 	init_preload();
-	oldfdi = idm_lookup(&idm, oldfd);
+	oldfdi = fd_lookup(oldfd);
 	if (oldfdi) {
 		if (oldfdi->state == fd_fork_passive)
 			fork_passive(oldfd);
@@ -1117,7 +1782,7 @@ int dup2(int oldfd, int newfd)
 			fork_active(oldfd);
 	}
 
-	newfdi = idm_lookup(&idm, newfd);
+	newfdi = fd_lookup(newfd);
 	if (newfdi) {
 		 /* newfd cannot have been dup'ed directly */
 		if (atomic_load(&newfdi->refcnt) > 1)
@@ -1135,41 +1800,28 @@ int dup2(int oldfd, int newfd)
 		return ERR(ENOMEM);
 	}
 
-	pthread_mutex_lock(&mut);
-	idm_set(&idm, newfd, newfdi);
-	pthread_mutex_unlock(&mut);
-
 	newfdi->fd = oldfdi->fd;
 	newfdi->type = oldfdi->type;
 	if (oldfdi->dupfd != -1) {
 		newfdi->dupfd = oldfdi->dupfd;
-		oldfdi = idm_lookup(&idm, oldfdi->dupfd);
+		oldfdi = fd_lookup(oldfdi->dupfd);
 	} else {
 		newfdi->dupfd = oldfd;
 	}
 	atomic_store(&newfdi->refcnt, 1);
 	atomic_fetch_add(&oldfdi->refcnt, 1);
+	fd_insert(newfd, newfdi);
 	return newfd;
 }
 
 ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
 {
-	void *file_addr;
 	int fd;
-	size_t ret;
 
 	if (fd_get(out_fd, &fd) != fd_rsocket)
 		return real.sendfile(fd, in_fd, offset, count);
 
-	file_addr = mmap(NULL, count, PROT_READ, 0, in_fd, offset ? *offset : 0);
-	if (file_addr == (void *) -1)
-		return -1;
-
-	ret = rwrite(fd, file_addr, count);
-	if ((ret > 0) && offset)
-		lseek(in_fd, ret, SEEK_CUR);
-	munmap(file_addr, count);
-	return ret;
+	return rsendfile(fd, in_fd, offset, count);
 }
 
 int __fxstat(int ver, int socket, struct stat *buf)
@@ -178,6 +178,7 @@ struct rdma_cm_event {
 #define RAI_NUMERICHOST		0x00000002
 #define RAI_NOROUTE		0x00000004
 #define RAI_FAMILY		0x00000008
+#define RAI_POOL		0x00000010
 
 struct rdma_addrinfo {
 	int			ai_flags;
@@ -220,6 +221,33 @@ struct rdma_cm_join_mc_attr_ex {
 	struct sockaddr *addr;
 };
 
+struct rdma_cm_peer {
+	/* Optional source address, may be NULL */
+	struct sockaddr		*src_addr;
+	struct sockaddr		*dst_addr;
+	/* Set as the context of the connected rdma_cm_id */
+	void			*context;
+	/* Set on completion */
+	struct rdma_cm_id	*id;
+	int			status;
+	uint32_t		resolve_addr_us;
+	uint32_t		resolve_route_us;
+	uint32_t		connect_us;
+};
+
+struct rdma_cm_peers_attr {
+	enum rdma_port_space	ps;
+	/* Used to create a QP for each peer, unless qp_init_attr is NULL */
+	struct ibv_pd		*pd;
+	struct ibv_qp_init_attr	*qp_init_attr;
+	struct rdma_conn_param	*conn_param;
+	/* Address and route resolution timeout and retries */
+	int			timeout_ms;
+	int			retries;
+	/* Maximum number of peers being connected at once, 0 for default */
+	int			window;
+};
+
 /**
  * rdma_create_event_channel - Open a channel used to report communication events.
  * Description:
@@ -646,6 +674,25 @@ int rdma_join_multicast_ex(struct rdma_cm_id *id,
 int rdma_get_cm_event(struct rdma_event_channel *channel,
 		      struct rdma_cm_event **event);
 
+/**
+ * rdma_get_cm_events - Retrieves a batch of pending communication events.
+ * @channel: Event channel to check for events.
+ * @events: Array that receives the retrieved events.
+ * @max: Maximum number of events to retrieve.
+ * Description:
+ *   Retrieves up to max communication events.  If no events are pending, by
+ *   default, the call will block until an event is received.  Once an event
+ *   has been retrieved, the call returns as soon as no more events are
+ *   pending.  Returns the number of events retrieved.
+ * Notes:
+ *   Each reported event must be acknowledged by calling rdma_ack_cm_event.
+ *   Event structures are reused after they have been acknowledged.
+ * See also:
+ *   rdma_get_cm_event, rdma_ack_cm_event, rdma_create_event_channel
+ */
+int rdma_get_cm_events(struct rdma_event_channel *channel,
+		       struct rdma_cm_event **events, int max);
+
 /**
  * rdma_ack_cm_event - Free a communication event.
  * @event: Event to be released.
@@ -777,6 +824,30 @@ int rdma_set_local_ece(struct rdma_cm_id *id, struct ibv_ece *ece);
  * @ece: ECE parameters
  */
 int rdma_get_remote_ece(struct rdma_cm_id *id, struct ibv_ece *ece);
+
+/**
+ * rdma_connect_peers - Connect to a set of remote peers.
+ * @channel: Event channel used to report events for the new rdma_cm_ids.
+ * @peers: Array of peers to connect to.
+ * @cnt: Number of peers in the array.
+ * @attr: Connection attributes used for all peers.
+ * Description:
+ *   Creates an rdma_cm_id for each peer and drives address resolution,
+ *   route resolution, QP creation and connection establishment for up to
+ *   attr->window peers at a time.  Returns once every peer has either
+ *   connected or failed.  The id and status of each peer are set on
+ *   completion, along with the time spent in each step.  Returns the number
+ *   of connected peers, or -1 on error.
+ * Notes:
+ *   The peers are driven on a private channel, so events for other
+ *   rdma_cm_ids on the channel are not consumed.  Connected rdma_cm_ids
+ *   are migrated to the channel before the call returns.
+ * See also:
+ *   rdma_create_id, rdma_resolve_addr, rdma_resolve_route, rdma_connect
+ */
+int rdma_connect_peers(struct rdma_event_channel *channel,
+		       struct rdma_cm_peer *peers, int cnt,
+		       struct rdma_cm_peers_attr *attr);
 #ifdef __cplusplus
 }
 #endif
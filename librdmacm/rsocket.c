@@ -36,6 +36,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <endian.h>
 #include <stdarg.h>
 #include <netdb.h>
@@ -83,17 +85,30 @@ enum {
 	RS_SVC_MOD_KEEPALIVE,
 	RS_SVC_ADD_CM,
 	RS_SVC_REM_CM,
+	RS_SVC_ACCEPT_CM,
 };
 
 struct rs_svc_msg {
+	struct rs_svc_msg *next;
 	uint32_t cmd;
 	uint32_t status;
 	struct rsocket *rs;
+	sem_t *done;	/* NULL for asynchronous requests */
 };
 
+/*
+ * Requests are pushed onto a lock-free list by any thread and are taken
+ * off as a batch by the service thread, which is woken through an eventfd.
+ * The reference count holds one reference for each queued request and for
+ * each rsocket that the service is tracking.  The service thread exits once
+ * the count drops to 0, and is restarted by the next request.
+ */
 struct rs_svc {
 	pthread_t id;
-	int sock[2];
+	int active;
+	int efd;
+	_Atomic(struct rs_svc_msg *) msgs;
+	_Atomic(int) ref;
 	int cnt;
 	int size;
 	int context_size;
@@ -114,26 +129,62 @@ static struct rs_svc tcp_svc = {
 	.context_size = sizeof(*tcp_svc_timeouts),
 	.run = tcp_svc_run
 };
-static void *cm_svc_run(void *arg);
-static struct rs_svc listen_svc = {
-	.context_size = sizeof(struct pollfd),
-	.run = cm_svc_run
-};
-static struct rs_svc connect_svc = {
-	.context_size = sizeof(struct pollfd),
-	.run = cm_svc_run
-};
 
-static uint32_t pollcnt;
-static bool suspendpoll;
+/*
+ * Listening and connecting rsockets are spread across several cm service
+ * threads, selected by the rsocket's index.  See rs_cm_svc().
+ */
+#define RS_CM_SVC_MAX 16
+static void *listen_svc_run(void *arg);
+static void *connect_svc_run(void *arg);
+static struct rs_svc listen_svc[RS_CM_SVC_MAX];
+static struct rs_svc connect_svc[RS_CM_SVC_MAX];
+static uint16_t cm_svc_threads = 4;
+
+/*
+ * The poll gate holds the number of threads blocked in rpoll(), plus a
+ * flag indicating that those threads have been signaled to return and
+ * re-check their rsockets.  While the signal is being written, PENDING
+ * is set, and SIGNALED is set once the write succeeds.  If the last thread
+ * leaving the gate has to wait for PENDING to clear, it sets WAITING, and
+ * only then is clearing PENDING announced on pollcond.  See rs_poll_stop().
+ */
+#define RS_POLL_SUSPEND (1U << 31)
+#define RS_POLL_PENDING (1U << 30)
+#define RS_POLL_SIGNALED (1U << 29)
+#define RS_POLL_WAITING (1U << 28)
+#define RS_POLL_FLAGS (RS_POLL_SUSPEND | RS_POLL_PENDING | RS_POLL_SIGNALED | \
+		       RS_POLL_WAITING)
+#define rs_poll_cnt(gate) ((gate) & ~RS_POLL_FLAGS)
+static _Atomic(uint32_t) pollgate;
 static int pollsignal = -1;
+static pthread_mutex_t pollmut = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pollcond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * repoll sets.  Each set is backed by a kernel epoll fd, which is the
+ * handle returned to the user.  The list is only walked when an rsocket
+ * which belongs to a set is closed.
+ */
+static struct index_map epidm;
+static dlist_entry epoll_list = { &epoll_list, &epoll_list };
+static pthread_mutex_t epoll_mut = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Shared receive contexts, one or more per device.  See rs_get_shared().
+ */
+static dlist_entry shared_list = { &shared_list, &shared_list };
+static pthread_mutex_t shared_mut = PTHREAD_MUTEX_INITIALIZER;
 
 static uint16_t def_iomap_size = 0;
 static uint16_t def_inline = 64;
 static uint16_t def_sqsize = 384;
 static uint16_t def_rqsize = 384;
+static uint32_t def_srqsize = 0;
 static uint32_t def_mem = (1 << 17);
 static uint32_t def_wmem = (1 << 17);
+static uint32_t def_mem_max = (1 << 22);
+static uint32_t def_wmem_max = (1 << 22);
 static uint32_t polling_time = 10;
 static int wake_up_interval = 5000;
 
@@ -150,6 +201,10 @@ static int wake_up_interval = 5000;
  * bits [28-0]: receive credits granted
  * IOMAP_SGL
  * bits [28-16]: reserved, bits [15-0]: index
+ * RESIZE
+ * bits [28-27]: request, ack, or hint, bits [26-16]: target sequence number
+ * (request) or stale target count (ack), bits [15-0]: receive buffer size in
+ * RS_RESIZE_UNIT bytes
  */
 
 enum {
@@ -158,7 +213,7 @@ enum {
 	RS_OP_WRITE, /* opcode is not transmitted over the network */
 	RS_OP_RSVD_DRA_MORE,
 	RS_OP_SGL,
-	RS_OP_RSVD,
+	RS_OP_RESIZE,
 	RS_OP_IOMAP_SGL,
 	RS_OP_CTRL
 };
@@ -167,8 +222,26 @@ enum {
 #define rs_msg_data(imm_data) (imm_data & 0x1FFFFFFF)
 #define RS_MSG_SIZE	      sizeof(uint32_t)
 
+enum {
+	RS_RESIZE_REQ,
+	RS_RESIZE_ACK,
+	RS_RESIZE_HINT
+};
+#define rs_resize_set(type, seq, units) \
+	((type << 27) | ((uint32_t) (seq) & 0x7FF) << 16 | (uint32_t) (units))
+#define rs_resize_type(data)  ((data >> 27) & 0x3)
+#define rs_resize_seq(data)   ((data >> 16) & 0x7FF)
+#define rs_resize_units(data) (data & 0xFFFF)
+#define RS_RESIZE_UNIT	      4096
+#define RS_RESIZE_MAX	      (0xFFFF * RS_RESIZE_UNIT)
+#define RS_RESIZE_STALLS      4
+#define RS_RESIZE_SLACK_US    20
+#define RS_RESIZE_IDLE_US     1000000
+#define RS_SHARED_BUF_SIZE    (1 << 14)
+
 #define RS_WR_ID_FLAG_RECV (((uint64_t) 1) << 63)
 #define RS_WR_ID_FLAG_MSG_SEND (((uint64_t) 1) << 62) /* See RS_OPT_MSG_SEND */
+#define RS_WR_ID_FLAG_SENDFILE (((uint64_t) 1) << 61) /* See rs_sendfile_mr */
 #define rs_send_wr_id(data) ((uint64_t) data)
 #define rs_recv_wr_id(data) (RS_WR_ID_FLAG_RECV | (uint64_t) data)
 #define rs_wr_is_recv(wr_id) (wr_id & RS_WR_ID_FLAG_RECV)
@@ -217,10 +290,28 @@ struct rs_iomap_mr {
 	int index;	/* -1 if mapping is local and not in iomap_list */
 };
 
+/*
+ * A piece of a file mapped and registered by rsendfile.  The writes from
+ * it complete in order with the rest of the send queue, so completions
+ * flagged with RS_WR_ID_FLAG_SENDFILE always belong to the oldest piece.
+ * The piece is released once it is done posting and all of its writes
+ * have completed.  Protected by the cq_lock.
+ */
+struct rs_sendfile_mr {
+	dlist_entry entry;
+	struct ibv_mr *mr;
+	void *map;
+	size_t map_len;
+	uint32_t posted;
+	uint32_t completed;
+	int done;
+};
+
 #define RS_MAX_CTRL_MSG    (sizeof(struct rs_sge))
 #define rs_host_is_net()   (__BYTE_ORDER == __BIG_ENDIAN)
 #define RS_CONN_FLAG_NET   (1 << 0)
 #define RS_CONN_FLAG_IOMAP (1 << 1)
+#define RS_CONN_FLAG_RESIZE (1 << 2)
 
 struct rs_conn_data {
 	uint8_t		  version;
@@ -272,6 +363,11 @@ enum rs_state {
 #define RS_OPT_UDP_SVC    (1 << 2)
 #define RS_OPT_KEEPALIVE  (1 << 3)
 #define RS_OPT_CM_SVC	  (1 << 4)
+/*
+ * Both sides support changing the size of the receive buffer after the
+ * connection has been established.  See rs_post_resize.
+ */
+#define RS_OPT_RESIZE	  (1 << 5)
 
 union socket_addr {
 	struct sockaddr		sa;
@@ -302,6 +398,18 @@ struct ds_dest {
 	uint32_t	   qpn;
 };
 
+/*
+ * Destinations are found through an open addressing hash table, using
+ * linear probing.  The hash is stored with each entry, so that most
+ * mismatches are rejected without touching the destination.
+ */
+struct ds_dest_entry {
+	uint32_t	  hash;
+	struct ds_dest	  *dest;	/* NULL if the entry is free */
+};
+
+#define DS_DEST_MAP_MIN 16
+
 struct ds_qp {
 	dlist_entry	  list;
 	struct rsocket	  *rs;
@@ -316,6 +424,64 @@ struct ds_qp {
 	int		  cq_armed;
 };
 
+/*
+ * Stream rsockets on the same device may share a receive queue and a
+ * completion queue.  Receive buffers are posted to the SRQ, and the CQ is
+ * drained by a per-context thread, which processes each completion for the
+ * owning rsocket and signals the rsocket's notify fd if a user is waiting.
+ * The cq_lock replaces the cq_lock of each rsocket using the context.
+ */
+struct rs_shared {
+	dlist_entry	  entry;
+	struct ibv_context *verbs;
+	struct ibv_comp_channel *channel;
+	struct ibv_cq	  *cq;
+	struct ibv_srq	  *srq;
+	fastlock_t	  cq_lock;
+	void		  *qp_map;
+	pthread_t	  id;
+	int		  stop_fd;
+	int		  refcnt;
+	int		  cq_size;
+	int		  max_cqe;
+	int		  cqe_avail;
+	uint32_t	  srq_size;
+};
+
+#define RS_SRQ_POST_BATCH 16
+
+/*
+ * Counters reported through RDMA_STATS.  Each counter is only updated under
+ * the lock that serializes its path: slock for sends, rlock for receives,
+ * and cq_lock for completions.  Updates are therefore plain relaxed stores,
+ * and readers load the counters without taking any of those locks.
+ */
+struct rs_stats {
+	_Atomic(uint64_t) bytes_sent;
+	_Atomic(uint64_t) bytes_recv;
+	_Atomic(uint64_t) writes;
+	_Atomic(uint64_t) inline_writes;
+	_Atomic(uint64_t) iomap_writes;
+	_Atomic(uint64_t) ctrl_sent;
+	_Atomic(uint64_t) ctrl_recv;
+	_Atomic(uint64_t) credit_stalls;
+	_Atomic(uint64_t) send_stalls;
+	_Atomic(uint64_t) cq_polls;
+	_Atomic(uint64_t) cq_entries;
+	_Atomic(uint64_t) resizes;
+};
+
+static inline void rs_stat_add(_Atomic(uint64_t) *cnt, uint64_t val)
+{
+	atomic_store_explicit(cnt, atomic_load_explicit(cnt,
+			      memory_order_relaxed) + val, memory_order_relaxed);
+}
+
+static inline uint64_t rs_stat_get(_Atomic(uint64_t) *cnt)
+{
+	return atomic_load_explicit(cnt, memory_order_relaxed);
+}
+
 struct rsocket {
 	int		  type;
 	int		  index;
@@ -331,7 +497,9 @@ struct rsocket {
 			struct rdma_cm_id *cm_id;
 			uint64_t	  tcp_opts;
 			unsigned int	  keepalive_time;
+			int		  keepalive_index; /* tcp_svc heap */
 			int		  accept_queue[2];
+			struct rsocket	  *listen_rs; /* pending accept */
 
 			unsigned int	  ctrl_seqno;
 			unsigned int	  ctrl_max_seqno;
@@ -339,6 +507,8 @@ struct rsocket {
 			uint16_t	  sseq_comp;
 			uint16_t	  rseq_no;
 			uint16_t	  rseq_comp;
+			uint16_t	  sgl_seq;	/* targets given to peer */
+			uint16_t	  target_seq;	/* targets used or dropped */
 
 			int		  remote_sge;
 			struct rs_sge	  remote_sgl;
@@ -355,17 +525,39 @@ struct rsocket {
 			int		  rbuf_bytes_avail;
 			int		  rbuf_free_offset;
 			int		  rbuf_offset;
+			int		  rbuf_zc_offset;
+			int		  rbuf_zc_bytes;
 			struct ibv_mr	  *rmr;
 			uint8_t		  *rbuf;
 
 			int		  sbuf_bytes_avail;
 			struct ibv_mr	  *smr;
 			struct ibv_sge	  ssgl[2];
+
+			uint32_t	  rbuf_default;
+			uint32_t	  sbuf_default;
+			int		  rbuf_resize;
+			uint16_t	  rbuf_resize_stale;
+			uint32_t	  rbuf_resize_size;
+			uint16_t	  idle_seq;
+			uint64_t	  idle_time;
+			uint32_t	  remote_rbuf_size;
+			uint32_t	  remote_rbuf_max;
+			uint32_t	  resize_wait;	/* requested size */
+			int		  sbuf_resize;
+			int		  stall_cnt;
+			uint32_t	  stall_min;
+			uint64_t	  stall_start;
+
+			struct rs_shared  *shared;
+			int		  notify_fd;
 		};
 		/* datagram */
 		struct {
 			struct ds_qp	  *qp_list;
-			void		  *dest_map;
+			struct ds_dest_entry *dest_map;
+			uint32_t	  dest_mask;
+			uint32_t	  dest_cnt;
 			struct ds_dest    *conn_dest;
 
 			int		  udp_sock;
@@ -376,6 +568,8 @@ struct rsocket {
 	};
 
 	int		  opts;
+	int		  svc_index;	/* udp, listen or connect svc */
+	struct rs_svc_msg svc_msg;	/* asynchronous svc request */
 	int		  fd_flags;
 	uint64_t	  so_opts;
 	uint64_t	  ipv6_opts;
@@ -393,6 +587,7 @@ struct rsocket {
 
 	uint32_t	  rbuf_size;
 	uint16_t	  rq_size;
+	uint32_t	  srq_size;
 	int		  rmsg_head;
 	int		  rmsg_tail;
 	union {
@@ -405,7 +600,19 @@ struct rsocket {
 	dlist_entry	  iomap_list;
 	dlist_entry	  iomap_queue;
 	int		  iomap_pending;
+	dlist_entry	  sendfile_list;
 	int		  unack_cqe;
+	_Atomic(int)	  epoll_cnt;
+
+	uint32_t	  busy_poll_us;
+	/* Sampled by both the send and receive paths, see rs_poll_sample */
+	_Atomic(uint32_t) poll_avg;
+	_Atomic(uint32_t) poll_skips;
+	_Atomic(uint64_t) poll_spins;
+	_Atomic(uint64_t) poll_wakeups;
+	_Atomic(uint64_t) poll_misses;
+
+	struct rs_stats stats;
 };
 
 #define DS_UDP_TAG 0x55555555
@@ -488,42 +695,156 @@ static void ds_remove_qp(struct rsocket *rs, struct ds_qp *qp)
 	}
 }
 
-static int rs_notify_svc(struct rs_svc *svc, struct rsocket *rs, int cmd)
+static int rs_svc_grow_sets(struct rs_svc *svc, int grow_size);
+
+static bool rs_svc_tryget(struct rs_svc *svc)
 {
-	struct rs_svc_msg msg;
-	int ret;
+	int ref = atomic_load(&svc->ref);
+
+	while (ref) {
+		if (atomic_compare_exchange_weak(&svc->ref, &ref, ref + 1))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Takes a reference on the service for a new request, starting the service
+ * thread if it is not running.  The wakeup eventfd and the service's sets
+ * are kept across restarts, so a request may be queued at any time while a
+ * reference is held.
+ */
+static int rs_svc_get(struct rs_svc *svc)
+{
+	int ret = 0;
+
+	if (rs_svc_tryget(svc))
+		return 0;
 
 	pthread_mutex_lock(&svc_mut);
-	if (!svc->cnt) {
-		ret = socketpair(AF_UNIX, SOCK_STREAM, 0, svc->sock);
-		if (ret)
+	if (rs_svc_tryget(svc))
+		goto unlock;
+
+	if (!svc->size) {
+		svc->efd = eventfd(0, EFD_CLOEXEC);
+		if (svc->efd < 0) {
+			ret = -1;
 			goto unlock;
+		}
 
-		ret = pthread_create(&svc->id, NULL, svc->run, svc);
+		ret = rs_svc_grow_sets(svc, 4);
 		if (ret) {
+			close(svc->efd);
 			ret = ERR(ret);
-			goto closepair;
+			goto unlock;
 		}
 	}
 
+	if (svc->active) {
+		pthread_join(svc->id, NULL);
+		svc->active = 0;
+	}
+
+	ret = pthread_create(&svc->id, NULL, svc->run, svc);
+	if (ret) {
+		ret = ERR(ret);
+		goto unlock;
+	}
+	svc->active = 1;
+	atomic_store(&svc->ref, 1);
+unlock:
+	pthread_mutex_unlock(&svc_mut);
+	return ret;
+}
+
+static int rs_post_svc(struct rs_svc *svc, struct rs_svc_msg *msg)
+{
+	struct rs_svc_msg *head;
+	uint64_t val = 1;
+	int ret;
+
+	ret = rs_svc_get(svc);
+	if (ret)
+		return ret;
+
+	head = atomic_load(&svc->msgs);
+	do {
+		msg->next = head;
+	} while (!atomic_compare_exchange_weak(&svc->msgs, &head, msg));
+
+	/* Only the request that makes the list non-empty needs to wake */
+	if (!head)
+		write_all(svc->efd, &val, sizeof val);
+	return 0;
+}
+
+static int rs_notify_svc(struct rs_svc *svc, struct rsocket *rs, int cmd)
+{
+	struct rs_svc_msg msg;
+	sem_t done;
+	int ret;
+
+	sem_init(&done, 0, 0);
 	msg.cmd = cmd;
 	msg.status = EINVAL;
 	msg.rs = rs;
-	write_all(svc->sock[0], &msg, sizeof(msg));
-	read_all(svc->sock[0], &msg, sizeof(msg));
+	msg.done = &done;
+	ret = rs_post_svc(svc, &msg);
+	if (ret)
+		goto out;
+
+	while (sem_wait(&done))
+		;
 	ret = rdma_seterrno(msg.status);
-	if (svc->cnt)
-		goto unlock;
 
-	pthread_join(svc->id, NULL);
-closepair:
-	close(svc->sock[0]);
-	close(svc->sock[1]);
-unlock:
-	pthread_mutex_unlock(&svc_mut);
+	/* Reap the service thread if it exited after our request */
+	if (!atomic_load(&svc->ref)) {
+		pthread_mutex_lock(&svc_mut);
+		if (!atomic_load(&svc->ref) && svc->active) {
+			pthread_join(svc->id, NULL);
+			svc->active = 0;
+		}
+		pthread_mutex_unlock(&svc_mut);
+	}
+out:
+	sem_destroy(&done);
 	return ret;
 }
 
+/*
+ * Queue a request without waiting for the service thread to process it.
+ * The request is carried in the rsocket, so only one may be outstanding.
+ * The result is not reported to the caller.
+ */
+static int rs_notify_svc_async(struct rs_svc *svc, struct rsocket *rs, int cmd)
+{
+	rs->svc_msg.cmd = cmd;
+	rs->svc_msg.status = EINVAL;
+	rs->svc_msg.rs = rs;
+	rs->svc_msg.done = NULL;
+	return rs_post_svc(svc, &rs->svc_msg);
+}
+
+static struct rs_svc *rs_cm_svc(struct rs_svc *svcs, struct rsocket *rs)
+{
+	return &svcs[rs->index % cm_svc_threads];
+}
+
+/*
+ * Connection requests handed off by a listener reference its accept queue.
+ * Once the listener has been removed from its listen service, wait for the
+ * connect services to finish any requests that are still queued.
+ */
+static void rs_flush_accepts(void)
+{
+	int i;
+
+	for (i = 0; i < cm_svc_threads; i++) {
+		if (atomic_load(&connect_svc[i].ref))
+			rs_notify_svc(&connect_svc[i], NULL, RS_SVC_NOOP);
+	}
+}
+
 static int ds_compare_addr(const void *dst1, const void *dst2)
 {
 	const struct sockaddr *sa1, *sa2;
@@ -537,6 +858,109 @@ static int ds_compare_addr(const void *dst1, const void *dst2)
 	return memcmp(dst1, dst2, len);
 }
 
+static uint32_t ds_hash_addr(const void *addr)
+{
+	const union socket_addr *sa = addr;
+	uint64_t hash, ip6[2];
+
+	if (sa->sa.sa_family == AF_INET6) {
+		memcpy(ip6, &sa->sin6.sin6_addr, sizeof ip6);
+		hash = ip6[0] ^ (ip6[1] * 0x9E3779B97F4A7C15ULL);
+	} else {
+		hash = sa->sin.sin_addr.s_addr;
+	}
+	hash = ((hash << 16) ^ sa->sin.sin_port) * 0x9E3779B97F4A7C15ULL;
+	return (uint32_t) (hash >> 32);
+}
+
+static struct ds_dest *ds_find_dest(struct rsocket *rs, const void *addr)
+{
+	uint32_t hash, i;
+
+	if (!rs->dest_map)
+		return NULL;
+
+	hash = ds_hash_addr(addr);
+	for (i = hash & rs->dest_mask; rs->dest_map[i].dest;
+	     i = (i + 1) & rs->dest_mask) {
+		if (rs->dest_map[i].hash == hash &&
+		    !ds_compare_addr(addr, &rs->dest_map[i].dest->addr))
+			return rs->dest_map[i].dest;
+	}
+	return NULL;
+}
+
+static void ds_place_dest(struct ds_dest_entry *map, uint32_t mask,
+			  uint32_t hash, struct ds_dest *dest)
+{
+	uint32_t i;
+
+	for (i = hash & mask; map[i].dest; i = (i + 1) & mask)
+		;
+	map[i].hash = hash;
+	map[i].dest = dest;
+}
+
+/*
+ * The table is kept at most half full to keep probe sequences short.
+ * Caller must hold map_lock.
+ */
+static int ds_insert_dest(struct rsocket *rs, struct ds_dest *dest)
+{
+	struct ds_dest_entry *map;
+	uint32_t size, i;
+
+	if ((rs->dest_cnt + 1) * 2 > rs->dest_mask + 1) {
+		size = rs->dest_map ? (rs->dest_mask + 1) << 1 : DS_DEST_MAP_MIN;
+		map = calloc(size, sizeof(*map));
+		if (!map)
+			return ERR(ENOMEM);
+
+		for (i = 0; rs->dest_map && i <= rs->dest_mask; i++) {
+			if (rs->dest_map[i].dest)
+				ds_place_dest(map, size - 1, rs->dest_map[i].hash,
+					      rs->dest_map[i].dest);
+		}
+		free(rs->dest_map);
+		rs->dest_map = map;
+		rs->dest_mask = size - 1;
+	}
+
+	ds_place_dest(rs->dest_map, rs->dest_mask, ds_hash_addr(&dest->addr),
+		      dest);
+	rs->dest_cnt++;
+	return 0;
+}
+
+/*
+ * Entries which follow the removed one are shifted back into the hole,
+ * unless that would move them ahead of their home slot.
+ */
+static void ds_remove_dest(struct rsocket *rs, struct ds_dest *dest)
+{
+	struct ds_dest_entry *map = rs->dest_map;
+	uint32_t mask = rs->dest_mask, i, j, home;
+
+	if (!map)
+		return;
+
+	for (i = ds_hash_addr(&dest->addr) & mask; map[i].dest != dest;
+	     i = (i + 1) & mask) {
+		if (!map[i].dest)
+			return;
+	}
+
+	for (j = (i + 1) & mask; map[j].dest; j = (j + 1) & mask) {
+		home = map[j].hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			map[i] = map[j];
+			i = j;
+		}
+	}
+	map[i].dest = NULL;
+	rs->dest_cnt--;
+}
+
 static int rs_value_to_scale(int value, int bits)
 {
 	return value <= (1 << (bits - 1)) ?
@@ -562,6 +986,7 @@ static void rs_configure(void)
 {
 	FILE *f;
 	static int init;
+	int i;
 
 	if (init)
 		return;
@@ -614,6 +1039,19 @@ static void rs_configure(void)
 			def_wmem = RS_SNDLOWAT << 1;
 	}
 
+	if ((f = fopen(RS_CONF_DIR "/mem_max", "r"))) {
+		failable_fscanf(f, "%u", &def_mem_max);
+		fclose(f);
+
+		if (def_mem_max > RS_RESIZE_MAX)
+			def_mem_max = RS_RESIZE_MAX;
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/wmem_max", "r"))) {
+		failable_fscanf(f, "%u", &def_wmem_max);
+		fclose(f);
+	}
+
 	if ((f = fopen(RS_CONF_DIR "/iomap_size", "r"))) {
 		failable_fscanf(f, "%hu", &def_iomap_size);
 		fclose(f);
@@ -622,24 +1060,47 @@ static void rs_configure(void)
 		def_iomap_size = (uint8_t) rs_value_to_scale(
 			(uint16_t) rs_scale_to_value(def_iomap_size, 8), 8);
 	}
+
+	if ((f = fopen(RS_CONF_DIR "/srqsize_default", "r"))) {
+		failable_fscanf(f, "%u", &def_srqsize);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/cm_svc_threads", "r"))) {
+		failable_fscanf(f, "%hu", &cm_svc_threads);
+		fclose(f);
+
+		if (cm_svc_threads < 1)
+			cm_svc_threads = 1;
+		else if (cm_svc_threads > RS_CM_SVC_MAX)
+			cm_svc_threads = RS_CM_SVC_MAX;
+	}
+
+	for (i = 0; i < RS_CM_SVC_MAX; i++) {
+		listen_svc[i].context_size = sizeof(struct pollfd);
+		listen_svc[i].run = listen_svc_run;
+		connect_svc[i].context_size = sizeof(struct pollfd);
+		connect_svc[i].run = connect_svc_run;
+	}
 	init = 1;
 out:
 	pthread_mutex_unlock(&mut);
 }
 
+/*
+ * The index is the fd backing the rsocket, which is unique for as long as
+ * the rsocket exists, so the index map does not need a lock here.  The
+ * rsocket must be removed before the backing fd is closed.
+ */
 static int rs_insert(struct rsocket *rs, int index)
 {
-	pthread_mutex_lock(&mut);
 	rs->index = idm_set(&idm, index, rs);
-	pthread_mutex_unlock(&mut);
 	return rs->index;
 }
 
 static void rs_remove(struct rsocket *rs)
 {
-	pthread_mutex_lock(&mut);
 	idm_clear(&idm, rs->index);
-	pthread_mutex_unlock(&mut);
 }
 
 /* We only inherit from listening sockets */
@@ -664,6 +1125,10 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		rs->sq_inline = inherited_rs->sq_inline;
 		rs->sq_size = inherited_rs->sq_size;
 		rs->rq_size = inherited_rs->rq_size;
+		rs->srq_size = inherited_rs->srq_size;
+		rs->busy_poll_us = inherited_rs->busy_poll_us;
+		rs->so_opts = inherited_rs->so_opts &
+			      ((1 << SO_RCVBUF) | (1 << SO_SNDBUF));
 		if (type == SOCK_STREAM) {
 			rs->ctrl_max_seqno = inherited_rs->ctrl_max_seqno;
 			rs->target_iomap_size = inherited_rs->target_iomap_size;
@@ -674,11 +1139,14 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		rs->sq_inline = def_inline;
 		rs->sq_size = def_sqsize;
 		rs->rq_size = def_rqsize;
+		rs->srq_size = def_srqsize;
+		rs->busy_poll_us = polling_time;
 		if (type == SOCK_STREAM) {
 			rs->ctrl_max_seqno = RS_QP_CTRL_SIZE;
 			rs->target_iomap_size = def_iomap_size;
 		}
 	}
+	atomic_init(&rs->poll_avg, rs->busy_poll_us >> 1);
 	fastlock_init(&rs->slock);
 	fastlock_init(&rs->rlock);
 	fastlock_init(&rs->cq_lock);
@@ -686,6 +1154,7 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 	fastlock_init(&rs->map_lock);
 	dlist_init(&rs->iomap_list);
 	dlist_init(&rs->iomap_queue);
+	dlist_init(&rs->sendfile_list);
 	return rs;
 }
 
@@ -697,6 +1166,8 @@ static int rs_set_nonblocking(struct rsocket *rs, int arg)
 	if (rs->type == SOCK_STREAM) {
 		if (rs->cm_id->recv_cq_channel)
 			ret = fcntl(rs->cm_id->recv_cq_channel->fd, F_SETFL, arg);
+		else if (rs->shared)
+			ret = fcntl(rs->notify_fd, F_SETFL, arg);
 
 		if (rs->state == rs_listening)
 			ret = fcntl(rs->accept_queue[0], F_SETFL, arg);
@@ -761,7 +1232,8 @@ static int rs_init_bufs(struct rsocket *rs)
 	uint32_t total_rbuf_size, total_sbuf_size;
 	size_t len;
 
-	rs->rmsg = calloc(rs->rq_size + 1, sizeof(*rs->rmsg));
+	/* Leave room for a resize marker, see rs_process_resize */
+	rs->rmsg = calloc(rs->rq_size + 2, sizeof(*rs->rmsg));
 	if (!rs->rmsg)
 		return ERR(ENOMEM);
 
@@ -807,6 +1279,10 @@ static int rs_init_bufs(struct rsocket *rs)
 
 	rs->rbuf_free_offset = rs->rbuf_size >> 1;
 	rs->rbuf_bytes_avail = rs->rbuf_size >> 1;
+	rs->sgl_seq = 1;
+	rs->rbuf_default = rs->rbuf_size;
+	rs->sbuf_default = rs->sbuf_size;
+	rs->remote_rbuf_max = RS_RESIZE_MAX;
 	rs->sqe_avail = rs->sq_size - rs->ctrl_max_seqno;
 	rs->rseq_comp = rs->rq_size >> 1;
 	return 0;
@@ -830,77 +1306,285 @@ static int ds_init_bufs(struct ds_qp *qp)
 	return 0;
 }
 
-/*
- * If a user is waiting on a datagram rsocket through poll or select, then
- * we need the first completion to generate an event on the related epoll fd
- * in order to signal the user.  We arm the CQ on creation for this purpose
- */
-static int rs_create_cq(struct rsocket *rs, struct rdma_cm_id *cm_id)
+static int rs_shared_compare(const void *a, const void *b)
 {
-	cm_id->recv_cq_channel = ibv_create_comp_channel(cm_id->verbs);
-	if (!cm_id->recv_cq_channel)
-		return -1;
+	uint32_t qpn_a = *(const uint32_t *) a, qpn_b = *(const uint32_t *) b;
 
-	cm_id->recv_cq = ibv_create_cq(cm_id->verbs, rs->sq_size + rs->rq_size,
-				       cm_id, cm_id->recv_cq_channel, 0);
-	if (!cm_id->recv_cq)
-		goto err1;
+	return (qpn_a < qpn_b) ? -1 : (qpn_a > qpn_b);
+}
 
-	if (rs->fd_flags & O_NONBLOCK) {
-		if (set_fd_nonblock(cm_id->recv_cq_channel->fd, true))
-			goto err2;
+static int rs_shared_post_recv(struct rs_shared *sh, int cnt)
+{
+	struct ibv_recv_wr wr[RS_SRQ_POST_BATCH], *bad;
+	int i, n, ret = 0;
+
+	while (!ret && cnt) {
+		n = min(cnt, RS_SRQ_POST_BATCH);
+		for (i = 0; i < n; i++) {
+			wr[i].wr_id = rs_recv_wr_id(0);
+			wr[i].next = (i + 1 < n) ? &wr[i + 1] : NULL;
+			wr[i].sg_list = NULL;
+			wr[i].num_sge = 0;
+		}
+		ret = rdma_seterrno(ibv_post_srq_recv(sh->srq, wr, &bad));
+		cnt -= n;
 	}
+	return ret;
+}
 
-	ibv_req_notify_cq(cm_id->recv_cq, 0);
-	cm_id->send_cq_channel = cm_id->recv_cq_channel;
-	cm_id->send_cq = cm_id->recv_cq;
-	return 0;
+static void rs_free_shared(struct rs_shared *sh)
+{
+	uint64_t stop = 1;
 
-err2:
-	ibv_destroy_cq(cm_id->recv_cq);
-	cm_id->recv_cq = NULL;
-err1:
-	ibv_destroy_comp_channel(cm_id->recv_cq_channel);
-	cm_id->recv_cq_channel = NULL;
-	return -1;
+	if (sh->stop_fd >= 0) {
+		if (sh->id) {
+			write_all(sh->stop_fd, &stop, sizeof stop);
+			pthread_join(sh->id, NULL);
+		}
+		close(sh->stop_fd);
+	}
+	if (sh->srq)
+		ibv_destroy_srq(sh->srq);
+	if (sh->cq)
+		ibv_destroy_cq(sh->cq);
+	if (sh->channel)
+		ibv_destroy_comp_channel(sh->channel);
+	fastlock_destroy(&sh->cq_lock);
+	free(sh);
 }
 
-static inline int rs_post_recv(struct rsocket *rs)
+static void *rs_shared_run(void *arg);
+static int rs_shared_poll(struct rs_shared *sh, struct rsocket *rs);
+
+static struct rs_shared *rs_alloc_shared(struct rsocket *rs)
 {
-	struct ibv_recv_wr wr, *bad;
-	struct ibv_sge sge;
+	struct ibv_srq_init_attr srq_attr;
+	struct ibv_device_attr attr;
+	struct rs_shared *sh;
 
-	wr.next = NULL;
-	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		wr.wr_id = rs_recv_wr_id(0);
-		wr.sg_list = NULL;
-		wr.num_sge = 0;
-	} else {
-		wr.wr_id = rs_recv_wr_id(rs->rbuf_msg_index);
-		sge.addr = (uintptr_t) rs->rbuf + rs->rbuf_size +
-			   (rs->rbuf_msg_index * RS_MSG_SIZE);
-		sge.length = RS_MSG_SIZE;
-		sge.lkey = rs->rmr->lkey;
+	if (ibv_query_device(rs->cm_id->verbs, &attr))
+		return NULL;
 
-		wr.sg_list = &sge;
-		wr.num_sge = 1;
-		if(++rs->rbuf_msg_index == rs->rq_size)
-			rs->rbuf_msg_index = 0;
+	if (!attr.max_srq) {
+		errno = ENOTSUP;
+		return NULL;
 	}
 
-	return rdma_seterrno(ibv_post_recv(rs->cm_id->qp, &wr, &bad));
-}
+	sh = calloc(1, sizeof(*sh));
+	if (!sh)
+		return NULL;
 
-static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t offset)
-{
-	struct ibv_recv_wr wr, *bad;
-	struct ibv_sge sge[2];
+	fastlock_init(&sh->cq_lock);
+	sh->verbs = rs->cm_id->verbs;
+	sh->stop_fd = -1;
+	sh->max_cqe = attr.max_cqe;
+	sh->srq_size = min_t(uint32_t, rs->srq_size, attr.max_srq_wr);
+	sh->srq_size = min_t(uint32_t, sh->srq_size, attr.max_cqe >> 1);
+	sh->cq_size = sh->srq_size << 1;
+	sh->cqe_avail = sh->cq_size - sh->srq_size;
+
+	sh->channel = ibv_create_comp_channel(sh->verbs);
+	if (!sh->channel || set_fd_nonblock(sh->channel->fd, true))
+		goto err;
 
-	sge[0].addr = (uintptr_t) qp->rbuf + rs->rbuf_size;
-	sge[0].length = sizeof(struct ibv_grh);
-	sge[0].lkey = qp->rmr->lkey;
-	sge[1].addr = (uintptr_t) qp->rbuf + offset;
-	sge[1].length = RS_SNDLOWAT;
+	sh->cq = ibv_create_cq(sh->verbs, sh->cq_size, sh, sh->channel, 0);
+	if (!sh->cq)
+		goto err;
+
+	memset(&srq_attr, 0, sizeof srq_attr);
+	srq_attr.attr.max_wr = sh->srq_size;
+	srq_attr.attr.max_sge = 1;
+	sh->srq = ibv_create_srq(rs->cm_id->pd, &srq_attr);
+	if (!sh->srq || rs_shared_post_recv(sh, sh->srq_size))
+		goto err;
+
+	sh->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (sh->stop_fd < 0)
+		goto err;
+
+	ibv_req_notify_cq(sh->cq, 0);
+	if (pthread_create(&sh->id, NULL, rs_shared_run, sh)) {
+		sh->id = 0;
+		goto err;
+	}
+	return sh;
+
+err:
+	rs_free_shared(sh);
+	return NULL;
+}
+
+/*
+ * Reserve space in the shared CQ for the send completions of an rsocket.
+ * Receive completions are bounded by the size of the SRQ, which is
+ * accounted for when the context is created.
+ */
+static int rs_reserve_shared(struct rs_shared *sh, int cqe)
+{
+	int size, ret;
+
+	if (sh->cqe_avail < cqe) {
+		size = max(sh->cq_size << 1, sh->cq_size + cqe);
+		size = min(size, sh->max_cqe);
+		if (sh->cqe_avail + size - sh->cq_size < cqe)
+			return -1;
+
+		fastlock_acquire(&sh->cq_lock);
+		ret = ibv_resize_cq(sh->cq, size);
+		fastlock_release(&sh->cq_lock);
+		if (ret)
+			return -1;
+
+		sh->cqe_avail += size - sh->cq_size;
+		sh->cq_size = size;
+	}
+
+	sh->cqe_avail -= cqe;
+	return 0;
+}
+
+/*
+ * Find a shared context for the rsocket's device with room in its CQ for
+ * the rsocket's sends.  A new context is created once the CQs of existing
+ * contexts can no longer grow.
+ */
+static struct rs_shared *rs_get_shared(struct rsocket *rs)
+{
+	struct rs_shared *sh;
+	dlist_entry *entry;
+
+	pthread_mutex_lock(&shared_mut);
+	for (entry = shared_list.next; entry != &shared_list; entry = entry->next) {
+		sh = container_of(entry, struct rs_shared, entry);
+		if (sh->verbs == rs->cm_id->verbs &&
+		    !rs_reserve_shared(sh, rs->sq_size))
+			goto out;
+	}
+
+	sh = rs_alloc_shared(rs);
+	if (!sh)
+		goto unlock;
+
+	if (rs_reserve_shared(sh, rs->sq_size)) {
+		rs_free_shared(sh);
+		sh = NULL;
+		errno = ENOMEM;
+		goto unlock;
+	}
+	dlist_insert_tail(&sh->entry, &shared_list);
+out:
+	sh->refcnt++;
+unlock:
+	pthread_mutex_unlock(&shared_mut);
+	return sh;
+}
+
+static void rs_put_shared(struct rsocket *rs)
+{
+	struct rs_shared *sh = rs->shared;
+
+	/* Flush completions for the destroyed QP before reusing their space */
+	fastlock_acquire(&sh->cq_lock);
+	rs_shared_poll(sh, NULL);
+	fastlock_release(&sh->cq_lock);
+
+	pthread_mutex_lock(&shared_mut);
+	sh->cqe_avail += rs->sq_size;
+	if (!--sh->refcnt) {
+		dlist_remove(&sh->entry);
+		rs_free_shared(sh);
+	}
+	pthread_mutex_unlock(&shared_mut);
+	close(rs->notify_fd);
+	rs->shared = NULL;
+}
+
+static int rs_join_shared(struct rsocket *rs)
+{
+	rs->notify_fd = eventfd(0, EFD_CLOEXEC |
+			       ((rs->fd_flags & O_NONBLOCK) ? EFD_NONBLOCK : 0));
+	if (rs->notify_fd < 0)
+		return -1;
+
+	rs->shared = rs_get_shared(rs);
+	if (!rs->shared) {
+		close(rs->notify_fd);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * If a user is waiting on a datagram rsocket through poll or select, then
+ * we need the first completion to generate an event on the related epoll fd
+ * in order to signal the user.  We arm the CQ on creation for this purpose
+ */
+static int rs_create_cq(struct rsocket *rs, struct rdma_cm_id *cm_id)
+{
+	cm_id->recv_cq_channel = ibv_create_comp_channel(cm_id->verbs);
+	if (!cm_id->recv_cq_channel)
+		return -1;
+
+	cm_id->recv_cq = ibv_create_cq(cm_id->verbs, rs->sq_size + rs->rq_size,
+				       cm_id, cm_id->recv_cq_channel, 0);
+	if (!cm_id->recv_cq)
+		goto err1;
+
+	if (rs->fd_flags & O_NONBLOCK) {
+		if (set_fd_nonblock(cm_id->recv_cq_channel->fd, true))
+			goto err2;
+	}
+
+	ibv_req_notify_cq(cm_id->recv_cq, 0);
+	cm_id->send_cq_channel = cm_id->recv_cq_channel;
+	cm_id->send_cq = cm_id->recv_cq;
+	return 0;
+
+err2:
+	ibv_destroy_cq(cm_id->recv_cq);
+	cm_id->recv_cq = NULL;
+err1:
+	ibv_destroy_comp_channel(cm_id->recv_cq_channel);
+	cm_id->recv_cq_channel = NULL;
+	return -1;
+}
+
+static inline int rs_post_recv(struct rsocket *rs)
+{
+	struct ibv_recv_wr wr, *bad;
+	struct ibv_sge sge;
+
+	wr.next = NULL;
+	if (!(rs->opts & RS_OPT_MSG_SEND)) {
+		wr.wr_id = rs_recv_wr_id(0);
+		wr.sg_list = NULL;
+		wr.num_sge = 0;
+	} else {
+		wr.wr_id = rs_recv_wr_id(rs->rbuf_msg_index);
+		sge.addr = (uintptr_t) rs->rbuf + rs->rbuf_size +
+			   (rs->rbuf_msg_index * RS_MSG_SIZE);
+		sge.length = RS_MSG_SIZE;
+		sge.lkey = rs->rmr->lkey;
+
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		if(++rs->rbuf_msg_index == rs->rq_size)
+			rs->rbuf_msg_index = 0;
+	}
+
+	return rdma_seterrno(ibv_post_recv(rs->cm_id->qp, &wr, &bad));
+}
+
+static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t offset)
+{
+	struct ibv_recv_wr wr, *bad;
+	struct ibv_sge sge[2];
+
+	sge[0].addr = (uintptr_t) qp->rbuf + rs->rbuf_size;
+	sge[0].length = sizeof(struct ibv_grh);
+	sge[0].lkey = qp->rmr->lkey;
+	sge[1].addr = (uintptr_t) qp->rbuf + offset;
+	sge[1].length = RS_SNDLOWAT;
 	sge[1].lkey = qp->rmr->lkey;
 
 	wr.wr_id = rs_recv_wr_id(offset);
@@ -919,32 +1603,69 @@ static int rs_create_ep(struct rsocket *rs)
 	rs_set_qp_size(rs);
 	if (rs->cm_id->verbs->device->transport_type == IBV_TRANSPORT_IWARP)
 		rs->opts |= RS_OPT_MSG_SEND;
-	ret = rs_create_cq(rs, rs->cm_id);
-	if (ret)
-		return ret;
+
+	/* Message sends place data in per connection receive buffers */
+	if (rs->srq_size && !(rs->opts & RS_OPT_MSG_SEND)) {
+		ret = rs_join_shared(rs);
+		if (ret && errno != ENOTSUP)
+			return ret;
+	}
+	if (!rs->shared) {
+		ret = rs_create_cq(rs, rs->cm_id);
+		if (ret)
+			return ret;
+	} else {
+		/*
+		 * Start with small buffers, which grow through RS_OP_RESIZE
+		 * while the connection is busy, so that memory use follows
+		 * traffic rather than the number of connections.
+		 */
+		if (!(rs->so_opts & (1 << SO_RCVBUF)))
+			rs->rbuf_size = min_t(uint32_t, rs->rbuf_size,
+					     RS_SHARED_BUF_SIZE);
+		if (!(rs->so_opts & (1 << SO_SNDBUF)))
+			rs->sbuf_size = min_t(uint32_t, rs->sbuf_size,
+					     RS_SHARED_BUF_SIZE);
+	}
 
 	memset(&qp_attr, 0, sizeof qp_attr);
 	qp_attr.qp_context = rs;
-	qp_attr.send_cq = rs->cm_id->send_cq;
-	qp_attr.recv_cq = rs->cm_id->recv_cq;
 	qp_attr.qp_type = IBV_QPT_RC;
 	qp_attr.sq_sig_all = 1;
 	qp_attr.cap.max_send_wr = rs->sq_size;
-	qp_attr.cap.max_recv_wr = rs->rq_size;
 	qp_attr.cap.max_send_sge = 2;
 	qp_attr.cap.max_recv_sge = 1;
 	qp_attr.cap.max_inline_data = rs->sq_inline;
+	if (rs->shared) {
+		/* The CQ is not attached to the cm_id, so rdma_cm won't free it */
+		qp_attr.send_cq = rs->shared->cq;
+		qp_attr.recv_cq = rs->shared->cq;
+		qp_attr.srq = rs->shared->srq;
+	} else {
+		qp_attr.send_cq = rs->cm_id->send_cq;
+		qp_attr.recv_cq = rs->cm_id->recv_cq;
+		qp_attr.cap.max_recv_wr = rs->rq_size;
+	}
 
 	ret = rdma_create_qp(rs->cm_id, NULL, &qp_attr);
 	if (ret)
 		return ret;
 
+	if (rs->shared) {
+		fastlock_acquire(&rs->shared->cq_lock);
+		ret = tsearch(&rs->cm_id->qp->qp_num, &rs->shared->qp_map,
+			      rs_shared_compare) ? 0 : ERR(ENOMEM);
+		fastlock_release(&rs->shared->cq_lock);
+		if (ret)
+			return ret;
+	}
+
 	rs->sq_inline = qp_attr.cap.max_inline_data;
 	if ((rs->opts & RS_OPT_MSG_SEND) && (rs->sq_inline < RS_MSG_SIZE))
 		return ERR(ENOTSUP);
 
 	ret = rs_init_bufs(rs);
-	if (ret)
+	if (ret || rs->shared)
 		return ret;
 
 	for (i = 0; i < rs->rq_size; i++) {
@@ -984,6 +1705,14 @@ static void rs_free_iomappings(struct rsocket *rs)
 	}
 }
 
+static void rs_free_sendfile_mr(struct rs_sendfile_mr *sfmr)
+{
+	dlist_remove(&sfmr->entry);
+	ibv_dereg_mr(sfmr->mr);
+	munmap(sfmr->map, sfmr->map_len);
+	free(sfmr);
+}
+
 static void ds_free_qp(struct ds_qp *qp)
 {
 	if (qp->smr)
@@ -997,7 +1726,7 @@ static void ds_free_qp(struct ds_qp *qp)
 
 	if (qp->cm_id) {
 		if (qp->cm_id->qp) {
-			tdelete(&qp->dest.addr, &qp->rs->dest_map, ds_compare_addr);
+			ds_remove_dest(qp->rs, &qp->dest);
 			epoll_ctl(qp->rs->epfd, EPOLL_CTL_DEL,
 				  qp->cm_id->recv_cq_channel->fd, NULL);
 			rdma_destroy_qp(qp->cm_id);
@@ -1011,13 +1740,14 @@ static void ds_free_qp(struct ds_qp *qp)
 static void ds_free(struct rsocket *rs)
 {
 	struct ds_qp *qp;
-
-	if (rs->udp_sock >= 0)
-		close(rs->udp_sock);
+	uint32_t i;
 
 	if (rs->index >= 0)
 		rs_remove(rs);
 
+	if (rs->udp_sock >= 0)
+		close(rs->udp_sock);
+
 	if (rs->dmsg)
 		free(rs->dmsg);
 
@@ -1032,7 +1762,9 @@ static void ds_free(struct rsocket *rs)
 	if (rs->sbuf)
 		free(rs->sbuf);
 
-	tdestroy(rs->dest_map, free);
+	for (i = 0; rs->dest_map && i <= rs->dest_mask; i++)
+		free(rs->dest_map[i].dest);
+	free(rs->dest_map);
 	fastlock_destroy(&rs->map_lock);
 	fastlock_destroy(&rs->cq_wait_lock);
 	fastlock_destroy(&rs->cq_lock);
@@ -1075,9 +1807,21 @@ static void rs_free(struct rsocket *rs)
 	if (rs->cm_id) {
 		rs_free_iomappings(rs);
 		if (rs->cm_id->qp) {
-			ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
+			if (rs->shared) {
+				fastlock_acquire(&rs->shared->cq_lock);
+				tdelete(&rs->cm_id->qp->qp_num,
+					&rs->shared->qp_map, rs_shared_compare);
+				fastlock_release(&rs->shared->cq_lock);
+			} else {
+				ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
+			}
 			rdma_destroy_qp(rs->cm_id);
 		}
+		while (!dlist_empty(&rs->sendfile_list))
+			rs_free_sendfile_mr(container_of(rs->sendfile_list.next,
+					    struct rs_sendfile_mr, entry));
+		if (rs->shared)
+			rs_put_shared(rs);
 		rdma_destroy_id(rs->cm_id);
 	}
 
@@ -1105,6 +1849,8 @@ static void rs_format_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
 	conn->version = 1;
 	conn->flags = RS_CONN_FLAG_IOMAP |
 		      (rs_host_is_net() ? RS_CONN_FLAG_NET : 0);
+	if (!(rs->opts & RS_OPT_MSG_SEND))
+		conn->flags |= RS_CONN_FLAG_RESIZE;
 	conn->credits = htobe16(rs->rq_size);
 	memset(conn->reserved, 0, sizeof conn->reserved);
 	conn->target_iomap_size = (uint8_t) rs_value_to_scale(rs->target_iomap_size, 8);
@@ -1138,6 +1884,10 @@ static void rs_save_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
 	rs->target_sgl[0].addr = be64toh((__force __be64)conn->data_buf.addr);
 	rs->target_sgl[0].length = be32toh((__force __be32)conn->data_buf.length);
 	rs->target_sgl[0].key = be32toh((__force __be32)conn->data_buf.key);
+	rs->remote_rbuf_size = rs->target_sgl[0].length << 1;
+
+	if ((conn->flags & RS_CONN_FLAG_RESIZE) && !(rs->opts & RS_OPT_MSG_SEND))
+		rs->opts |= RS_OPT_RESIZE;
 
 	rs->sseq_comp = be16toh(conn->credits);
 }
@@ -1284,20 +2034,24 @@ int rlisten(int socket, int backlog)
 	if (ret)
 		return ret;
 
-	ret = rs_notify_svc(&listen_svc, rs, RS_SVC_ADD_CM);
+	ret = rs_notify_svc(rs_cm_svc(listen_svc, rs), rs, RS_SVC_ADD_CM);
 	if (ret)
 		return ret;
 
+	rs->opts |= RS_OPT_CM_SVC;
 	rs->state = rs_listening;
 	return 0;
 }
 
-/* Accepting new connection requests is currently a blocking operation */
+/*
+ * The listen service only retrieves new connection requests.  Setting up
+ * and accepting the connection is done by the connect service that will
+ * own the new rsocket, so that the work for a busy listener is spread
+ * across the connect service threads.
+ */
 static void rs_accept(struct rsocket *rs)
 {
 	struct rsocket *new_rs;
-	struct rdma_conn_param param;
-	struct rs_conn_data *creq, cresp;
 	struct rdma_cm_id *cm_id;
 	int ret;
 
@@ -1309,11 +2063,31 @@ static void rs_accept(struct rsocket *rs)
 	if (!new_rs)
 		goto err;
 	new_rs->cm_id = cm_id;
+	new_rs->listen_rs = rs;
 
 	ret = rs_insert(new_rs, new_rs->cm_id->channel->fd);
 	if (ret < 0)
 		goto err;
 
+	if (rs_notify_svc_async(rs_cm_svc(connect_svc, new_rs), new_rs,
+				RS_SVC_ACCEPT_CM))
+		goto err;
+	return;
+
+err:
+	rdma_reject(cm_id, NULL, 0);
+	if (new_rs)
+		rs_free(new_rs);
+}
+
+/* Accepting new connection requests is currently a blocking operation */
+static void rs_accept_conn(struct rsocket *new_rs)
+{
+	struct rsocket *rs = new_rs->listen_rs;
+	struct rdma_conn_param param;
+	struct rs_conn_data *creq, cresp;
+	int ret;
+
 	creq = (struct rs_conn_data *)
 	       (new_rs->cm_id->event->param.conn.private_data + rs_conn_data_offset(rs));
 	if (creq->version != 1)
@@ -1336,13 +2110,13 @@ static void rs_accept(struct rsocket *rs)
 	else
 		goto err;
 
+	new_rs->listen_rs = NULL;
 	write_all(rs->accept_queue[1], &new_rs, sizeof(new_rs));
 	return;
 
 err:
-	rdma_reject(cm_id, NULL, 0);
-	if (new_rs)
-		rs_free(new_rs);
+	rdma_reject(new_rs->cm_id, NULL, 0);
+	rs_free(new_rs);
 }
 
 int raccept(int socket, struct sockaddr *addr, socklen_t *addrlen)
@@ -1365,7 +2139,10 @@ int raccept(int socket, struct sockaddr *addr, socklen_t *addrlen)
 		rgetpeername(new_rs->index, addr, addrlen);
 	/* The app can still drive the CM state on failure */
 	int save_errno = errno;
-	rs_notify_svc(&connect_svc, new_rs, RS_SVC_ADD_CM);
+	new_rs->opts |= RS_OPT_CM_SVC;
+	if (rs_notify_svc_async(rs_cm_svc(connect_svc, new_rs), new_rs,
+				RS_SVC_ADD_CM))
+		new_rs->opts &= ~RS_OPT_CM_SVC;
 	errno = save_errno;
 	return new_rs->index;
 }
@@ -1576,8 +2353,10 @@ static int ds_add_qp_dest(struct ds_qp *qp, union socket_addr *addr,
 	if (!qp->dest.ah)
 		return ERR(ENOMEM);
 
-	tsearch(&qp->dest.addr, &qp->rs->dest_map, ds_compare_addr);
-	return 0;
+	if (ds_find_dest(qp->rs, &qp->dest.addr))
+		return 0;
+
+	return ds_insert_dest(qp->rs, &qp->dest);
 }
 
 static int ds_create_qp(struct rsocket *rs, union socket_addr *src_addr,
@@ -1674,12 +2453,12 @@ static int ds_get_dest(struct rsocket *rs, const struct sockaddr *addr,
 	union socket_addr src_addr;
 	socklen_t src_len;
 	struct ds_qp *qp;
-	struct ds_dest **tdest, *new_dest;
+	struct ds_dest *new_dest;
 	int ret = 0;
 
 	fastlock_acquire(&rs->map_lock);
-	tdest = tfind(addr, &rs->dest_map, ds_compare_addr);
-	if (tdest)
+	new_dest = ds_find_dest(rs, addr);
+	if (new_dest)
 		goto found;
 
 	ret = ds_get_src_addr(rs, addr, addrlen, &src_addr, &src_len);
@@ -1690,8 +2469,8 @@ static int ds_get_dest(struct rsocket *rs, const struct sockaddr *addr,
 	if (ret)
 		goto out;
 
-	tdest = tfind(addr, &rs->dest_map, ds_compare_addr);
-	if (!tdest) {
+	new_dest = ds_find_dest(rs, addr);
+	if (!new_dest) {
 		new_dest = calloc(1, sizeof(*new_dest));
 		if (!new_dest) {
 			ret = ERR(ENOMEM);
@@ -1700,11 +2479,15 @@ static int ds_get_dest(struct rsocket *rs, const struct sockaddr *addr,
 
 		memcpy(&new_dest->addr, addr, addrlen);
 		new_dest->qp = qp;
-		tdest = tsearch(&new_dest->addr, &rs->dest_map, ds_compare_addr);
+		ret = ds_insert_dest(rs, new_dest);
+		if (ret) {
+			free(new_dest);
+			goto out;
+		}
 	}
 
 found:
-	*dest = *tdest;
+	*dest = new_dest;
 out:
 	fastlock_release(&rs->map_lock);
 	return ret;
@@ -1721,10 +2504,14 @@ int rconnect(int socket, const struct sockaddr *addr, socklen_t addrlen)
 	if (rs->type == SOCK_STREAM) {
 		memcpy(&rs->cm_id->route.addr.dst_addr, addr, addrlen);
 		ret = rs_do_connect(rs);
-		if (ret == -1 && errno == EINPROGRESS) {
+		if (ret == -1 && errno == EINPROGRESS &&
+		    !(rs->opts & RS_OPT_CM_SVC)) {
 			save_errno = errno;
 			/* The app can still drive the CM state on failure */
-			rs_notify_svc(&connect_svc, rs, RS_SVC_ADD_CM);
+			rs->opts |= RS_OPT_CM_SVC;
+			if (rs_notify_svc_async(rs_cm_svc(connect_svc, rs), rs,
+						RS_SVC_ADD_CM))
+				rs->opts &= ~RS_OPT_CM_SVC;
 			errno = save_errno;
 		}
 	} else {
@@ -1797,7 +2584,7 @@ static int rs_post_write(struct rsocket *rs,
 static int rs_post_write_msg(struct rsocket *rs,
 			 struct ibv_sge *sgl, int nsge,
 			 uint32_t msg, int flags,
-			 uint64_t addr, uint32_t rkey)
+			 uint64_t addr, uint32_t rkey, uint64_t wr_id_flags)
 {
 	struct ibv_send_wr wr, *bad;
 	struct ibv_sge sge;
@@ -1805,7 +2592,7 @@ static int rs_post_write_msg(struct rsocket *rs,
 
 	wr.next = NULL;
 	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		wr.wr_id = rs_send_wr_id(msg);
+		wr.wr_id = rs_send_wr_id(msg) | wr_id_flags;
 		wr.sg_list = sgl;
 		wr.num_sge = nsge;
 		wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
@@ -1819,7 +2606,7 @@ static int rs_post_write_msg(struct rsocket *rs,
 		ret = rs_post_write(rs, sgl, nsge, msg, flags, addr, rkey);
 		if (!ret) {
 			wr.wr_id = rs_send_wr_id(rs_msg_set(rs_msg_op(msg), 0)) |
-				   RS_WR_ID_FLAG_MSG_SEND;
+				   RS_WR_ID_FLAG_MSG_SEND | wr_id_flags;
 			sge.addr = (uintptr_t) &msg;
 			sge.lkey = 0;
 			sge.length = sizeof msg;
@@ -1852,13 +2639,21 @@ static int ds_post_send(struct rsocket *rs, struct ibv_sge *sge,
 	return rdma_seterrno(ibv_post_send(rs->conn_dest->qp->cm_id->qp, &wr, &bad));
 }
 
+static void rs_next_target(struct rsocket *rs)
+{
+	if (++rs->target_sge == RS_SGL_SIZE)
+		rs->target_sge = 0;
+	rs->target_seq++;
+}
+
 /*
  * Update target SGE before sending data.  Otherwise the remote side may
  * update the entry before we do.
  */
-static int rs_write_data(struct rsocket *rs,
-			 struct ibv_sge *sgl, int nsge,
-			 uint32_t length, int flags)
+static int rs_write_data_flags(struct rsocket *rs,
+			       struct ibv_sge *sgl, int nsge,
+			       uint32_t length, int flags,
+			       uint64_t wr_id_flags)
 {
 	uint64_t addr;
 	uint32_t rkey;
@@ -1868,6 +2663,10 @@ static int rs_write_data(struct rsocket *rs,
 	if (rs->opts & RS_OPT_MSG_SEND)
 		rs->sqe_avail--;
 	rs->sbuf_bytes_avail -= length;
+	rs_stat_add(&rs->stats.bytes_sent, length);
+	rs_stat_add(&rs->stats.writes, 1);
+	if (flags & IBV_SEND_INLINE)
+		rs_stat_add(&rs->stats.inline_writes, 1);
 
 	addr = rs->target_sgl[rs->target_sge].addr;
 	rkey = rs->target_sgl[rs->target_sge].key;
@@ -1875,13 +2674,18 @@ static int rs_write_data(struct rsocket *rs,
 	rs->target_sgl[rs->target_sge].addr += length;
 	rs->target_sgl[rs->target_sge].length -= length;
 
-	if (!rs->target_sgl[rs->target_sge].length) {
-		if (++rs->target_sge == RS_SGL_SIZE)
-			rs->target_sge = 0;
-	}
+	if (!rs->target_sgl[rs->target_sge].length)
+		rs_next_target(rs);
 
 	return rs_post_write_msg(rs, sgl, nsge, rs_msg_set(RS_OP_DATA, length),
-				 flags, addr, rkey);
+				 flags, addr, rkey, wr_id_flags);
+}
+
+static int rs_write_data(struct rsocket *rs,
+			 struct ibv_sge *sgl, int nsge,
+			 uint32_t length, int flags)
+{
+	return rs_write_data_flags(rs, sgl, nsge, length, flags, 0);
 }
 
 static int rs_write_direct(struct rsocket *rs, struct rs_iomap *iom, uint64_t offset,
@@ -1891,6 +2695,8 @@ static int rs_write_direct(struct rsocket *rs, struct rs_iomap *iom, uint64_t of
 
 	rs->sqe_avail--;
 	rs->sbuf_bytes_avail -= length;
+	rs_stat_add(&rs->stats.bytes_sent, length);
+	rs_stat_add(&rs->stats.iomap_writes, 1);
 
 	addr = iom->sge.addr + offset - iom->offset;
 	return rs_post_write(rs, sgl, nsge, rs_msg_set(RS_OP_WRITE, length),
@@ -1910,7 +2716,7 @@ static int rs_write_iomap(struct rsocket *rs, struct rs_iomap_mr *iomr,
 
 	addr = rs->remote_iomap.addr + iomr->index * sizeof(struct rs_iomap);
 	return rs_post_write_msg(rs, sgl, nsge, rs_msg_set(RS_OP_IOMAP_SGL, iomr->index),
-				 flags, addr, rs->remote_iomap.key);
+				 flags, addr, rs->remote_iomap.key, 0);
 }
 
 static uint32_t rs_sbuf_left(struct rsocket *rs)
@@ -1919,6 +2725,16 @@ static uint32_t rs_sbuf_left(struct rsocket *rs)
 			   rs->ssgl[0].addr);
 }
 
+/*
+ * Receive buffer space is not given to the peer while a resize is pending.
+ * The peer has dropped its targets, and the next target that it receives
+ * must be in the new buffer.
+ */
+static int rs_rbuf_grantable(struct rsocket *rs)
+{
+	return !rs->rbuf_resize && (rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1));
+}
+
 static void rs_send_credits(struct rsocket *rs)
 {
 	struct ibv_sge ibsge;
@@ -1927,7 +2743,7 @@ static void rs_send_credits(struct rsocket *rs)
 
 	rs->ctrl_seqno++;
 	rs->rseq_comp = rs->rseq_no + (rs->rq_size >> 1);
-	if (rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) {
+	if (rs_rbuf_grantable(rs)) {
 		if (rs->opts & RS_OPT_MSG_SEND)
 			rs->ctrl_seqno++;
 
@@ -1957,7 +2773,7 @@ static void rs_send_credits(struct rsocket *rs)
 		rs_post_write_msg(rs, &ibsge, 1,
 			rs_msg_set(RS_OP_SGL, rs->rseq_no + rs->rq_size), flags,
 			rs->remote_sgl.addr + rs->remote_sge * sizeof(struct rs_sge),
-			rs->remote_sgl.key);
+			rs->remote_sgl.key, 0);
 
 		rs->rbuf_bytes_avail -= rs->rbuf_size >> 1;
 		rs->rbuf_free_offset += rs->rbuf_size >> 1;
@@ -1965,6 +2781,7 @@ static void rs_send_credits(struct rsocket *rs)
 			rs->rbuf_free_offset = 0;
 		if (++rs->remote_sge == rs->remote_sgl.length)
 			rs->remote_sge = 0;
+		rs->sgl_seq++;
 	} else {
 		rs_post_msg(rs, rs_msg_set(RS_OP_SGL, rs->rseq_no + rs->rq_size));
 	}
@@ -1984,106 +2801,323 @@ static inline int rs_2ctrl_avail(struct rsocket *rs)
 static int rs_give_credits(struct rsocket *rs)
 {
 	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
+		return (rs_rbuf_grantable(rs) ||
 			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
 		       rs_ctrl_avail(rs) && (rs->state & rs_connected);
 	} else {
-		return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
+		return (rs_rbuf_grantable(rs) ||
 			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
 		       rs_2ctrl_avail(rs) && (rs->state & rs_connected);
 	}
 }
 
+/*
+ * Ask the peer to shrink a grown receive buffer back to its default size
+ * once no data has arrived for a while.  The peer drives the resize, since
+ * it must first give up its targets in the current buffer.
+ */
+static void rs_check_idle(struct rsocket *rs)
+{
+	uint64_t now = rs_time_us();
+
+	if (rs->idle_seq != rs->rseq_no) {
+		rs->idle_seq = rs->rseq_no;
+		rs->idle_time = now;
+	} else if (now - rs->idle_time >= RS_RESIZE_IDLE_US && !rs->rbuf_resize &&
+		   rs_ctrl_avail(rs) && (rs->state & rs_connected)) {
+		rs->idle_time = now;
+		rs->ctrl_seqno++;
+		rs_post_msg(rs, rs_msg_set(RS_OP_RESIZE,
+			rs_resize_set(RS_RESIZE_HINT, 0,
+				      rs->rbuf_default / RS_RESIZE_UNIT)));
+	}
+}
+
 static void rs_update_credits(struct rsocket *rs)
 {
 	if (rs_give_credits(rs))
 		rs_send_credits(rs);
+	if ((rs->opts & RS_OPT_RESIZE) && rs->rbuf_size > rs->rbuf_default)
+		rs_check_idle(rs);
 }
 
-static int rs_poll_cq(struct rsocket *rs)
+/*
+ * Ask the peer to replace its receive buffer with one of the given size.
+ * Targets that we hold in the current buffer are dropped, and data
+ * transfers stop until the peer acknowledges the request.  The request
+ * carries the number of targets that we have used or dropped, so that the
+ * peer can tell us how many of its targets were in flight.  Those are
+ * dropped when the ack arrives.  Caller must hold slock and cq_lock.
+ */
+static void rs_post_resize(struct rsocket *rs, uint32_t size)
 {
-	struct ibv_wc wc;
-	uint32_t msg;
-	int ret, rcnt = 0;
-
-	while ((ret = ibv_poll_cq(rs->cm_id->recv_cq, 1, &wc)) > 0) {
-		if (rs_wr_is_recv(wc.wr_id)) {
-			if (wc.status != IBV_WC_SUCCESS)
-				continue;
-			rcnt++;
-
-			if (wc.wc_flags & IBV_WC_WITH_IMM) {
-				msg = be32toh(wc.imm_data);
-			} else {
-				msg = ((uint32_t *) (rs->rbuf + rs->rbuf_size))
-					[rs_wr_data(wc.wr_id)];
+	if (rs->resize_wait || !rs_ctrl_avail(rs) || !(rs->state & rs_connected))
+		return;
 
-			}
-			switch (rs_msg_op(msg)) {
-			case RS_OP_SGL:
-				rs->sseq_comp = (uint16_t) rs_msg_data(msg);
-				break;
-			case RS_OP_IOMAP_SGL:
-				/* The iomap was updated, that's nice to know. */
-				break;
-			case RS_OP_CTRL:
-				if (rs_msg_data(msg) == RS_CTRL_DISCONNECT) {
-					rs->state = rs_disconnected;
-					return 0;
-				} else if (rs_msg_data(msg) == RS_CTRL_SHUTDOWN) {
-					if (rs->state & rs_writable) {
-						rs->state &= ~rs_readable;
-					} else {
-						rs->state = rs_disconnected;
-						return 0;
-					}
-				}
-				break;
-			case RS_OP_WRITE:
-				/* We really shouldn't be here. */
-				break;
-			default:
-				rs->rmsg[rs->rmsg_tail].op = rs_msg_op(msg);
-				rs->rmsg[rs->rmsg_tail].data = rs_msg_data(msg);
-				if (++rs->rmsg_tail == rs->rq_size + 1)
-					rs->rmsg_tail = 0;
-				break;
-			}
-		} else {
-			switch  (rs_msg_op(rs_wr_data(wc.wr_id))) {
-			case RS_OP_SGL:
-				rs->ctrl_max_seqno++;
-				break;
-			case RS_OP_CTRL:
-				rs->ctrl_max_seqno++;
-				if (rs_msg_data(rs_wr_data(wc.wr_id)) == RS_CTRL_DISCONNECT)
-					rs->state = rs_disconnected;
-				break;
-			case RS_OP_IOMAP_SGL:
-				rs->sqe_avail++;
-				if (!rs_wr_is_msg_send(wc.wr_id))
-					rs->sbuf_bytes_avail += sizeof(struct rs_iomap);
-				break;
-			default:
-				rs->sqe_avail++;
-				rs->sbuf_bytes_avail += rs_msg_data(rs_wr_data(wc.wr_id));
-				break;
-			}
-			if (wc.status != IBV_WC_SUCCESS && (rs->state & rs_connected)) {
-				rs->state = rs_error;
-				rs->err = EIO;
-			}
-		}
+	while (rs->target_sgl[rs->target_sge].length) {
+		rs->target_sgl[rs->target_sge].length = 0;
+		rs_next_target(rs);
 	}
 
-	if (rs->state & rs_connected) {
-		while (!ret && rcnt--)
-			ret = rs_post_recv(rs);
+	if (size > RS_RESIZE_MAX)
+		size = RS_RESIZE_MAX;
+	else if (size < RS_RESIZE_UNIT)
+		size = RS_RESIZE_UNIT;
+	rs->resize_wait = size;
+	rs->stall_start = 0;
+	rs->stall_cnt = 0;
+	rs->ctrl_seqno++;
+	rs_post_msg(rs, rs_msg_set(RS_OP_RESIZE,
+		rs_resize_set(RS_RESIZE_REQ, rs->target_seq,
+			      size / RS_RESIZE_UNIT)));
+}
 
-		if (ret) {
-			rs->state = rs_error;
-			rs->err = errno;
-		}
+static uint32_t rs_rbuf_target(struct rsocket *rs, uint32_t size)
+{
+	if (rs->so_opts & (1 << SO_RCVBUF))
+		return rs->rbuf_size;
+	if (size > def_mem_max)
+		size = def_mem_max;
+	if (size < rs->rbuf_default)
+		size = rs->rbuf_default;
+	return size;
+}
+
+/*
+ * A resize request is queued as a marker behind any data that the peer
+ * wrote into the current receive buffer.  The buffer is replaced once the
+ * reader reaches the marker, see rs_switch_rbuf.
+ */
+static void rs_process_resize(struct rsocket *rs, uint32_t data)
+{
+	uint32_t size = rs_resize_units(data) * RS_RESIZE_UNIT;
+	int stale;
+
+	switch (rs_resize_type(data)) {
+	case RS_RESIZE_REQ:
+		if (rs->rbuf_resize)
+			break;
+		rs->rbuf_resize = 1;
+		rs->rbuf_resize_stale = (rs->sgl_seq - rs_resize_seq(data)) & 0x7FF;
+		rs->rbuf_resize_size = rs_rbuf_target(rs, size);
+		rs->rmsg[rs->rmsg_tail].op = RS_OP_RESIZE;
+		rs->rmsg[rs->rmsg_tail].data = 0;
+		if (++rs->rmsg_tail == rs->rq_size + 2)
+			rs->rmsg_tail = 0;
+		break;
+	case RS_RESIZE_ACK:
+		for (stale = rs_resize_seq(data); stale; stale--) {
+			rs->target_sgl[rs->target_sge].length = 0;
+			rs_next_target(rs);
+		}
+		if (size < rs->resize_wait)
+			rs->remote_rbuf_max = size;
+		rs->remote_rbuf_size = size;
+		rs->resize_wait = 0;
+		rs->sbuf_resize = 1;
+		break;
+	case RS_RESIZE_HINT:
+		/* Hints are advisory, skip them if the sender is busy */
+		if (!rs->resize_wait && fastlock_tryacquire(&rs->slock)) {
+			rs_post_resize(rs, size);
+			fastlock_release(&rs->slock);
+		}
+		break;
+	}
+}
+
+static void rs_sendfile_comp(struct rsocket *rs)
+{
+	struct rs_sendfile_mr *sfmr;
+
+	sfmr = container_of(rs->sendfile_list.next, struct rs_sendfile_mr, entry);
+	sfmr->completed++;
+	if (sfmr->done && sfmr->completed == sfmr->posted)
+		rs_free_sendfile_mr(sfmr);
+}
+
+/*
+ * Process a single completion for an rsocket.  Returns 1 if the remote side
+ * has disconnected, in which case the caller should stop processing.
+ */
+static int rs_process_wc(struct rsocket *rs, struct ibv_wc *wc)
+{
+	uint32_t msg;
+
+	rs_stat_add(&rs->stats.cq_entries, 1);
+	if (rs_wr_is_recv(wc->wr_id)) {
+		if (wc->status != IBV_WC_SUCCESS)
+			return 0;
+
+		if (wc->wc_flags & IBV_WC_WITH_IMM) {
+			msg = be32toh(wc->imm_data);
+		} else {
+			msg = ((uint32_t *) (rs->rbuf + rs->rbuf_size))
+				[rs_wr_data(wc->wr_id)];
+
+		}
+		if (rs_msg_op(msg) != RS_OP_DATA)
+			rs_stat_add(&rs->stats.ctrl_recv, 1);
+
+		switch (rs_msg_op(msg)) {
+		case RS_OP_SGL:
+			rs->sseq_comp = (uint16_t) rs_msg_data(msg);
+			break;
+		case RS_OP_IOMAP_SGL:
+			/* The iomap was updated, that's nice to know. */
+			break;
+		case RS_OP_CTRL:
+			if (rs_msg_data(msg) == RS_CTRL_DISCONNECT) {
+				rs->state = rs_disconnected;
+				return 1;
+			} else if (rs_msg_data(msg) == RS_CTRL_SHUTDOWN) {
+				if (rs->state & rs_writable) {
+					rs->state &= ~rs_readable;
+				} else {
+					rs->state = rs_disconnected;
+					return 1;
+				}
+			}
+			break;
+		case RS_OP_WRITE:
+			/* We really shouldn't be here. */
+			break;
+		case RS_OP_RESIZE:
+			rs_process_resize(rs, rs_msg_data(msg));
+			break;
+		default:
+			rs->rmsg[rs->rmsg_tail].op = rs_msg_op(msg);
+			rs->rmsg[rs->rmsg_tail].data = rs_msg_data(msg);
+			if (++rs->rmsg_tail == rs->rq_size + 2)
+				rs->rmsg_tail = 0;
+			break;
+		}
+	} else {
+		switch  (rs_msg_op(rs_wr_data(wc->wr_id))) {
+		case RS_OP_SGL:
+		case RS_OP_RESIZE:
+			rs->ctrl_max_seqno++;
+			rs_stat_add(&rs->stats.ctrl_sent, 1);
+			break;
+		case RS_OP_CTRL:
+			rs->ctrl_max_seqno++;
+			rs_stat_add(&rs->stats.ctrl_sent, 1);
+			if (rs_msg_data(rs_wr_data(wc->wr_id)) == RS_CTRL_DISCONNECT)
+				rs->state = rs_disconnected;
+			break;
+		case RS_OP_IOMAP_SGL:
+			rs->sqe_avail++;
+			if (!rs_wr_is_msg_send(wc->wr_id))
+				rs->sbuf_bytes_avail += sizeof(struct rs_iomap);
+			break;
+		default:
+			rs->sqe_avail++;
+			rs->sbuf_bytes_avail += rs_msg_data(rs_wr_data(wc->wr_id));
+			break;
+		}
+		if (wc->wr_id & RS_WR_ID_FLAG_SENDFILE)
+			rs_sendfile_comp(rs);
+		if (wc->status != IBV_WC_SUCCESS && (rs->state & rs_connected)) {
+			rs->state = rs_error;
+			rs->err = EIO;
+		}
+	}
+	return 0;
+}
+
+static void rs_shared_signal(struct rsocket *rs)
+{
+	uint64_t cnt = 1;
+	ssize_t __attribute__((unused)) rc;
+
+	rc = write(rs->notify_fd, &cnt, sizeof cnt);
+}
+
+/*
+ * Drain a shared CQ, handing each completion to the rsocket which owns the
+ * QP.  Owners other than the calling rsocket are signaled if armed, since
+ * a user may be blocked waiting on them.  Every receive completion consumed
+ * an SRQ buffer, even if its QP has since been destroyed, so all of them
+ * are reposted.  Must be called with the shared cq_lock held.
+ */
+static int rs_shared_poll(struct rs_shared *sh, struct rsocket *rs)
+{
+	struct rsocket *owner;
+	struct ibv_wc wc;
+	void *node;
+	int ret, rcnt = 0;
+
+	while ((ret = ibv_poll_cq(sh->cq, 1, &wc)) > 0) {
+		if (rs_wr_is_recv(wc.wr_id))
+			rcnt++;
+
+		node = tfind(&wc.qp_num, &sh->qp_map, rs_shared_compare);
+		if (!node)
+			continue;
+
+		owner = container_of(*(uint32_t **) node, struct ibv_qp,
+				     qp_num)->qp_context;
+		rs_process_wc(owner, &wc);
+		if (owner != rs && owner->cq_armed)
+			rs_shared_signal(owner);
+	}
+
+	if (rcnt && !ret)
+		ret = rs_shared_post_recv(sh, rcnt);
+	return ret;
+}
+
+static void *rs_shared_run(void *arg)
+{
+	struct rs_shared *sh = arg;
+	struct pollfd fds[2];
+	struct ibv_cq *cq;
+	void *context;
+
+	fds[0].fd = sh->channel->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = sh->stop_fd;
+	fds[1].events = POLLIN;
+	do {
+		poll(fds, 2, -1);
+		if (fds[0].revents &&
+		    !ibv_get_cq_event(sh->channel, &cq, &context)) {
+			ibv_ack_cq_events(sh->cq, 1);
+
+			fastlock_acquire(&sh->cq_lock);
+			ibv_req_notify_cq(sh->cq, 0);
+			rs_shared_poll(sh, NULL);
+			fastlock_release(&sh->cq_lock);
+		}
+	} while (!fds[1].revents);
+
+	return NULL;
+}
+
+static int rs_poll_cq(struct rsocket *rs)
+{
+	struct ibv_wc wc;
+	int ret, rcnt = 0;
+
+	rs_stat_add(&rs->stats.cq_polls, 1);
+	if (rs->shared)
+		return rs_shared_poll(rs->shared, rs);
+
+	while ((ret = ibv_poll_cq(rs->cm_id->recv_cq, 1, &wc)) > 0) {
+		if (rs_wr_is_recv(wc.wr_id) && wc.status == IBV_WC_SUCCESS)
+			rcnt++;
+		if (rs_process_wc(rs, &wc))
+			return 0;
+	}
+
+	if (rs->state & rs_connected) {
+		while (!ret && rcnt--)
+			ret = rs_post_recv(rs);
+
+		if (ret) {
+			rs->state = rs_error;
+			rs->err = errno;
+		}
 	}
 	return ret;
 }
@@ -2092,17 +3126,23 @@ static int rs_get_cq_event(struct rsocket *rs)
 {
 	struct ibv_cq *cq;
 	void *context;
+	uint64_t cnt;
 	int ret;
 
 	if (!rs->cq_armed)
 		return 0;
 
-	ret = ibv_get_cq_event(rs->cm_id->recv_cq_channel, &cq, &context);
-	if (!ret) {
-		if (++rs->unack_cqe >= rs->sq_size + rs->rq_size) {
+	if (rs->shared) {
+		ret = (read(rs->notify_fd, &cnt, sizeof cnt) == sizeof cnt) ? 0 : -1;
+	} else {
+		ret = ibv_get_cq_event(rs->cm_id->recv_cq_channel, &cq, &context);
+		if (!ret && ++rs->unack_cqe >= rs->sq_size + rs->rq_size) {
 			ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
 			rs->unack_cqe = 0;
 		}
+	}
+
+	if (!ret) {
 		rs->cq_armed = 0;
 	} else if (!(errno == EAGAIN || errno == EINTR)) {
 		rs->state = rs_error;
@@ -2124,12 +3164,22 @@ static int rs_get_cq_event(struct rsocket *rs)
  * We handle this by using two locks.  The cq_lock protects against polling
  * the CQ and processing completions.  The cq_wait_lock serializes access to
  * waiting on the CQ.
+ *
+ * An rsocket using a shared CQ takes the shared cq_lock instead, and waits
+ * on its notify fd, which is signaled by whichever thread drains the CQ.
+ * The shared CQ is kept armed by its service thread.
  */
+static fastlock_t *rs_cq_lock(struct rsocket *rs)
+{
+	return rs->shared ? &rs->shared->cq_lock : &rs->cq_lock;
+}
+
 static int rs_process_cq(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
 {
+	fastlock_t *cq_lock = rs_cq_lock(rs);
 	int ret;
 
-	fastlock_acquire(&rs->cq_lock);
+	fastlock_acquire(cq_lock);
 	do {
 		rs_update_credits(rs);
 		ret = rs_poll_cq(rs);
@@ -2141,43 +3191,118 @@ static int rs_process_cq(struct rsocket *rs, int nonblock, int (*test)(struct rs
 		} else if (nonblock) {
 			ret = ERR(EWOULDBLOCK);
 		} else if (!rs->cq_armed) {
-			ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
+			if (!rs->shared)
+				ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
 			rs->cq_armed = 1;
 		} else {
 			rs_update_credits(rs);
 			fastlock_acquire(&rs->cq_wait_lock);
-			fastlock_release(&rs->cq_lock);
+			fastlock_release(cq_lock);
 
 			ret = rs_get_cq_event(rs);
 			fastlock_release(&rs->cq_wait_lock);
-			fastlock_acquire(&rs->cq_lock);
+			fastlock_acquire(cq_lock);
 		}
 	} while (!ret);
 
 	rs_update_credits(rs);
-	fastlock_release(&rs->cq_lock);
+	fastlock_release(cq_lock);
 	return ret;
 }
 
-static int rs_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
+/*
+ * Before blocking, an rsocket busy polls for a completion.  The time spent
+ * polling adapts to the average time that the rsocket waits for a
+ * completion, which is bounded by the rsocket's busy poll limit.  If
+ * completions usually arrive within the limit, we poll for twice the
+ * average wait.  Otherwise polling would just burn CPU, so we block
+ * immediately, except for every RS_POLL_PROBE_INTERVAL'th wait, which
+ * polls for a fraction of the limit.  A probe which finds a completion
+ * brings the average back under the limit once traffic picks up again.
+ */
+#define RS_POLL_PROBE_INTERVAL 16
+
+static uint32_t rs_poll_budget(struct rsocket *rs)
 {
-	uint64_t start_time = 0;
-	uint32_t poll_time;
+	uint32_t avg;
+
+	if (!rs->busy_poll_us)
+		return 0;
+
+	/*
+	 * Fast completions average out to 0, which must still leave a budget,
+	 * or no further samples are taken and busy polling stays off.
+	 */
+	avg = atomic_load_explicit(&rs->poll_avg, memory_order_relaxed);
+	if (avg <= rs->busy_poll_us) {
+		avg = max_t(uint32_t, avg << 1, 1);
+		return min(avg, rs->busy_poll_us);
+	}
+
+	if (atomic_fetch_add_explicit(&rs->poll_skips, 1, memory_order_relaxed) %
+	    RS_POLL_PROBE_INTERVAL)
+		return 0;
+
+	return max_t(uint32_t, rs->busy_poll_us >> 2, 1);
+}
+
+/*
+ * A wait that is satisfied by polling samples the time to the completion.
+ * A wait that blocks after polling only tells us that the completion took
+ * longer than the budget, so it is sampled as just over the limit, rather
+ * than as the time spent blocked, which includes the wakeup latency.  That
+ * keeps the average within reach of a single successful probe.
+ *
+ * The send path under slock and the receive path under rlock may sample
+ * concurrently.  An update lost to a race only drops one sample from the
+ * average, so relaxed atomics are enough.
+ */
+static void rs_poll_sample(struct rsocket *rs, uint32_t sample)
+{
+	uint32_t avg;
+
+	avg = atomic_load_explicit(&rs->poll_avg, memory_order_relaxed);
+	avg = (uint32_t) (((uint64_t) avg * 7 + sample) >> 3);
+	atomic_store_explicit(&rs->poll_avg, avg, memory_order_relaxed);
+}
+
+static int rs_poll_comp(struct rsocket *rs, int nonblock,
+			int (*test)(struct rsocket *rs),
+			int (*process)(struct rsocket *rs, int nonblock,
+				       int (*test)(struct rsocket *rs)))
+{
+	uint64_t start_time, poll_time;
+	uint32_t budget;
 	int ret;
 
-	do {
-		ret = rs_process_cq(rs, 1, test);
-		if (!ret || nonblock || errno != EWOULDBLOCK)
-			return ret;
+	ret = process(rs, 1, test);
+	if (!ret || nonblock || errno != EWOULDBLOCK)
+		return ret;
 
-		if (!start_time)
-			start_time = rs_time_us();
+	start_time = rs_time_us();
+	budget = rs_poll_budget(rs);
+	while ((poll_time = rs_time_us() - start_time) < budget) {
+		ret = process(rs, 1, test);
+		if (!ret) {
+			atomic_fetch_add(&rs->poll_spins, 1);
+			rs_poll_sample(rs, (uint32_t) poll_time);
+			return 0;
+		} else if (errno != EWOULDBLOCK) {
+			return ret;
+		}
+	}
 
-		poll_time = (uint32_t) (rs_time_us() - start_time);
-	} while (poll_time <= polling_time);
+	if (budget) {
+		atomic_fetch_add(&rs->poll_misses, 1);
+		rs_poll_sample(rs, rs->busy_poll_us + 1);
+	}
+	atomic_fetch_add(&rs->poll_wakeups, 1);
+	return process(rs, 0, test);
+}
 
-	ret = rs_process_cq(rs, 0, test);
-	return ret;
+static int rs_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
+{
+	return rs_poll_comp(rs, nonblock, test, rs_process_cq);
 }
 
 static int ds_valid_recv(struct ds_qp *qp, struct ibv_wc *wc)
@@ -2320,23 +3445,7 @@ static int ds_process_cqs(struct rsocket *rs, int nonblock, int (*test)(struct r
 
 static int ds_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
 {
-	uint64_t start_time = 0;
-	uint32_t poll_time;
-	int ret;
-
-	do {
-		ret = ds_process_cqs(rs, 1, test);
-		if (!ret || nonblock || errno != EWOULDBLOCK)
-			return ret;
-
-		if (!start_time)
-			start_time = rs_time_us();
-
-		poll_time = (uint32_t) (rs_time_us() - start_time);
-	} while (poll_time <= polling_time);
-
-	ret = ds_process_cqs(rs, 0, test);
-	return ret;
+	return rs_poll_comp(rs, nonblock, test, ds_process_cqs);
 }
 
 static int rs_nonblocking(struct rsocket *rs, int flags)
@@ -2367,6 +3476,7 @@ static int rs_can_send(struct rsocket *rs)
 {
 	if (!(rs->opts & RS_OPT_MSG_SEND)) {
 		return rs->sqe_avail && (rs->sbuf_bytes_avail >= RS_SNDLOWAT) &&
+		       !rs->resize_wait &&
 		       (rs->sseq_no != rs->sseq_comp) &&
 		       (rs->target_sgl[rs->target_sge].length != 0);
 	} else {
@@ -2413,6 +3523,113 @@ static int rs_conn_all_sends_done(struct rsocket *rs)
 	       !(rs->state & rs_connected);
 }
 
+static int rs_resize_at_head(struct rsocket *rs)
+{
+	return rs_have_rdata(rs) && rs->rmsg[rs->rmsg_head].op == RS_OP_RESIZE;
+}
+
+/*
+ * Replace the receive buffer once the reader has consumed all data that
+ * the peer wrote before requesting a resize.  The peer holds no targets in
+ * the old buffer, so it can be freed.  If a new buffer cannot be allocated,
+ * the current one is kept and reported back to the peer.  Caller must hold
+ * rs->rlock.
+ */
+static int rs_switch_rbuf(struct rsocket *rs, int nonblock)
+{
+	struct ibv_mr *mr = NULL, *old_mr = NULL;
+	uint8_t *rbuf = NULL, *old_rbuf = NULL;
+	uint32_t size = rs->rbuf_resize_size;
+	int ret;
+
+	if (rs->rbuf_zc_bytes)
+		return ERR(EBUSY);
+
+	if (size != rs->rbuf_size) {
+		rbuf = forksafe_alloc(size);
+		if (rbuf) {
+			mr = rdma_reg_write(rs->cm_id, rbuf, size);
+			if (!mr) {
+				free(rbuf);
+				rbuf = NULL;
+			}
+		}
+	}
+	if (!rbuf)
+		size = rs->rbuf_size;
+
+	fastlock_acquire(rs_cq_lock(rs));
+	while (!rs_ctrl_avail(rs) && (rs->state & rs_connected)) {
+		fastlock_release(rs_cq_lock(rs));
+		ret = rs_get_comp(rs, nonblock, rs_conn_can_send_ctrl);
+		if (ret) {
+			if (rbuf) {
+				rdma_dereg_mr(mr);
+				free(rbuf);
+			}
+			return ret;
+		}
+		fastlock_acquire(rs_cq_lock(rs));
+	}
+
+	if (rbuf) {
+		old_rbuf = rs->rbuf;
+		old_mr = rs->rmr;
+		rs->rbuf = rbuf;
+		rs->rmr = mr;
+		rs->rbuf_size = size;
+		rs_stat_add(&rs->stats.resizes, 1);
+	}
+	rs->rbuf_offset = 0;
+	rs->rbuf_free_offset = 0;
+	rs->rbuf_bytes_avail = size;
+	rs->rbuf_resize = 0;
+	rs->idle_seq = rs->rseq_no;
+	rs->idle_time = rs_time_us();
+	if (++rs->rmsg_head == rs->rq_size + 2)
+		rs->rmsg_head = 0;
+
+	if (rs->state & rs_connected) {
+		rs->ctrl_seqno++;
+		rs_post_msg(rs, rs_msg_set(RS_OP_RESIZE,
+			rs_resize_set(RS_RESIZE_ACK, rs->rbuf_resize_stale,
+				      size / RS_RESIZE_UNIT)));
+		rs_update_credits(rs);
+	}
+	fastlock_release(rs_cq_lock(rs));
+
+	if (old_rbuf) {
+		rdma_dereg_mr(old_mr);
+		free(old_rbuf);
+	}
+	return 0;
+}
+
+/*
+ * Wait for received data, switching receive buffers if the peer asked for
+ * a resize.  Caller must hold rs->rlock.
+ */
+static int rs_wait_rdata(struct rsocket *rs, int flags)
+{
+	int ret;
+
+	for (;;) {
+		if (!rs_have_rdata(rs)) {
+			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
+					  rs_conn_have_rdata);
+			if (ret || !rs_have_rdata(rs))
+				return ret;
+		}
+
+		if (!rs_resize_at_head(rs))
+			return 0;
+
+		ret = rs_switch_rbuf(rs, rs_nonblocking(rs, flags));
+		if (ret)
+			return ret;
+	}
+}
+
 static void ds_set_src(struct sockaddr *addr, socklen_t *addrlen,
 		       struct ds_header *hdr)
 {
@@ -2483,12 +3700,13 @@ static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 	rmsg_head = rs->rmsg_head;
 	rbuf_offset = rs->rbuf_offset;
 
-	for (; left && (rmsg_head != rs->rmsg_tail); left -= rsize) {
+	for (; left && (rmsg_head != rs->rmsg_tail) &&
+	       (rs->rmsg[rmsg_head].op != RS_OP_RESIZE); left -= rsize) {
 		if (left < rs->rmsg[rmsg_head].data) {
 			rsize = left;
 		} else {
 			rsize = rs->rmsg[rmsg_head].data;
-			if (++rmsg_head == rs->rq_size + 1)
+			if (++rmsg_head == rs->rq_size + 2)
 				rmsg_head = 0;
 		}
 
@@ -2511,53 +3729,38 @@ static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 /*
  * Continue to receive any queued data even if the remote side has disconnected.
  */
-ssize_t rrecv(int socket, void *buf, size_t len, int flags)
+/*
+ * Caller must hold rs->rlock.
+ */
+static ssize_t rs_recv(struct rsocket *rs, void *buf, size_t len, int flags)
 {
-	struct rsocket *rs;
 	size_t left = len;
 	uint32_t end_size, rsize;
 	int ret = 0;
 
-	rs = idm_at(&idm, socket);
-	if (!rs)
-		return ERR(EBADF);
-	if (rs->type == SOCK_DGRAM) {
-		fastlock_acquire(&rs->rlock);
-		ret = ds_recvfrom(rs, buf, len, flags, NULL, NULL);
-		fastlock_release(&rs->rlock);
-		return ret;
-	}
+	/* Copied data cannot be returned until zero-copy data is released */
+	if (rs->rbuf_zc_bytes && !(flags & MSG_PEEK))
+		return ERR(EBUSY);
 
-	if (rs->state & rs_opening) {
-		ret = rs_do_connect(rs);
-		if (ret) {
-			if (errno == EINPROGRESS)
-				errno = EAGAIN;
-			return ret;
-		}
-	}
-	fastlock_acquire(&rs->rlock);
 	do {
-		if (!rs_have_rdata(rs)) {
-			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_have_rdata);
-			if (ret)
-				break;
-		}
+		ret = rs_wait_rdata(rs, flags);
+		if (ret)
+			break;
 
 		if (flags & MSG_PEEK) {
 			left = len - rs_peek(rs, buf, left);
 			break;
 		}
 
-		for (; left && rs_have_rdata(rs); left -= rsize) {
+		for (; left && rs_have_rdata(rs) && !rs_resize_at_head(rs);
+		     left -= rsize) {
 			if (left < rs->rmsg[rs->rmsg_head].data) {
 				rsize = left;
 				rs->rmsg[rs->rmsg_head].data -= left;
 			} else {
 				rs->rseq_no++;
 				rsize = rs->rmsg[rs->rmsg_head].data;
-				if (++rs->rmsg_head == rs->rq_size + 1)
+				if (++rs->rmsg_head == rs->rq_size + 2)
 					rs->rmsg_head = 0;
 			}
 
@@ -2578,29 +3781,160 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 
 	} while (left && (flags & MSG_WAITALL) && (rs->state & rs_readable));
 
-	fastlock_release(&rs->rlock);
+	if (!(flags & MSG_PEEK))
+		rs_stat_add(&rs->stats.bytes_recv, len - left);
 	return (ret && left == len) ? ret : len - left;
 }
 
-ssize_t rrecvfrom(int socket, void *buf, size_t len, int flags,
-		  struct sockaddr *src_addr, socklen_t *addrlen)
+ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 {
 	struct rsocket *rs;
-	int ret;
+	ssize_t ret;
 
 	rs = idm_at(&idm, socket);
 	if (!rs)
 		return ERR(EBADF);
 	if (rs->type == SOCK_DGRAM) {
 		fastlock_acquire(&rs->rlock);
-		ret = ds_recvfrom(rs, buf, len, flags, src_addr, addrlen);
+		ret = ds_recvfrom(rs, buf, len, flags, NULL, NULL);
 		fastlock_release(&rs->rlock);
 		return ret;
 	}
 
-	ret = rrecv(socket, buf, len, flags);
-	if (ret > 0 && src_addr)
-		rgetpeername(socket, src_addr, addrlen);
+	if (rs->state & rs_opening) {
+		ret = rs_do_connect(rs);
+		if (ret) {
+			if (errno == EINPROGRESS)
+				errno = EAGAIN;
+			return ret;
+		}
+	}
+	fastlock_acquire(&rs->rlock);
+	ret = rs_recv(rs, buf, len, flags);
+	fastlock_release(&rs->rlock);
+	return ret;
+}
+
+/*
+ * Zero-copy receive.  Rather than copying data out of the receive buffer,
+ * return a pointer to the data in place.  The buffer space is not given
+ * back to the remote peer until the application releases the data through
+ * rrecv_release.  Returned regions are contiguous, so a transfer which
+ * wraps around the end of the receive buffer is returned in two pieces.
+ */
+ssize_t rrecv_zc(int socket, void **buf, size_t len, int flags)
+{
+	struct rsocket *rs;
+	uint32_t end_size, rsize;
+	int ret = 0;
+
+	rs = idm_lookup(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type != SOCK_STREAM)
+		return ERR(EOPNOTSUPP);
+
+	if (rs->state & rs_opening) {
+		ret = rs_do_connect(rs);
+		if (ret) {
+			if (errno == EINPROGRESS)
+				errno = EAGAIN;
+			return ret;
+		}
+	}
+
+	*buf = NULL;
+	fastlock_acquire(&rs->rlock);
+	ret = rs_wait_rdata(rs, flags);
+	if (ret || !rs_have_rdata(rs))
+		goto out;
+
+	rsize = rs->rmsg[rs->rmsg_head].data;
+	end_size = rs->rbuf_size - rs->rbuf_offset;
+	if (rsize > end_size)
+		rsize = end_size;
+	if (rsize > len)
+		rsize = len;
+
+	*buf = &rs->rbuf[rs->rbuf_offset];
+	ret = rsize;
+	if (flags & MSG_PEEK)
+		goto out;
+
+	if (!rs->rbuf_zc_bytes)
+		rs->rbuf_zc_offset = rs->rbuf_offset;
+	rs->rbuf_zc_bytes += rsize;
+	rs_stat_add(&rs->stats.bytes_recv, rsize);
+
+	if (rsize < rs->rmsg[rs->rmsg_head].data) {
+		rs->rmsg[rs->rmsg_head].data -= rsize;
+	} else {
+		rs->rseq_no++;
+		if (++rs->rmsg_head == rs->rq_size + 2)
+			rs->rmsg_head = 0;
+	}
+
+	rs->rbuf_offset += rsize;
+	if (rs->rbuf_offset == rs->rbuf_size)
+		rs->rbuf_offset = 0;
+out:
+	fastlock_release(&rs->rlock);
+	return ret;
+}
+
+/*
+ * Zero-copy data must be released in the order that it was received.  A
+ * release may cover part of a region, or span multiple regions.
+ */
+int rrecv_release(int socket, void *buf, size_t len)
+{
+	struct rsocket *rs;
+
+	rs = idm_lookup(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type != SOCK_STREAM)
+		return ERR(EOPNOTSUPP);
+
+	fastlock_acquire(&rs->rlock);
+	if (!len || len > rs->rbuf_zc_bytes ||
+	    buf != &rs->rbuf[rs->rbuf_zc_offset]) {
+		fastlock_release(&rs->rlock);
+		return ERR(EINVAL);
+	}
+
+	rs->rbuf_zc_bytes -= len;
+	rs->rbuf_zc_offset = (rs->rbuf_zc_offset + len) % rs->rbuf_size;
+	rs->rbuf_bytes_avail += len;
+	if (!rs->rbuf_zc_bytes && rs_resize_at_head(rs))
+		rs_switch_rbuf(rs, 1);
+	fastlock_release(&rs->rlock);
+
+	fastlock_acquire(rs_cq_lock(rs));
+	rs_update_credits(rs);
+	fastlock_release(rs_cq_lock(rs));
+	return 0;
+}
+
+ssize_t rrecvfrom(int socket, void *buf, size_t len, int flags,
+		  struct sockaddr *src_addr, socklen_t *addrlen)
+{
+	struct rsocket *rs;
+	int ret;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM) {
+		fastlock_acquire(&rs->rlock);
+		ret = ds_recvfrom(rs, buf, len, flags, src_addr, addrlen);
+		fastlock_release(&rs->rlock);
+		return ret;
+	}
+
+	ret = rrecv(socket, buf, len, flags);
+	if (ret > 0 && src_addr)
+		rgetpeername(socket, src_addr, addrlen);
 
 	return ret;
 }
@@ -2632,6 +3966,91 @@ ssize_t rreadv(int socket, const struct iovec *iov, int iovcnt)
 	return rrecvv(socket, iov, iovcnt, 0);
 }
 
+static int rs_timeout_expired(struct timespec *end)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec > end->tv_sec) ||
+	       (now.tv_sec == end->tv_sec && now.tv_nsec >= end->tv_nsec);
+}
+
+/*
+ * Receive multiple messages while holding the receive lock, so that
+ * completions for the entire batch are processed together.  As with
+ * rrecvmsg, only the first vector of each message is filled in.  Stream
+ * rsockets return data as it is available, not on message boundaries.
+ * Like recvmmsg, the timeout is only checked after a message is received.
+ */
+int rrecvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	      int flags, struct timespec *timeout)
+{
+	struct rsocket *rs;
+	struct msghdr *msg;
+	struct timespec end;
+	unsigned int i;
+	void *buf;
+	size_t len;
+	ssize_t ret = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->state & rs_opening) {
+		ret = rs_do_connect(rs);
+		if (ret) {
+			if (errno == EINPROGRESS)
+				errno = EAGAIN;
+			return ret;
+		}
+	}
+
+	if (timeout) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		end.tv_sec += timeout->tv_sec;
+		end.tv_nsec += timeout->tv_nsec;
+		if (end.tv_nsec >= 1000000000) {
+			end.tv_sec++;
+			end.tv_nsec -= 1000000000;
+		}
+	}
+
+	fastlock_acquire(&rs->rlock);
+	for (i = 0; i < vlen; i++) {
+		msg = &msgvec[i].msg_hdr;
+		if (msg->msg_control && msg->msg_controllen) {
+			ret = ERR(ENOTSUP);
+			break;
+		}
+
+		buf = msg->msg_iovlen ? msg->msg_iov[0].iov_base : NULL;
+		len = msg->msg_iovlen ? msg->msg_iov[0].iov_len : 0;
+		if (rs->type == SOCK_DGRAM)
+			ret = ds_recvfrom(rs, buf, len, flags, msg->msg_name,
+					  msg->msg_name ? &msg->msg_namelen : NULL);
+		else
+			ret = rs_recv(rs, buf, len, flags);
+		if (ret < 0)
+			break;
+
+		msgvec[i].msg_len = ret;
+		if (!ret && rs->type == SOCK_STREAM) {
+			i++;
+			break;
+		}
+
+		if (flags & MSG_WAITFORONE)
+			flags |= MSG_DONTWAIT;
+		if (timeout && rs_timeout_expired(&end)) {
+			i++;
+			break;
+		}
+	}
+	fastlock_release(&rs->rlock);
+
+	return i ? i : ret;
+}
+
 static int rs_send_iomaps(struct rsocket *rs, int flags)
 {
 	struct rs_iomap_mr *iomr;
@@ -2781,6 +4200,163 @@ static ssize_t dsend(struct rsocket *rs, const void *buf, size_t len, int flags)
 	return ret ? ret : len;
 }
 
+static uint32_t rs_sbuf_target(struct rsocket *rs)
+{
+	uint32_t size;
+
+	if (rs->so_opts & (1 << SO_SNDBUF))
+		return rs->sbuf_size;
+	size = min(rs->remote_rbuf_size, def_wmem_max);
+	return max(size, rs->sbuf_default);
+}
+
+/*
+ * Size the send buffer to match the peer's receive buffer.  The buffer
+ * can only be replaced once all sends, including control messages, have
+ * completed.  Caller must hold rs->slock.
+ */
+static void rs_resize_sbuf(struct rsocket *rs)
+{
+	struct ibv_mr *mr, *old_mr;
+	uint8_t *sbuf, *old_sbuf;
+	uint32_t size, total_size;
+
+	size = rs_sbuf_target(rs);
+	if (size == rs->sbuf_size) {
+		rs->sbuf_resize = 0;
+		return;
+	}
+
+	/*
+	 * Avoid allocating and registering a buffer on every send while
+	 * writes are still outstanding.  The receive path may still post a
+	 * control message, so the check is repeated before the swap.
+	 */
+	fastlock_acquire(rs_cq_lock(rs));
+	if (!(rs->state & rs_connected) || !rs_conn_all_sends_done(rs)) {
+		fastlock_release(rs_cq_lock(rs));
+		return;
+	}
+	fastlock_release(rs_cq_lock(rs));
+
+	rs->sbuf_resize = 0;
+	total_size = size;
+	if (rs->sq_inline < RS_MAX_CTRL_MSG)
+		total_size += RS_MAX_CTRL_MSG * RS_QP_CTRL_SIZE;
+	sbuf = forksafe_alloc(total_size);
+	if (!sbuf)
+		return;
+
+	mr = rdma_reg_msgs(rs->cm_id, sbuf, total_size);
+	if (!mr) {
+		free(sbuf);
+		return;
+	}
+
+	fastlock_acquire(rs_cq_lock(rs));
+	if (!(rs->state & rs_connected) || !rs_conn_all_sends_done(rs)) {
+		fastlock_release(rs_cq_lock(rs));
+		rdma_dereg_mr(mr);
+		free(sbuf);
+		rs->sbuf_resize = 1;
+		return;
+	}
+
+	old_sbuf = rs->sbuf;
+	old_mr = rs->smr;
+	rs->sbuf = sbuf;
+	rs->smr = mr;
+	rs->sbuf_size = size;
+	rs->sbuf_bytes_avail = size;
+	rs->ssgl[0].addr = rs->ssgl[1].addr = (uintptr_t) sbuf;
+	rs->ssgl[0].lkey = rs->ssgl[1].lkey = mr->lkey;
+	fastlock_release(rs_cq_lock(rs));
+
+	rdma_dereg_mr(old_mr);
+	free(old_sbuf);
+}
+
+/*
+ * The sender is stalled only because it is waiting for the peer to return
+ * receive buffer space.
+ */
+static int rs_window_limited(struct rsocket *rs)
+{
+	return !rs->resize_wait && rs->sqe_avail &&
+	       (rs->sbuf_bytes_avail >= RS_SNDLOWAT) &&
+	       (rs->sseq_no != rs->sseq_comp) &&
+	       (rs->target_sgl[rs->target_sge].length == 0);
+}
+
+/*
+ * If the peer returns receive buffer space within about a round trip of
+ * our running out, throughput is limited by the size of its buffer rather
+ * than by the receiving application.  The shortest stall seen approximates
+ * the round trip time.  After several such stalls in a row, ask the peer
+ * to double its receive buffer.
+ */
+static void rs_start_stall(struct rsocket *rs)
+{
+	if (rs->stall_cnt >= RS_RESIZE_STALLS &&
+	    rs->remote_rbuf_size < rs->remote_rbuf_max) {
+		fastlock_acquire(rs_cq_lock(rs));
+		rs_post_resize(rs, rs->remote_rbuf_size << 1);
+		fastlock_release(rs_cq_lock(rs));
+	} else {
+		rs->stall_start = rs_time_us();
+	}
+}
+
+static void rs_end_stall(struct rsocket *rs)
+{
+	uint32_t stall;
+
+	stall = (uint32_t) (rs_time_us() - rs->stall_start);
+	rs->stall_start = 0;
+	if (!rs->stall_min || stall < rs->stall_min)
+		rs->stall_min = stall;
+
+	if (stall <= (rs->stall_min << 1) + RS_RESIZE_SLACK_US)
+		rs->stall_cnt++;
+	else
+		rs->stall_cnt = 0;
+}
+
+/*
+ * Caller must hold rs->slock.
+ */
+static int rs_wait_send(struct rsocket *rs, int flags)
+{
+	int ret;
+
+	if (rs->sbuf_resize)
+		rs_resize_sbuf(rs);
+
+	if (!rs_can_send(rs)) {
+		if (rs->sqe_avail && rs->sbuf_bytes_avail >= RS_SNDLOWAT)
+			rs_stat_add(&rs->stats.credit_stalls, 1);
+		else
+			rs_stat_add(&rs->stats.send_stalls, 1);
+	}
+
+	while (!rs_can_send(rs)) {
+		if ((rs->opts & RS_OPT_RESIZE) && !rs->stall_start &&
+		    rs_window_limited(rs))
+			rs_start_stall(rs);
+
+		ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
+				  rs_conn_can_send);
+		if (ret)
+			return ret;
+		if (!(rs->state & rs_writable))
+			return ERR(ECONNRESET);
+	}
+
+	if (rs->stall_start)
+		rs_end_stall(rs);
+	return 0;
+}
+
 /*
  * We overlap sending the data, by posting a small work request immediately,
  * then increasing the size of the send on each iteration.
@@ -2819,16 +4395,9 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 			goto out;
 	}
 	for (; left; left -= xfer_size, buf += xfer_size) {
-		if (!rs_can_send(rs)) {
-			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_can_send);
-			if (ret)
-				break;
-			if (!(rs->state & rs_writable)) {
-				ret = ERR(ECONNRESET);
-				break;
-			}
-		}
+		ret = rs_wait_send(rs, flags);
+		if (ret)
+			break;
 
 		if (olen < left) {
 			xfer_size = olen;
@@ -2929,49 +4498,40 @@ static void rs_copy_iov(void *dst, const struct iovec **iov, size_t *offset, siz
 	}
 }
 
-static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags)
+static size_t rs_iov_len(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+/*
+ * Caller must hold rs->slock.
+ */
+static ssize_t rs_sendv(struct rsocket *rs, const struct iovec *iov, int iovcnt,
+			int flags)
 {
-	struct rsocket *rs;
 	const struct iovec *cur_iov;
 	size_t left, len, offset = 0;
 	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
-	int i, ret = 0;
-
-	rs = idm_at(&idm, socket);
-	if (!rs)
-		return ERR(EBADF);
-	if (rs->state & rs_opening) {
-		ret = rs_do_connect(rs);
-		if (ret) {
-			if (errno == EINPROGRESS)
-				errno = EAGAIN;
-			return ret;
-		}
-	}
+	int ret = 0;
 
 	cur_iov = iov;
-	len = iov[0].iov_len;
-	for (i = 1; i < iovcnt; i++)
-		len += iov[i].iov_len;
+	len = rs_iov_len(iov, iovcnt);
 	left = len;
 
-	fastlock_acquire(&rs->slock);
 	if (rs->iomap_pending) {
 		ret = rs_send_iomaps(rs, flags);
 		if (ret)
-			goto out;
+			return ret;
 	}
 	for (; left; left -= xfer_size) {
-		if (!rs_can_send(rs)) {
-			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_can_send);
-			if (ret)
-				break;
-			if (!(rs->state & rs_writable)) {
-				ret = ERR(ECONNRESET);
-				break;
-			}
-		}
+		ret = rs_wait_send(rs, flags);
+		if (ret)
+			break;
 
 		if (olen < left) {
 			xfer_size = olen;
@@ -3009,16 +4569,37 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 		if (ret)
 			break;
 	}
-out:
-	fastlock_release(&rs->slock);
 
 	return (ret && left == len) ? ret : len - left;
 }
 
-ssize_t rsendmsg(int socket, const struct msghdr *msg, int flags)
+static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags)
 {
-	if (msg->msg_control && msg->msg_controllen)
-		return ERR(ENOTSUP);
+	struct rsocket *rs;
+	ssize_t ret;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->state & rs_opening) {
+		ret = rs_do_connect(rs);
+		if (ret) {
+			if (errno == EINPROGRESS)
+				errno = EAGAIN;
+			return ret;
+		}
+	}
+
+	fastlock_acquire(&rs->slock);
+	ret = rs_sendv(rs, iov, iovcnt, flags);
+	fastlock_release(&rs->slock);
+	return ret;
+}
+
+ssize_t rsendmsg(int socket, const struct msghdr *msg, int flags)
+{
+	if (msg->msg_control && msg->msg_controllen)
+		return ERR(ENOTSUP);
 
 	return rsendv(socket, msg->msg_iov, (int) msg->msg_iovlen, flags);
 }
@@ -3033,6 +4614,294 @@ ssize_t rwritev(int socket, const struct iovec *iov, int iovcnt)
 	return rsendv(socket, iov, iovcnt, 0);
 }
 
+static int ds_sendmmsg(struct rsocket *rs, struct mmsghdr *msgvec,
+		       unsigned int vlen, int flags)
+{
+	struct msghdr *msg;
+	unsigned int i;
+	ssize_t ret = 0;
+
+	if (rs->state == rs_init) {
+		ret = ds_init_ep(rs);
+		if (ret)
+			return ret;
+	}
+
+	fastlock_acquire(&rs->slock);
+	for (i = 0; i < vlen; i++) {
+		msg = &msgvec[i].msg_hdr;
+		if (msg->msg_iovlen > 1 ||
+		    (msg->msg_control && msg->msg_controllen)) {
+			ret = ERR(ENOTSUP);
+			break;
+		}
+
+		if (msg->msg_name) {
+			if (!rs->conn_dest ||
+			    ds_compare_addr(msg->msg_name, &rs->conn_dest->addr)) {
+				ret = ds_get_dest(rs, msg->msg_name,
+						  msg->msg_namelen, &rs->conn_dest);
+				if (ret)
+					break;
+			}
+		} else if (!rs->conn_dest) {
+			ret = ERR(EDESTADDRREQ);
+			break;
+		}
+
+		ret = dsend(rs, msg->msg_iovlen ? msg->msg_iov[0].iov_base : NULL,
+			    msg->msg_iovlen ? msg->msg_iov[0].iov_len : 0, flags);
+		if (ret < 0)
+			break;
+		msgvec[i].msg_len = ret;
+	}
+	fastlock_release(&rs->slock);
+
+	return i ? i : ret;
+}
+
+#define RS_MMSG_IOV_MAX 64
+
+/*
+ * Send multiple messages while holding the send lock.  Stream rsockets do
+ * not preserve message boundaries, so the data from consecutive messages is
+ * gathered and written to the remote receive buffer together.  A batch of
+ * small messages is carried by a single RDMA write, rather than one write
+ * per message.
+ */
+int rsendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	struct iovec iov[RS_MMSG_IOV_MAX];
+	struct rsocket *rs;
+	struct msghdr *msg;
+	unsigned int i = 0, j;
+	int iovcnt, partial;
+	size_t mlen;
+	ssize_t ret = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM)
+		return ds_sendmmsg(rs, msgvec, vlen, flags);
+
+	if (rs->state & rs_opening) {
+		ret = rs_do_connect(rs);
+		if (ret) {
+			if (errno == EINPROGRESS)
+				errno = EAGAIN;
+			return ret;
+		}
+	}
+
+	fastlock_acquire(&rs->slock);
+	while (i < vlen) {
+		for (j = i, iovcnt = 0; j < vlen; j++) {
+			msg = &msgvec[j].msg_hdr;
+			if (msg->msg_control && msg->msg_controllen)
+				break;
+			if (iovcnt + msg->msg_iovlen > RS_MMSG_IOV_MAX)
+				break;
+
+			memcpy(&iov[iovcnt], msg->msg_iov,
+			       sizeof(*iov) * msg->msg_iovlen);
+			iovcnt += msg->msg_iovlen;
+		}
+
+		if (j == i) {
+			msg = &msgvec[i].msg_hdr;
+			if (msg->msg_control && msg->msg_controllen) {
+				ret = ERR(ENOTSUP);
+				break;
+			}
+
+			/* Too many vectors to gather, send by itself */
+			ret = rs_sendv(rs, msg->msg_iov, msg->msg_iovlen, flags);
+			j = i + 1;
+		} else {
+			ret = rs_sendv(rs, iov, iovcnt, flags);
+		}
+		if (ret < 0)
+			break;
+
+		/*
+		 * Like sendmmsg, stop at the first message that was not sent in
+		 * full.  A message that was partly sent is counted, but nothing
+		 * after it may be written, or the stream would skip its tail.
+		 */
+		for (partial = 0; i < j && !partial; i++) {
+			mlen = rs_iov_len(msgvec[i].msg_hdr.msg_iov,
+					  msgvec[i].msg_hdr.msg_iovlen);
+			if (mlen > (size_t) ret) {
+				if (!ret)
+					break;
+				mlen = ret;
+				partial = 1;
+			}
+			msgvec[i].msg_len = mlen;
+			ret -= mlen;
+		}
+		if (i < j || partial)
+			break;
+	}
+	fastlock_release(&rs->slock);
+
+	return i ? i : ret;
+}
+
+#define RS_SENDFILE_MAX (1 << 24)
+
+/*
+ * Write a mapped region of a file to the remote receive buffer without
+ * copying it into the send buffer.  The mapping is owned by this call: it
+ * stays registered until its writes complete and is released from
+ * completion handling, see rs_sendfile_comp.  If it cannot be registered,
+ * fall back to sending through the send buffer.  Caller must hold
+ * rs->slock.
+ */
+static ssize_t rs_sendfile_map(struct rsocket *rs, void *map, size_t map_len,
+			       void *buf, size_t len)
+{
+	struct rs_sendfile_mr *sfmr;
+	struct ibv_sge sge;
+	struct iovec iov;
+	size_t left = len;
+	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
+	int ret = 0;
+
+	sfmr = calloc(1, sizeof(*sfmr));
+	if (sfmr)
+		sfmr->mr = ibv_reg_mr(rs->cm_id->pd, buf, len, 0);
+	if (!sfmr || !sfmr->mr) {
+		free(sfmr);
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		ret = rs_sendv(rs, &iov, 1, 0);
+		munmap(map, map_len);
+		return ret;
+	}
+
+	sfmr->map = map;
+	sfmr->map_len = map_len;
+	fastlock_acquire(rs_cq_lock(rs));
+	dlist_insert_tail(&sfmr->entry, &rs->sendfile_list);
+	fastlock_release(rs_cq_lock(rs));
+
+	sge.lkey = sfmr->mr->lkey;
+	for (; left; left -= xfer_size, buf += xfer_size) {
+		ret = rs_wait_send(rs, 0);
+		if (ret)
+			break;
+
+		if (olen < left) {
+			xfer_size = olen;
+			if (olen < RS_MAX_TRANSFER)
+				olen <<= 1;
+		} else {
+			xfer_size = left;
+		}
+
+		if (xfer_size > rs->sbuf_bytes_avail)
+			xfer_size = rs->sbuf_bytes_avail;
+		if (xfer_size > rs->target_sgl[rs->target_sge].length)
+			xfer_size = rs->target_sgl[rs->target_sge].length;
+
+		sge.addr = (uintptr_t) buf;
+		sge.length = xfer_size;
+		ret = rs_write_data_flags(rs, &sge, 1, xfer_size, 0,
+					  RS_WR_ID_FLAG_SENDFILE);
+		if (ret)
+			break;
+		sfmr->posted++;
+	}
+
+	fastlock_acquire(rs_cq_lock(rs));
+	sfmr->done = 1;
+	if (sfmr->completed == sfmr->posted)
+		rs_free_sendfile_mr(sfmr);
+	fastlock_release(rs_cq_lock(rs));
+	return (ret && left == len) ? ret : len - left;
+}
+
+/*
+ * Transfer data from a file directly out of the page cache.  The file is
+ * mapped in pieces of up to RS_SENDFILE_MAX bytes, and each piece is
+ * RDMA written into the remote receive buffer.
+ */
+ssize_t rsendfile(int socket, int in_fd, off_t *offset, size_t count)
+{
+	struct rsocket *rs;
+	struct stat st;
+	off_t pos, map_off;
+	size_t left, len, map_len;
+	long pagesize;
+	void *map;
+	ssize_t ret = 0;
+
+	rs = idm_lookup(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type != SOCK_STREAM)
+		return ERR(EOPNOTSUPP);
+
+	if (rs->state & rs_opening) {
+		ret = rs_do_connect(rs);
+		if (ret) {
+			if (errno == EINPROGRESS)
+				errno = EAGAIN;
+			return ret;
+		}
+	}
+
+	pos = offset ? *offset : lseek(in_fd, 0, SEEK_CUR);
+	if (pos < 0 || fstat(in_fd, &st))
+		return -1;
+
+	if (pos >= st.st_size)
+		return 0;
+	if (count > st.st_size - pos)
+		count = st.st_size - pos;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	left = count;
+	fastlock_acquire(&rs->slock);
+	if (rs->iomap_pending) {
+		ret = rs_send_iomaps(rs, 0);
+		if (ret)
+			goto out;
+	}
+	while (left) {
+		len = min_t(size_t, left, RS_SENDFILE_MAX);
+		map_off = pos & ~((off_t) pagesize - 1);
+		map_len = len + (pos - map_off);
+		map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, in_fd, map_off);
+		if (map == MAP_FAILED) {
+			ret = -1;
+			break;
+		}
+
+		ret = rs_sendfile_map(rs, map, map_len, map + (pos - map_off),
+				      len);
+		if (ret <= 0)
+			break;
+
+		pos += ret;
+		left -= ret;
+		if ((size_t) ret < len)
+			break;
+	}
+out:
+	fastlock_release(&rs->slock);
+
+	if (left != count) {
+		if (offset)
+			*offset = pos;
+		else
+			lseek(in_fd, pos, SEEK_SET);
+	}
+	return (ret < 0 && left == count) ? ret : count - left;
+}
+
 /* When mapping rpoll to poll, the events reported on the RDMA
  * fd are independent from the events rpoll may be looking for.
  * To avoid threads hanging in poll, whenever any event occurs,
@@ -3063,39 +4932,88 @@ unlock:
  */
 static int rs_poll_enter(void)
 {
-	pthread_mutex_lock(&mut);
-	if (suspendpoll) {
-		pthread_mutex_unlock(&mut);
-		sched_yield();
-		return -EBUSY;
-	}
+	uint32_t gate;
+
+	gate = atomic_load(&pollgate);
+	do {
+		if (gate & RS_POLL_SUSPEND) {
+			sched_yield();
+			return -EBUSY;
+		}
+	} while (!atomic_compare_exchange_weak(&pollgate, &gate, gate + 1));
 
-	pollcnt++;
-	pthread_mutex_unlock(&mut);
 	return 0;
 }
 
-static void rs_poll_exit(void)
+/* Called by the last thread leaving a suspended gate.  The thread which
+ * suspended the gate writes the signal after setting RS_POLL_SUSPEND, so
+ * the write may still be in flight.  No thread can enter the gate until
+ * it is reopened, so wait for the write to finish, clear the signal if it
+ * was sent, then reopen.  The writer only takes pollmut if WAITING is set,
+ * which is done under pollmut before re-checking PENDING.
+ */
+static void rs_poll_resume(void)
 {
+	struct pollfd fds;
 	uint64_t c;
 	int save_errno;
-	ssize_t ret;
 
-	pthread_mutex_lock(&mut);
-	if (!--pollcnt) {
-		/* Keep errno value from poll() call.  We try to clear
-		 * a single signal.  But there's no guarantee that we'll
-		 * find one.  Additional signals indicate that a change
-		 * occurred on an rsocket, which requires all threads to
-		 * re-check before blocking on poll.
-		 */
+	if (atomic_load(&pollgate) & RS_POLL_PENDING) {
+		pthread_mutex_lock(&pollmut);
+		atomic_fetch_or(&pollgate, RS_POLL_WAITING);
+		while (atomic_load(&pollgate) & RS_POLL_PENDING)
+			pthread_cond_wait(&pollcond, &pollmut);
+		pthread_mutex_unlock(&pollmut);
+	}
+
+	if (atomic_load(&pollgate) & RS_POLL_SIGNALED) {
+		/* Keep errno value from poll() call. */
 		save_errno = errno;
-		ret = read(pollsignal, &c, sizeof(c));
-		if (ret != sizeof(c))
-			errno = save_errno;
-		suspendpoll = 0;
+		fds.fd = pollsignal;
+		fds.events = POLLIN;
+		while (read(pollsignal, &c, sizeof(c)) != sizeof(c) &&
+		       errno == EAGAIN)
+			poll(&fds, 1, -1);
+		errno = save_errno;
 	}
-	pthread_mutex_unlock(&mut);
+
+	atomic_store(&pollgate, 0);
+}
+
+static void rs_poll_exit(void)
+{
+	uint32_t gate;
+
+	gate = atomic_fetch_sub(&pollgate, 1);
+	if ((gate & RS_POLL_SUSPEND) && rs_poll_cnt(gate) == 1)
+		rs_poll_resume();
+}
+
+/* Called by the thread which suspended the gate, to wake up the threads
+ * still in it.  The outcome is recorded in the gate, so that the last
+ * thread leaving it does not wait for a signal that was never sent.  The
+ * last thread may already be blocked in rs_poll_resume() waiting for it,
+ * in which case it has set WAITING.
+ */
+static int rs_poll_write_signal(void)
+{
+	uint64_t c = 1;
+	uint32_t gate;
+	ssize_t ret;
+
+	ret = write(pollsignal, &c, sizeof(c));
+	if (ret == sizeof(c))
+		gate = atomic_fetch_xor(&pollgate,
+					RS_POLL_PENDING | RS_POLL_SIGNALED);
+	else
+		gate = atomic_fetch_and(&pollgate, ~RS_POLL_PENDING);
+
+	if (gate & RS_POLL_WAITING) {
+		pthread_mutex_lock(&pollmut);
+		pthread_cond_broadcast(&pollcond);
+		pthread_mutex_unlock(&pollmut);
+	}
+	return ret == sizeof(c) ? 0 : -1;
 }
 
 /* When an event occurs, it's possible for a single thread blocked in
@@ -3113,50 +5031,47 @@ static void rs_poll_exit(void)
  * polling threads whenever poll() indicates that there is a new
  * completion to process, and when rpoll() will return a successful
  * value after having blocked.
+ *
+ * The gate is updated with atomic operations, so that threads calling
+ * rpoll() on unrelated rsockets do not serialize on a process wide lock.
+ * Only the thread which sets RS_POLL_SUSPEND writes the signal, and only
+ * the last thread to leave the suspended gate reads it, if it was sent.
  */
 static void rs_poll_stop(void)
 {
-	uint64_t c;
+	uint32_t gate, new_gate;
 	int save_errno;
-	ssize_t ret;
-
-	/* See comment in rs_poll_exit */
-	save_errno = errno;
-
-	pthread_mutex_lock(&mut);
-	if (!--pollcnt) {
-		ret = read(pollsignal, &c, sizeof(c));
-		suspendpoll = 0;
-	} else if (!suspendpoll) {
-		suspendpoll = 1;
-		c = 1;
-		ret = write(pollsignal, &c, sizeof(c));
-	} else {
-		ret = sizeof(c);
-	}
-	pthread_mutex_unlock(&mut);
 
-	if (ret != sizeof(c))
+	gate = atomic_load(&pollgate);
+	do {
+		new_gate = gate - 1;
+		if (rs_poll_cnt(new_gate) && !(gate & RS_POLL_SUSPEND))
+			new_gate |= RS_POLL_SUSPEND | RS_POLL_PENDING;
+	} while (!atomic_compare_exchange_weak(&pollgate, &gate, new_gate));
+
+	if (!rs_poll_cnt(new_gate)) {
+		if (new_gate & RS_POLL_SUSPEND)
+			rs_poll_resume();
+	} else if (!(gate & RS_POLL_SUSPEND)) {
+		/* Keep errno value from poll() call. */
+		save_errno = errno;
+		rs_poll_write_signal();
 		errno = save_errno;
+	}
 }
 
 static int rs_poll_signal(void)
 {
-	uint64_t c;
-	ssize_t ret;
+	uint32_t gate;
 
-	pthread_mutex_lock(&mut);
-	if (pollcnt && !suspendpoll) {
-		suspendpoll = 1;
-		c = 1;
-		ret = write(pollsignal, &c, sizeof(c));
-		if (ret == sizeof(c))
-			ret = 0;
-	} else {
-		ret = 0;
-	}
-	pthread_mutex_unlock(&mut);
-	return ret;
+	gate = atomic_load(&pollgate);
+	do {
+		if (!rs_poll_cnt(gate) || (gate & RS_POLL_SUSPEND))
+			return 0;
+	} while (!atomic_compare_exchange_weak(&pollgate, &gate,
+				gate | RS_POLL_SUSPEND | RS_POLL_PENDING));
+
+	return rs_poll_write_signal();
 }
 
 /* We always add the pollsignal read fd to the poll fd set, so
@@ -3184,6 +5099,30 @@ static struct pollfd *rs_fds_alloc(nfds_t nfds)
 	return rfds;
 }
 
+/*
+ * A resize marker at the head of rmsg carries no data, and a blocking
+ * receive would switch buffers and then wait for the peer.  Switch buffers
+ * here so that POLLIN means a receive will not block.  If another thread
+ * holds the receive lock, it switches buffers itself.
+ */
+static int rs_poll_have_rdata(struct rsocket *rs)
+{
+	int ret;
+
+	if (!(rs->state & rs_readable))
+		return 1;
+
+	while (rs_resize_at_head(rs)) {
+		if (!fastlock_tryacquire(&rs->rlock))
+			return 0;
+		ret = rs_resize_at_head(rs) ? rs_switch_rbuf(rs, 1) : 0;
+		fastlock_release(&rs->rlock);
+		if (ret)
+			return 0;
+	}
+	return rs_have_rdata(rs);
+}
+
 static int rs_poll_rs(struct rsocket *rs, int events,
 		      int nonblock, int (*test)(struct rsocket *rs))
 {
@@ -3197,7 +5136,7 @@ check_cq:
 		rs_process_cq(rs, nonblock, test);
 
 		revents = 0;
-		if ((events & POLLIN) && rs_conn_have_rdata(rs))
+		if ((events & POLLIN) && rs_poll_have_rdata(rs))
 			revents |= POLLIN;
 		if ((events & POLLOUT) && rs_can_send(rs))
 			revents |= POLLOUT;
@@ -3269,6 +5208,24 @@ static int rs_poll_check(struct pollfd *fds, nfds_t nfds)
 	return cnt;
 }
 
+/*
+ * Return the fd which signals a change to the rsocket's state while it
+ * is armed: a CQ event once connected, a CM event while connecting, or
+ * a queued connection request when listening.
+ */
+static int rs_poll_fd(struct rsocket *rs)
+{
+	if (rs->type == SOCK_DGRAM)
+		return rs->epfd;
+	if (rs->state == rs_listening)
+		return rs->accept_queue[0];
+
+	if (rs->state < rs_connected)
+		return rs->cm_id->channel->fd;
+
+	return rs->shared ? rs->notify_fd : rs->cm_id->recv_cq_channel->fd;
+}
+
 static int rs_poll_arm(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
 {
 	struct rsocket *rs;
@@ -3281,14 +5238,7 @@ static int rs_poll_arm(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
 			if (fds[i].revents)
 				return 1;
 
-			if (rs->type == SOCK_STREAM) {
-				if (rs->state >= rs_connected)
-					rfds[i].fd = rs->cm_id->recv_cq_channel->fd;
-				else
-					rfds[i].fd = rs->cm_id->channel->fd;
-			} else {
-				rfds[i].fd = rs->epfd;
-			}
+			rfds[i].fd = rs_poll_fd(rs);
 			rfds[i].events = POLLIN;
 		} else {
 			rfds[i].fd = fds[i].fd;
@@ -3299,6 +5249,16 @@ static int rs_poll_arm(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
 	return 0;
 }
 
+static void rs_get_poll_event(struct rsocket *rs)
+{
+	fastlock_acquire(&rs->cq_wait_lock);
+	if (rs->type == SOCK_STREAM)
+		rs_get_cq_event(rs);
+	else
+		ds_get_cq_event(rs);
+	fastlock_release(&rs->cq_wait_lock);
+}
+
 static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
 {
 	struct rsocket *rs;
@@ -3307,14 +5267,8 @@ static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
 	for (i = 0; i < nfds; i++) {
 		rs = idm_lookup(&idm, fds[i].fd);
 		if (rs) {
-			if (rfds[i].revents) {
-				fastlock_acquire(&rs->cq_wait_lock);
-				if (rs->type == SOCK_STREAM)
-					rs_get_cq_event(rs);
-				else
-					ds_get_cq_event(rs);
-				fastlock_release(&rs->cq_wait_lock);
-			}
+			if (rfds[i].revents)
+				rs_get_poll_event(rs);
 			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
 		} else {
 			fds[i].revents = rfds[i].revents;
@@ -3383,95 +5337,623 @@ int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
 	return ret;
 }
 
-static struct pollfd *
-rs_select_to_poll(int *nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
+static struct pollfd *
+rs_select_to_poll(int *nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
+{
+	struct pollfd *fds;
+	int fd, i = 0;
+
+	fds = calloc(*nfds, sizeof(*fds));
+	if (!fds)
+		return NULL;
+
+	for (fd = 0; fd < *nfds; fd++) {
+		if (readfds && FD_ISSET(fd, readfds)) {
+			fds[i].fd = fd;
+			fds[i].events = POLLIN;
+		}
+
+		if (writefds && FD_ISSET(fd, writefds)) {
+			fds[i].fd = fd;
+			fds[i].events |= POLLOUT;
+		}
+
+		if (exceptfds && FD_ISSET(fd, exceptfds))
+			fds[i].fd = fd;
+
+		if (fds[i].fd)
+			i++;
+	}
+
+	*nfds = i;
+	return fds;
+}
+
+static int
+rs_poll_to_select(int nfds, struct pollfd *fds, fd_set *readfds,
+		  fd_set *writefds, fd_set *exceptfds)
+{
+	int i, cnt = 0;
+
+	for (i = 0; i < nfds; i++) {
+		if (readfds && (fds[i].revents & (POLLIN | POLLHUP))) {
+			FD_SET(fds[i].fd, readfds);
+			cnt++;
+		}
+
+		if (writefds && (fds[i].revents & POLLOUT)) {
+			FD_SET(fds[i].fd, writefds);
+			cnt++;
+		}
+
+		if (exceptfds && (fds[i].revents & ~(POLLIN | POLLOUT))) {
+			FD_SET(fds[i].fd, exceptfds);
+			cnt++;
+		}
+	}
+	return cnt;
+}
+
+static int rs_convert_timeout(struct timeval *timeout)
+{
+	return !timeout ? -1 :
+		timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+}
+
+int rselect(int nfds, fd_set *readfds, fd_set *writefds,
+	    fd_set *exceptfds, struct timeval *timeout)
+{
+	struct pollfd *fds;
+	int ret;
+
+	fds = rs_select_to_poll(&nfds, readfds, writefds, exceptfds);
+	if (!fds)
+		return ERR(ENOMEM);
+
+	ret = rpoll(fds, nfds, rs_convert_timeout(timeout));
+
+	if (readfds)
+		FD_ZERO(readfds);
+	if (writefds)
+		FD_ZERO(writefds);
+	if (exceptfds)
+		FD_ZERO(exceptfds);
+
+	if (ret > 0)
+		ret = rs_poll_to_select(nfds, fds, readfds, writefds, exceptfds);
+
+	free(fds);
+	return ret;
+}
+
+/*
+ * repoll provides an epoll style interface, which avoids scanning every
+ * rsocket on each call.  Normal fd's are added directly to the kernel epoll
+ * set.  For an rsocket, the kernel set instead watches the fd returned by
+ * rs_poll_fd.  When that fd fires, the event is read and the rsocket is
+ * placed on a ready list.  Only rsockets on the ready list are checked for
+ * events.  Level-triggered rsockets remain on the ready list until they
+ * report no events, at which point they are re-armed.  When repoll_ctl
+ * places an rsocket on the ready list, threads blocked on the kernel set
+ * are woken through the set's wake_fd.
+ */
+#define RS_EPOLL_BATCH 64
+
+struct rs_epoll_item {
+	dlist_entry		entry;
+	dlist_entry		ready_entry;
+	struct rsocket		*rs;
+	struct epoll_event	event;
+	int			fd;
+	int			watch_fd;
+	int			ready;
+	int			disabled;
+};
+
+struct rs_epoll {
+	dlist_entry		entry;
+	dlist_entry		item_list;
+	dlist_entry		ready_list;
+	struct index_map	items;
+	fastlock_t		lock;
+	int			epfd;
+	int			wake_fd;
+	int			waiters;
+};
+
+/* Wake threads blocked in repoll_wait to check the ready list */
+static void rs_epoll_wake(struct rs_epoll *ep)
+{
+	uint64_t val = 1;
+	ssize_t __attribute__((unused)) rc;
+
+	if (ep->waiters)
+		rc = write(ep->wake_fd, &val, sizeof(val));
+}
+
+static void rs_epoll_set_ready(struct rs_epoll *ep, struct rs_epoll_item *item)
+{
+	if (item->ready || item->disabled)
+		return;
+
+	dlist_insert_tail(&item->ready_entry, &ep->ready_list);
+	item->ready = 1;
+}
+
+static void rs_epoll_clear_ready(struct rs_epoll_item *item)
+{
+	if (!item->ready)
+		return;
+
+	dlist_remove(&item->ready_entry);
+	item->ready = 0;
+}
+
+/*
+ * The fd used to signal an rsocket changes as the rsocket is connected.
+ * The kernel set is edge-triggered for these fd's, since the ready list
+ * provides level-triggered behavior where needed.
+ */
+static void rs_epoll_watch(struct rs_epoll *ep, struct rs_epoll_item *item)
+{
+	struct epoll_event event;
+	int fd;
+
+	fd = rs_poll_fd(item->rs);
+	if (fd == item->watch_fd)
+		return;
+
+	if (item->watch_fd >= 0)
+		epoll_ctl(ep->epfd, EPOLL_CTL_DEL, item->watch_fd, NULL);
+
+	item->watch_fd = -1;
+	if (fd >= 0) {
+		event.events = EPOLLIN | EPOLLET;
+		event.data.fd = item->fd;
+		if (!epoll_ctl(ep->epfd, EPOLL_CTL_ADD, fd, &event))
+			item->watch_fd = fd;
+	}
+}
+
+static int rs_epoll_add_item(struct rs_epoll *ep, int fd, struct rsocket *rs,
+			     struct epoll_event *event)
+{
+	struct rs_epoll_item *item;
+	struct epoll_event kevent;
+	int ret;
+
+	item = calloc(1, sizeof(*item));
+	if (!item)
+		return ERR(ENOMEM);
+
+	item->rs = rs;
+	item->event = *event;
+	item->fd = fd;
+	item->watch_fd = -1;
+
+	ret = idm_set(&ep->items, fd, item);
+	if (ret < 0)
+		goto err;
+
+	if (rs) {
+		atomic_fetch_add(&rs->epoll_cnt, 1);
+		rs_epoll_watch(ep, item);
+		rs_epoll_set_ready(ep, item);
+		rs_epoll_wake(ep);
+	} else {
+		kevent.events = event->events;
+		kevent.data.fd = fd;
+		ret = epoll_ctl(ep->epfd, EPOLL_CTL_ADD, fd, &kevent);
+		if (ret) {
+			idm_clear(&ep->items, fd);
+			goto err;
+		}
+	}
+
+	dlist_insert_tail(&item->entry, &ep->item_list);
+	return 0;
+err:
+	free(item);
+	return ret;
+}
+
+static void rs_epoll_del_item(struct rs_epoll *ep, struct rs_epoll_item *item);
+
+static int rs_epoll_mod_item(struct rs_epoll *ep, struct rs_epoll_item *item,
+			     struct epoll_event *event)
+{
+	struct epoll_event kevent;
+	int ret;
+
+	if (!item->rs) {
+		kevent.events = event->events;
+		kevent.data.fd = item->fd;
+		ret = epoll_ctl(ep->epfd, EPOLL_CTL_MOD, item->fd, &kevent);
+		if (ret) {
+			if (errno != ENOENT)
+				return ret;
+
+			/* The kernel drops an fd from its set when it is closed */
+			rs_epoll_del_item(ep, item);
+			return ERR(ENOENT);
+		}
+	}
+
+	item->event = *event;
+	item->disabled = 0;
+	if (item->rs) {
+		rs_epoll_watch(ep, item);
+		rs_epoll_set_ready(ep, item);
+		rs_epoll_wake(ep);
+	}
+	return 0;
+}
+
+/*
+ * An fd that is already in the set may have been closed, which removes it
+ * from the kernel set, and its number reused.  If the kernel accepts the fd
+ * again, the old item was stale and is updated for the new fd.
+ */
+static int rs_epoll_readd_item(struct rs_epoll *ep, struct rs_epoll_item *item,
+			       struct epoll_event *event)
+{
+	struct epoll_event kevent;
+	int ret;
+
+	kevent.events = event->events;
+	kevent.data.fd = item->fd;
+	ret = epoll_ctl(ep->epfd, EPOLL_CTL_ADD, item->fd, &kevent);
+	if (ret)
+		return ret;
+
+	item->event = *event;
+	item->disabled = 0;
+	return 0;
+}
+
+static void rs_epoll_del_item(struct rs_epoll *ep, struct rs_epoll_item *item)
+{
+	if (item->rs) {
+		if (item->watch_fd >= 0)
+			epoll_ctl(ep->epfd, EPOLL_CTL_DEL, item->watch_fd, NULL);
+		atomic_fetch_sub(&item->rs->epoll_cnt, 1);
+	} else {
+		epoll_ctl(ep->epfd, EPOLL_CTL_DEL, item->fd, NULL);
+	}
+
+	rs_epoll_clear_ready(item);
+	dlist_remove(&item->entry);
+	idm_clear(&ep->items, item->fd);
+	free(item);
+}
+
+/*
+ * Remove a closing rsocket from any repoll sets that it belongs to.  The
+ * service threads must not call this, since a thread in repoll_wait may
+ * be waiting on a service thread while holding the set lock.
+ */
+static void rs_epoll_remove(struct rsocket *rs)
+{
+	struct rs_epoll_item *item;
+	struct rs_epoll *ep;
+	dlist_entry *entry;
+
+	if (!atomic_load(&rs->epoll_cnt))
+		return;
+
+	pthread_mutex_lock(&epoll_mut);
+	for (entry = epoll_list.next; entry != &epoll_list; entry = entry->next) {
+		ep = container_of(entry, struct rs_epoll, entry);
+		fastlock_acquire(&ep->lock);
+		item = idm_lookup(&ep->items, rs->index);
+		if (item && item->rs == rs)
+			rs_epoll_del_item(ep, item);
+		fastlock_release(&ep->lock);
+	}
+	pthread_mutex_unlock(&epoll_mut);
+}
+
+int repoll_create1(int flags)
+{
+	struct epoll_event event;
+	struct rs_epoll *ep;
+	int ret;
+
+	if (flags & ~EPOLL_CLOEXEC)
+		return ERR(EINVAL);
+
+	ep = calloc(1, sizeof(*ep));
+	if (!ep)
+		return ERR(ENOMEM);
+
+	dlist_init(&ep->item_list);
+	dlist_init(&ep->ready_list);
+	fastlock_init(&ep->lock);
+
+	ep->epfd = epoll_create1(flags);
+	if (ep->epfd < 0) {
+		ret = ep->epfd;
+		goto err1;
+	}
+
+	ep->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ep->wake_fd < 0) {
+		ret = ep->wake_fd;
+		goto err2;
+	}
+
+	event.events = EPOLLIN;
+	event.data.fd = ep->wake_fd;
+	ret = epoll_ctl(ep->epfd, EPOLL_CTL_ADD, ep->wake_fd, &event);
+	if (ret)
+		goto err3;
+
+	pthread_mutex_lock(&epoll_mut);
+	ret = idm_set(&epidm, ep->epfd, ep);
+	if (ret >= 0)
+		dlist_insert_tail(&ep->entry, &epoll_list);
+	pthread_mutex_unlock(&epoll_mut);
+	if (ret < 0)
+		goto err3;
+
+	return ep->epfd;
+
+err3:
+	close(ep->wake_fd);
+err2:
+	close(ep->epfd);
+err1:
+	fastlock_destroy(&ep->lock);
+	free(ep);
+	return ret;
+}
+
+int repoll_create(int size)
 {
-	struct pollfd *fds;
-	int fd, i = 0;
-
-	fds = calloc(*nfds, sizeof(*fds));
-	if (!fds)
-		return NULL;
+	if (size <= 0)
+		return ERR(EINVAL);
 
-	for (fd = 0; fd < *nfds; fd++) {
-		if (readfds && FD_ISSET(fd, readfds)) {
-			fds[i].fd = fd;
-			fds[i].events = POLLIN;
-		}
+	return repoll_create1(0);
+}
 
-		if (writefds && FD_ISSET(fd, writefds)) {
-			fds[i].fd = fd;
-			fds[i].events |= POLLOUT;
-		}
+static int rs_epoll_close(int epfd)
+{
+	struct rs_epoll_item *item;
+	struct rs_epoll *ep;
 
-		if (exceptfds && FD_ISSET(fd, exceptfds))
-			fds[i].fd = fd;
+	pthread_mutex_lock(&epoll_mut);
+	ep = idm_lookup(&epidm, epfd);
+	if (ep) {
+		idm_clear(&epidm, epfd);
+		dlist_remove(&ep->entry);
+	}
+	pthread_mutex_unlock(&epoll_mut);
+	if (!ep)
+		return EBADF;
 
-		if (fds[i].fd)
-			i++;
+	while (!dlist_empty(&ep->item_list)) {
+		item = container_of(ep->item_list.next,
+				    struct rs_epoll_item, entry);
+		rs_epoll_del_item(ep, item);
 	}
 
-	*nfds = i;
-	return fds;
+	close(ep->wake_fd);
+	close(ep->epfd);
+	fastlock_destroy(&ep->lock);
+	free(ep);
+	return 0;
 }
 
-static int
-rs_poll_to_select(int nfds, struct pollfd *fds, fd_set *readfds,
-		  fd_set *writefds, fd_set *exceptfds)
+int repoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 {
-	int i, cnt = 0;
+	struct rs_epoll_item *item;
+	struct rs_epoll *ep;
+	struct rsocket *rs;
+	int ret;
 
-	for (i = 0; i < nfds; i++) {
-		if (readfds && (fds[i].revents & (POLLIN | POLLHUP))) {
-			FD_SET(fds[i].fd, readfds);
-			cnt++;
+	ep = idm_lookup(&epidm, epfd);
+	if (!ep)
+		return ERR(EBADF);
+	if (fd == epfd)
+		return ERR(EINVAL);
+	if (op != EPOLL_CTL_DEL && !event)
+		return ERR(EFAULT);
+
+	rs = idm_lookup(&idm, fd);
+	fastlock_acquire(&ep->lock);
+	item = idm_lookup(&ep->items, fd);
+	if (item && !item->rs && rs) {
+		/* A closed fd's number is now used by an rsocket */
+		rs_epoll_del_item(ep, item);
+		item = NULL;
+	}
+
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		if (!item)
+			ret = rs_epoll_add_item(ep, fd, rs, event);
+		else if (!item->rs)
+			ret = rs_epoll_readd_item(ep, item, event);
+		else
+			ret = ERR(EEXIST);
+		break;
+	case EPOLL_CTL_MOD:
+		ret = item ? rs_epoll_mod_item(ep, item, event) : ERR(ENOENT);
+		break;
+	case EPOLL_CTL_DEL:
+		if (item) {
+			rs_epoll_del_item(ep, item);
+			ret = 0;
+		} else {
+			ret = ERR(ENOENT);
 		}
+		break;
+	default:
+		ret = ERR(EINVAL);
+		break;
+	}
+	fastlock_release(&ep->lock);
+	return ret;
+}
 
-		if (writefds && (fds[i].revents & POLLOUT)) {
-			FD_SET(fds[i].fd, writefds);
-			cnt++;
+/*
+ * Check the rsockets on the ready list, arming those with no events.
+ * Level-triggered rsockets which report events are moved to the end of
+ * the ready list, so that a busy rsocket cannot starve the others.
+ */
+static int rs_epoll_check(struct rs_epoll *ep, struct epoll_event *events,
+			  int maxevents)
+{
+	struct rs_epoll_item *item;
+	dlist_entry *entry, *next, requeue;
+	uint32_t revents;
+	int cnt = 0;
+
+	dlist_init(&requeue);
+	for (entry = ep->ready_list.next; entry != &ep->ready_list &&
+	     cnt < maxevents; entry = next) {
+		next = entry->next;
+		item = container_of(entry, struct rs_epoll_item, ready_entry);
+
+		revents = rs_poll_rs(item->rs, item->event.events, 0,
+				     rs_is_cq_armed);
+		rs_epoll_watch(ep, item);
+		revents &= item->event.events | EPOLLERR | EPOLLHUP;
+		rs_epoll_clear_ready(item);
+		if (!revents)
+			continue;
+
+		events[cnt].events = revents;
+		events[cnt++].data = item->event.data;
+		if (item->event.events & EPOLLONESHOT) {
+			item->disabled = 1;
+		} else if (!(item->event.events & EPOLLET)) {
+			dlist_insert_tail(&item->ready_entry, &requeue);
+			item->ready = 1;
 		}
+	}
 
-		if (exceptfds && (fds[i].revents & ~(POLLIN | POLLOUT))) {
-			FD_SET(fds[i].fd, exceptfds);
-			cnt++;
+	if (!dlist_empty(&requeue)) {
+		requeue.next->prev = ep->ready_list.prev;
+		ep->ready_list.prev->next = requeue.next;
+		requeue.prev->next = &ep->ready_list;
+		ep->ready_list.prev = requeue.prev;
+	}
+	return cnt;
+}
+
+/*
+ * Normal fd events are returned directly.  Events on rsockets only
+ * indicate that the rsocket should be checked.
+ */
+static int rs_epoll_events(struct rs_epoll *ep, struct epoll_event *kevents,
+			   int nevents, struct epoll_event *events)
+{
+	struct rs_epoll_item *item;
+	ssize_t __attribute__((unused)) rc;
+	uint64_t val;
+	int i, cnt = 0, signal = 0;
+
+	for (i = 0; i < nevents; i++) {
+		/* Another waiter may already have cleared the wakeup */
+		if (kevents[i].data.fd == ep->wake_fd) {
+			rc = read(ep->wake_fd, &val, sizeof(val));
+			continue;
+		}
+
+		item = idm_lookup(&ep->items, kevents[i].data.fd);
+		if (!item)
+			continue;
+
+		if (item->rs) {
+			rs_get_poll_event(item->rs);
+			rs_epoll_set_ready(ep, item);
+			signal = 1;
+		} else {
+			events[cnt].events = kevents[i].events;
+			events[cnt++].data = item->event.data;
 		}
 	}
+
+	/* Wake any threads in rpoll blocked on the events that we read */
+	if (signal)
+		rs_poll_signal();
 	return cnt;
 }
 
-static int rs_convert_timeout(struct timeval *timeout)
+static void rs_epoll_set_all_ready(struct rs_epoll *ep)
 {
-	return !timeout ? -1 :
-		timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+	struct rs_epoll_item *item;
+	dlist_entry *entry;
+
+	for (entry = ep->item_list.next; entry != &ep->item_list;
+	     entry = entry->next) {
+		item = container_of(entry, struct rs_epoll_item, entry);
+		if (item->rs)
+			rs_epoll_set_ready(ep, item);
+	}
 }
 
-int rselect(int nfds, fd_set *readfds, fd_set *writefds,
-	    fd_set *exceptfds, struct timeval *timeout)
+/*
+ * The signal mask is installed by epoll_pwait on the backing epoll fd, so
+ * it only applies, atomically, while the thread is blocked in the kernel.
+ * A signal arriving between waits stays pending until the next wait.
+ */
+int repoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+		 int timeout, const sigset_t *sigmask)
 {
-	struct pollfd *fds;
-	int ret;
+	struct epoll_event kevents[RS_EPOLL_BATCH];
+	struct rs_epoll *ep;
+	uint64_t start_time = 0;
+	int pollsleep, elapsed, ret;
 
-	fds = rs_select_to_poll(&nfds, readfds, writefds, exceptfds);
-	if (!fds)
-		return ERR(ENOMEM);
+	ep = idm_lookup(&epidm, epfd);
+	if (!ep)
+		return ERR(EBADF);
+	if (maxevents <= 0)
+		return ERR(EINVAL);
 
-	ret = rpoll(fds, nfds, rs_convert_timeout(timeout));
+	fastlock_acquire(&ep->lock);
+	ret = rs_epoll_check(ep, events, maxevents);
+	while (!ret && timeout) {
+		if (!start_time)
+			start_time = rs_time_us();
 
-	if (readfds)
-		FD_ZERO(readfds);
-	if (writefds)
-		FD_ZERO(writefds);
-	if (exceptfds)
-		FD_ZERO(exceptfds);
+		if (timeout >= 0) {
+			elapsed = (int) ((rs_time_us() - start_time) / 1000);
+			if (elapsed >= timeout)
+				break;
+			pollsleep = min(timeout - elapsed, wake_up_interval);
+		} else {
+			pollsleep = wake_up_interval;
+		}
 
-	if (ret > 0)
-		ret = rs_poll_to_select(nfds, fds, readfds, writefds, exceptfds);
+		ep->waiters++;
+		fastlock_release(&ep->lock);
+		ret = epoll_pwait(ep->epfd, kevents,
+				  min(maxevents, RS_EPOLL_BATCH), pollsleep,
+				  sigmask);
+		fastlock_acquire(&ep->lock);
+		ep->waiters--;
+		if (ret < 0)
+			break;
 
-	free(fds);
+		/* Safe guard against missed events, see wake_up_interval */
+		if (!ret && pollsleep == wake_up_interval)
+			rs_epoll_set_all_ready(ep);
+
+		ret = rs_epoll_events(ep, kevents, ret, events);
+		ret += rs_epoll_check(ep, events + ret, maxevents - ret);
+	}
+	fastlock_release(&ep->lock);
 	return ret;
 }
 
+int repoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	return repoll_pwait(epfd, events, maxevents, timeout, NULL);
+}
+
 /*
  * For graceful disconnect, notify the remote side that we're
  * disconnecting and wait until all outstanding sends complete, provided
@@ -3526,7 +6008,10 @@ out:
 
 	if (rs->state & rs_disconnected) {
 		/* Generate event by flushing receives to unblock rpoll */
-		ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
+		if (rs->shared)
+			rs_shared_signal(rs);
+		else
+			ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
 		ucma_shutdown(rs->cm_id);
 	}
 
@@ -3554,16 +6039,22 @@ int rclose(int socket)
 
 	rs = idm_lookup(&idm, socket);
 	if (!rs)
-		return EBADF;
+		return rs_epoll_close(socket);
+
+	rs_epoll_remove(rs);
 	if (rs->type == SOCK_STREAM) {
 		if (rs->state & rs_connected)
 			rshutdown(socket, SHUT_RDWR);
 		if (rs->opts & RS_OPT_KEEPALIVE)
 			rs_notify_svc(&tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
-		if (rs->opts & RS_OPT_CM_SVC && rs->state == rs_listening)
-			rs_notify_svc(&listen_svc, rs, RS_SVC_REM_CM);
+		if (rs->opts & RS_OPT_CM_SVC && rs->state == rs_listening) {
+			rs_notify_svc(rs_cm_svc(listen_svc, rs), rs,
+				      RS_SVC_REM_CM);
+			rs_flush_accepts();
+		}
 		if (rs->opts & RS_OPT_CM_SVC)
-			rs_notify_svc(&connect_svc, rs, RS_SVC_REM_CM);
+			rs_notify_svc(rs_cm_svc(connect_svc, rs), rs,
+				      RS_SVC_REM_CM);
 	} else {
 		ds_shutdown(rs);
 	}
@@ -3680,6 +6171,8 @@ int rsetsockopt(int socket, int level, int optname,
 			if ((rs->type == SOCK_STREAM && !rs->rbuf) ||
 			    (rs->type == SOCK_DGRAM && !rs->qp_list))
 				rs->rbuf_size = (*(uint32_t *) optval) << 1;
+			/* An explicit buffer size disables automatic resizing */
+			opt_on = 1;
 			ret = 0;
 			break;
 		case SO_SNDBUF:
@@ -3687,6 +6180,7 @@ int rsetsockopt(int socket, int level, int optname,
 				rs->sbuf_size = (*(uint32_t *) optval) << 1;
 			if (rs->sbuf_size < RS_SNDLOWAT)
 				rs->sbuf_size = RS_SNDLOWAT << 1;
+			opt_on = 1;
 			ret = 0;
 			break;
 		case SO_LINGER:
@@ -3749,6 +6243,15 @@ int rsetsockopt(int socket, int level, int optname,
 		}
 		break;
 	case SOL_RDMA:
+		if (optname == RDMA_BUSY_POLL_US) {
+			rs->busy_poll_us = *(uint32_t *) optval;
+			atomic_store_explicit(&rs->poll_avg,
+					      rs->busy_poll_us >> 1,
+					      memory_order_relaxed);
+			ret = 0;
+			break;
+		}
+
 		if (rs->state >= rs_opening) {
 			ret = ERR(EINVAL);
 			break;
@@ -3775,6 +6278,10 @@ int rsetsockopt(int socket, int level, int optname,
 				(uint8_t) rs_value_to_scale(*(int *) optval, 8), 8);
 			ret = 0;
 			break;
+		case RDMA_SRQSIZE:
+			rs->srq_size = *(uint32_t *) optval;
+			ret = 0;
+			break;
 		case RDMA_ROUTE:
 			if ((rs->optval = malloc(optlen))) {
 				memcpy(rs->optval, optval, optlen);
@@ -3824,6 +6331,22 @@ static void rs_convert_sa_path(struct ibv_sa_path_rec *sa_path,
 	path_data->flags= sa_path->preference;
 }
 
+static void rs_get_stats(struct rsocket *rs, struct rdma_stats *stats)
+{
+	stats->bytes_sent = rs_stat_get(&rs->stats.bytes_sent);
+	stats->bytes_recv = rs_stat_get(&rs->stats.bytes_recv);
+	stats->writes = rs_stat_get(&rs->stats.writes);
+	stats->inline_writes = rs_stat_get(&rs->stats.inline_writes);
+	stats->iomap_writes = rs_stat_get(&rs->stats.iomap_writes);
+	stats->ctrl_sent = rs_stat_get(&rs->stats.ctrl_sent);
+	stats->ctrl_recv = rs_stat_get(&rs->stats.ctrl_recv);
+	stats->credit_stalls = rs_stat_get(&rs->stats.credit_stalls);
+	stats->send_stalls = rs_stat_get(&rs->stats.send_stalls);
+	stats->cq_polls = rs_stat_get(&rs->stats.cq_polls);
+	stats->cq_entries = rs_stat_get(&rs->stats.cq_entries);
+	stats->resizes = rs_stat_get(&rs->stats.resizes);
+}
+
 int rgetsockopt(int socket, int level, int optname,
 		void *optval, socklen_t *optlen)
 {
@@ -3831,6 +6354,7 @@ int rgetsockopt(int socket, int level, int optname,
 	void *opt;
 	struct ibv_sa_path_rec *path_rec;
 	struct ibv_path_data path_data;
+	struct rdma_busy_poll_stats *stats;
 	socklen_t len;
 	int ret = 0;
 	int num_paths;
@@ -3867,6 +6391,10 @@ int rgetsockopt(int socket, int level, int optname,
 			*optlen = sizeof(int);
 			rs->err = 0;
 			break;
+		case SO_TYPE:
+			*((int *) optval) = rs->type;
+			*optlen = sizeof(int);
+			break;
 		default:
 			ret = ENOTSUP;
 			break;
@@ -3926,6 +6454,39 @@ int rgetsockopt(int socket, int level, int optname,
 			*((int *) optval) = rs->target_iomap_size;
 			*optlen = sizeof(int);
 			break;
+		case RDMA_SRQSIZE:
+			*((int *) optval) = (rs->type == SOCK_STREAM && rs->shared) ?
+					    rs->shared->srq_size : rs->srq_size;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_BUSY_POLL_US:
+			*((int *) optval) = rs->busy_poll_us;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_BUSY_POLL_STATS:
+			if (*optlen < sizeof(struct rdma_busy_poll_stats)) {
+				ret = EINVAL;
+				break;
+			}
+
+			stats = optval;
+			stats->spins = atomic_load(&rs->poll_spins);
+			stats->wakeups = atomic_load(&rs->poll_wakeups);
+			stats->misses = atomic_load(&rs->poll_misses);
+			stats->budget_us = rs_poll_budget(rs);
+			stats->avg_wait_us = atomic_load_explicit(&rs->poll_avg,
+							memory_order_relaxed);
+			*optlen = sizeof(*stats);
+			break;
+		case RDMA_STATS:
+			if (*optlen < sizeof(struct rdma_stats)) {
+				ret = EINVAL;
+				break;
+			}
+
+			rs_get_stats(rs, optval);
+			*optlen = sizeof(struct rdma_stats);
+			break;
 		case RDMA_ROUTE:
 			if (rs->optval) {
 				if (*optlen < rs->optlen) {
@@ -4231,7 +6792,7 @@ static int rs_svc_grow_sets(struct rs_svc *svc, int grow_size)
 }
 
 /*
- * Index 0 is reserved for the service's communication socket.
+ * Index 0 is reserved for the service's wakeup eventfd.
  */
 static int rs_svc_add_rs(struct rs_svc *svc, struct rsocket *rs)
 {
@@ -4244,18 +6805,15 @@ static int rs_svc_add_rs(struct rs_svc *svc, struct rsocket *rs)
 	}
 
 	svc->rss[++svc->cnt] = rs;
+	rs->svc_index = svc->cnt;
 	return 0;
 }
 
 static int rs_svc_index(struct rs_svc *svc, struct rsocket *rs)
 {
-	int i;
+	int i = rs->svc_index;
 
-	for (i = 1; i <= svc->cnt; i++) {
-		if (svc->rss[i] == rs)
-			return i;
-	}
-	return -1;
+	return (i >= 1 && i <= svc->cnt && svc->rss[i] == rs) ? i : -1;
 }
 
 static int rs_svc_rm_rs(struct rs_svc *svc, struct rsocket *rs)
@@ -4264,44 +6822,81 @@ static int rs_svc_rm_rs(struct rs_svc *svc, struct rsocket *rs)
 
 	if ((i = rs_svc_index(svc, rs)) >= 0) {
 		svc->rss[i] = svc->rss[svc->cnt];
+		svc->rss[i]->svc_index = i;
 		memcpy(svc->contexts + i * svc->context_size,
 		       svc->contexts + svc->cnt * svc->context_size,
 		       svc->context_size);
 		svc->cnt--;
+		rs->svc_index = 0;
 		return 0;
 	}
 	return EBADF;
 }
 
-static void udp_svc_process_sock(struct rs_svc *svc)
-{
-	struct rs_svc_msg msg;
+/*
+ * Processes all queued requests, in the order that they were queued.
+ * Returns the number of references remaining on the service.  When this
+ * reaches 0, the service thread must exit without accessing the service
+ * again, since it may be restarted by a new request.
+ */
+static int rs_svc_process_msgs(struct rs_svc *svc,
+			       void (*process)(struct rs_svc *svc,
+					       struct rs_svc_msg *msg))
+{
+	struct rs_svc_msg *list, *msg, *next;
+	sem_t *done;
+	uint64_t val;
+	int cnt, ref = 1;
+
+	read_all(svc->efd, &val, sizeof val);
+	while ((list = atomic_exchange(&svc->msgs, NULL))) {
+		for (msg = NULL; list; list = next) {
+			next = list->next;
+			list->next = msg;
+			msg = list;
+		}
+
+		for (; msg; msg = next) {
+			/* An asynchronous request may be reused once processed */
+			next = msg->next;
+			done = msg->done;
+			cnt = svc->cnt;
+			process(svc, msg);
+			ref = atomic_fetch_add(&svc->ref, svc->cnt - cnt - 1) +
+			      svc->cnt - cnt - 1;
+			if (done)
+				sem_post(done);
+		}
+		if (!ref)
+			break;
+	}
+	return ref;
+}
 
-	read_all(svc->sock[1], &msg, sizeof msg);
-	switch (msg.cmd) {
+static void udp_svc_process_msg(struct rs_svc *svc, struct rs_svc_msg *msg)
+{
+	switch (msg->cmd) {
 	case RS_SVC_ADD_DGRAM:
-		msg.status = rs_svc_add_rs(svc, msg.rs);
-		if (!msg.status) {
-			msg.rs->opts |= RS_OPT_UDP_SVC;
+		msg->status = rs_svc_add_rs(svc, msg->rs);
+		if (!msg->status) {
+			msg->rs->opts |= RS_OPT_UDP_SVC;
 			udp_svc_fds = svc->contexts;
-			udp_svc_fds[svc->cnt].fd = msg.rs->udp_sock;
+			udp_svc_fds[svc->cnt].fd = msg->rs->udp_sock;
 			udp_svc_fds[svc->cnt].events = POLLIN;
 			udp_svc_fds[svc->cnt].revents = 0;
 		}
 		break;
 	case RS_SVC_REM_DGRAM:
-		msg.status = rs_svc_rm_rs(svc, msg.rs);
-		if (!msg.status)
-			msg.rs->opts &= ~RS_OPT_UDP_SVC;
+		msg->status = rs_svc_rm_rs(svc, msg->rs);
+		if (!msg->status)
+			msg->rs->opts &= ~RS_OPT_UDP_SVC;
 		break;
 	case RS_SVC_NOOP:
-		msg.status = 0;
+		msg->status = 0;
 		break;
 	default:
 		break;
 	}
-
-	write_all(svc->sock[1], &msg, sizeof msg);
 }
 
 static uint8_t udp_svc_sgid_index(struct ds_dest *dest, union ibv_gid *sgid)
@@ -4474,32 +7069,25 @@ static void udp_svc_process_rs(struct rsocket *rs)
 static void *udp_svc_run(void *arg)
 {
 	struct rs_svc *svc = arg;
-	struct rs_svc_msg msg;
-	int i, ret;
-
-	ret = rs_svc_grow_sets(svc, 4);
-	if (ret) {
-		msg.status = ret;
-		write_all(svc->sock[1], &msg, sizeof msg);
-		return (void *) (uintptr_t) ret;
-	}
+	int i;
 
 	udp_svc_fds = svc->contexts;
-	udp_svc_fds[0].fd = svc->sock[1];
+	udp_svc_fds[0].fd = svc->efd;
 	udp_svc_fds[0].events = POLLIN;
-	do {
+	for (;;) {
 		for (i = 0; i <= svc->cnt; i++)
 			udp_svc_fds[i].revents = 0;
 
 		poll(udp_svc_fds, svc->cnt + 1, -1);
-		if (udp_svc_fds[0].revents)
-			udp_svc_process_sock(svc);
+		if (udp_svc_fds[0].revents &&
+		    !rs_svc_process_msgs(svc, udp_svc_process_msg))
+			break;
 
 		for (i = 1; i <= svc->cnt; i++) {
 			if (udp_svc_fds[i].revents)
 				udp_svc_process_rs(svc->rss[i]);
 		}
-	} while (svc->cnt >= 1);
+	}
 
 	return NULL;
 }
@@ -4509,43 +7097,133 @@ static uint64_t rs_get_time(void)
 	return rs_time_us() / 1000000;
 }
 
-static void tcp_svc_process_sock(struct rs_svc *svc)
+/*
+ * Keep-alive timeouts are kept in a binary min-heap, rooted at index 1 of
+ * the service's rsocket and timeout arrays.  Each rsocket records its
+ * position in the heap, so a timeout can be changed or removed without
+ * searching, and the next timeout to expire is always at the root.
+ */
+static void tcp_svc_heap_set(struct rs_svc *svc, int i, struct rsocket *rs,
+			     uint64_t timeout)
+{
+	svc->rss[i] = rs;
+	tcp_svc_timeouts[i] = timeout;
+	rs->keepalive_index = i;
+}
+
+static void tcp_svc_heap_up(struct rs_svc *svc, int i)
+{
+	struct rsocket *rs = svc->rss[i];
+	uint64_t timeout = tcp_svc_timeouts[i];
+
+	for (; i > 1 && tcp_svc_timeouts[i >> 1] > timeout; i >>= 1)
+		tcp_svc_heap_set(svc, i, svc->rss[i >> 1],
+				 tcp_svc_timeouts[i >> 1]);
+	tcp_svc_heap_set(svc, i, rs, timeout);
+}
+
+static void tcp_svc_heap_down(struct rs_svc *svc, int i)
+{
+	struct rsocket *rs = svc->rss[i];
+	uint64_t timeout = tcp_svc_timeouts[i];
+	int child;
+
+	while ((child = i << 1) <= svc->cnt) {
+		if (child < svc->cnt &&
+		    tcp_svc_timeouts[child + 1] < tcp_svc_timeouts[child])
+			child++;
+		if (tcp_svc_timeouts[child] >= timeout)
+			break;
+
+		tcp_svc_heap_set(svc, i, svc->rss[child],
+				 tcp_svc_timeouts[child]);
+		i = child;
+	}
+	tcp_svc_heap_set(svc, i, rs, timeout);
+}
+
+static void tcp_svc_heap_update(struct rs_svc *svc, int i, uint64_t timeout)
+{
+	tcp_svc_timeouts[i] = timeout;
+	if (i > 1 && tcp_svc_timeouts[i >> 1] > timeout)
+		tcp_svc_heap_up(svc, i);
+	else
+		tcp_svc_heap_down(svc, i);
+}
+
+static int tcp_svc_index(struct rs_svc *svc, struct rsocket *rs)
+{
+	int i = rs->keepalive_index;
+
+	return (i >= 1 && i <= svc->cnt && svc->rss[i] == rs) ? i : -1;
+}
+
+static int tcp_svc_add_rs(struct rs_svc *svc, struct rsocket *rs,
+			  uint64_t timeout)
+{
+	int ret;
+
+	if (svc->cnt >= svc->size - 1) {
+		ret = rs_svc_grow_sets(svc, svc->size);
+		if (ret)
+			return ret;
+		tcp_svc_timeouts = svc->contexts;
+	}
+
+	tcp_svc_heap_set(svc, ++svc->cnt, rs, timeout);
+	tcp_svc_heap_up(svc, svc->cnt);
+	return 0;
+}
+
+static int tcp_svc_rm_rs(struct rs_svc *svc, struct rsocket *rs)
+{
+	int i, last;
+
+	i = tcp_svc_index(svc, rs);
+	if (i < 0)
+		return EBADF;
+
+	last = svc->cnt--;
+	if (i != last) {
+		tcp_svc_heap_set(svc, i, svc->rss[last], tcp_svc_timeouts[last]);
+		tcp_svc_heap_update(svc, i, tcp_svc_timeouts[i]);
+	}
+	rs->keepalive_index = 0;
+	return 0;
+}
+
+static void tcp_svc_process_msg(struct rs_svc *svc, struct rs_svc_msg *msg)
 {
-	struct rs_svc_msg msg;
 	int i;
 
-	read_all(svc->sock[1], &msg, sizeof msg);
-	switch (msg.cmd) {
+	switch (msg->cmd) {
 	case RS_SVC_ADD_KEEPALIVE:
-		msg.status = rs_svc_add_rs(svc, msg.rs);
-		if (!msg.status) {
-			msg.rs->opts |= RS_OPT_KEEPALIVE;
-			tcp_svc_timeouts = svc->contexts;
-			tcp_svc_timeouts[svc->cnt] = rs_get_time() +
-						     msg.rs->keepalive_time;
-		}
+		msg->status = tcp_svc_add_rs(svc, msg->rs, rs_get_time() +
+					     msg->rs->keepalive_time);
+		if (!msg->status)
+			msg->rs->opts |= RS_OPT_KEEPALIVE;
 		break;
 	case RS_SVC_REM_KEEPALIVE:
-		msg.status = rs_svc_rm_rs(svc, msg.rs);
-		if (!msg.status)
-			msg.rs->opts &= ~RS_OPT_KEEPALIVE;
+		msg->status = tcp_svc_rm_rs(svc, msg->rs);
+		if (!msg->status)
+			msg->rs->opts &= ~RS_OPT_KEEPALIVE;
 		break;
 	case RS_SVC_MOD_KEEPALIVE:
-		i = rs_svc_index(svc, msg.rs);
+		i = tcp_svc_index(svc, msg->rs);
 		if (i >= 0) {
-			tcp_svc_timeouts[i] = rs_get_time() + msg.rs->keepalive_time;
-			msg.status = 0;
+			tcp_svc_heap_update(svc, i, rs_get_time() +
+					    msg->rs->keepalive_time);
+			msg->status = 0;
 		} else {
-			msg.status = EBADF;
+			msg->status = EBADF;
 		}
 		break;
 	case RS_SVC_NOOP:
-		msg.status = 0;
+		msg->status = 0;
 		break;
 	default:
 		break;
 	}
-	write_all(svc->sock[1], &msg, sizeof msg);
 }
 
 /*
@@ -4554,52 +7232,40 @@ static void tcp_svc_process_sock(struct rs_svc *svc)
  */
 static void tcp_svc_send_keepalive(struct rsocket *rs)
 {
-	fastlock_acquire(&rs->cq_lock);
+	fastlock_acquire(rs_cq_lock(rs));
 	if (rs_ctrl_avail(rs) && (rs->state & rs_connected)) {
 		rs->ctrl_seqno++;
 		rs_post_write(rs, NULL, 0, rs_msg_set(RS_OP_CTRL, RS_CTRL_KEEPALIVE),
 			      0, (uintptr_t) NULL, (uintptr_t) NULL);
 	}
-	fastlock_release(&rs->cq_lock);
+	fastlock_release(rs_cq_lock(rs));
 }	
 
 static void *tcp_svc_run(void *arg)
 {
 	struct rs_svc *svc = arg;
-	struct rs_svc_msg msg;
 	struct pollfd fds;
-	uint64_t now, next_timeout;
-	int i, ret, timeout;
-
-	ret = rs_svc_grow_sets(svc, 16);
-	if (ret) {
-		msg.status = ret;
-		write_all(svc->sock[1], &msg, sizeof msg);
-		return (void *) (uintptr_t) ret;
-	}
+	uint64_t now;
+	int i, timeout;
 
 	tcp_svc_timeouts = svc->contexts;
-	fds.fd = svc->sock[1];
+	fds.fd = svc->efd;
 	fds.events = POLLIN;
 	timeout = -1;
-	do {
+	for (;;) {
 		poll(&fds, 1, timeout * 1000);
-		if (fds.revents)
-			tcp_svc_process_sock(svc);
+		if (fds.revents && !rs_svc_process_msgs(svc, tcp_svc_process_msg))
+			break;
 
+		/* Each rsocket is sent at most one keep-alive per wakeup */
 		now = rs_get_time();
-		next_timeout = ~0;
-		for (i = 1; i <= svc->cnt; i++) {
-			if (tcp_svc_timeouts[i] <= now) {
-				tcp_svc_send_keepalive(svc->rss[i]);
-				tcp_svc_timeouts[i] =
-					now + svc->rss[i]->keepalive_time;
-			}
-			if (tcp_svc_timeouts[i] < next_timeout)
-				next_timeout = tcp_svc_timeouts[i];
+		for (i = svc->cnt; i && tcp_svc_timeouts[1] <= now; i--) {
+			tcp_svc_send_keepalive(svc->rss[1]);
+			tcp_svc_heap_update(svc, 1,
+					    now + svc->rss[1]->keepalive_time);
 		}
-		timeout = (int) (next_timeout - now);
-	} while (svc->cnt >= 1);
+		timeout = svc->cnt ? (int) (tcp_svc_timeouts[1] - now) : -1;
+	}
 
 	return NULL;
 }
@@ -4621,72 +7287,83 @@ static void rs_handle_cm_event(struct rsocket *rs)
 		rs_poll_signal();
 }
 
-static void cm_svc_process_sock(struct rs_svc *svc)
+/*
+ * The caller sets RS_OPT_CM_SVC when adding an rsocket, since additions may
+ * be asynchronous.
+ */
+static void cm_svc_process_msg(struct rs_svc *svc, struct rs_svc_msg *msg)
 {
-	struct rs_svc_msg msg;
+	struct rsocket *rs;
 	struct pollfd *fds;
 
-	read_all(svc->sock[1], &msg, sizeof(msg));
-	switch (msg.cmd) {
+	switch (msg->cmd) {
 	case RS_SVC_ADD_CM:
-		msg.status = rs_svc_add_rs(svc, msg.rs);
-		if (!msg.status) {
-			msg.rs->opts |= RS_OPT_CM_SVC;
+		msg->status = rs_svc_add_rs(svc, msg->rs);
+		if (!msg->status) {
 			fds = svc->contexts;
-			fds[svc->cnt].fd = msg.rs->cm_id->channel->fd;
+			fds[svc->cnt].fd = msg->rs->cm_id->channel->fd;
 			fds[svc->cnt].events = POLLIN;
 			fds[svc->cnt].revents = 0;
 		}
 		break;
 	case RS_SVC_REM_CM:
-		msg.status = rs_svc_rm_rs(svc, msg.rs);
-		if (!msg.status)
-			msg.rs->opts &= ~RS_OPT_CM_SVC;
+		msg->status = rs_svc_rm_rs(svc, msg->rs);
+		if (!msg->status)
+			msg->rs->opts &= ~RS_OPT_CM_SVC;
+		break;
+	case RS_SVC_ACCEPT_CM:
+		/*
+		 * The request is embedded in the new rsocket, which is freed
+		 * or handed to the application by rs_accept_conn, so it must
+		 * not be touched after the call.
+		 */
+		rs = msg->rs;
+		msg->status = 0;
+		rs_accept_conn(rs);
 		break;
 	case RS_SVC_NOOP:
-		msg.status = 0;
+		msg->status = 0;
 		break;
 	default:
 		break;
 	}
-	write_all(svc->sock[1], &msg, sizeof(msg));
 }
 
-static void *cm_svc_run(void *arg)
+static void cm_svc_run(struct rs_svc *svc,
+		       void (*process_rs)(struct rsocket *rs))
 {
-	struct rs_svc *svc = arg;
 	struct pollfd *fds;
-	struct rs_svc_msg msg;
-	int i, ret;
-
-	ret = rs_svc_grow_sets(svc, 4);
-	if (ret) {
-		msg.status = ret;
-		write_all(svc->sock[1], &msg, sizeof(msg));
-		return (void *) (uintptr_t) ret;
-	}
+	int i;
 
 	fds = svc->contexts;
-	fds[0].fd = svc->sock[1];
+	fds[0].fd = svc->efd;
 	fds[0].events = POLLIN;
-	do {
+	for (;;) {
 		for (i = 0; i <= svc->cnt; i++)
 			fds[i].revents = 0;
 
 		poll(fds, svc->cnt + 1, -1);
-		if (fds[0].revents)
-			cm_svc_process_sock(svc);
+		if (fds[0].revents &&
+		    !rs_svc_process_msgs(svc, cm_svc_process_msg))
+			break;
 
+		/* The sets may have been reallocated by an added rsocket */
+		fds = svc->contexts;
 		for (i = 1; i <= svc->cnt; i++) {
-			if (!fds[i].revents)
-				continue;
-
-			if (svc == &listen_svc)
-				rs_accept(svc->rss[i]);
-			else
-				rs_handle_cm_event(svc->rss[i]);
+			if (fds[i].revents)
+				process_rs(svc->rss[i]);
 		}
-	} while (svc->cnt >= 1);
+	}
+}
+
+static void *listen_svc_run(void *arg)
+{
+	cm_svc_run(arg, rs_accept);
+	return NULL;
+}
 
+static void *connect_svc_run(void *arg)
+{
+	cm_svc_run(arg, rs_handle_cm_event);
 	return NULL;
 }
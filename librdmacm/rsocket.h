@@ -38,6 +38,7 @@
 #include <sys/socket.h>
 #include <errno.h>
 #include <poll.h>
+#include <signal.h>
 #include <sys/select.h>
 #include <sys/mman.h>
 
@@ -65,6 +66,7 @@ ssize_t rread(int socket, void *buf, size_t count);
 ssize_t rreadv(int socket, const struct iovec *iov, int iovcnt);
 ssize_t rwrite(int socket, const void *buf, size_t count);
 ssize_t rwritev(int socket, const struct iovec *iov, int iovcnt);
+ssize_t rsendfile(int socket, int in_fd, off_t *offset, size_t count);
 
 int rpoll(struct pollfd *fds, nfds_t nfds, int timeout);
 int rselect(int nfds, fd_set *readfds, fd_set *writefds,
@@ -79,7 +81,34 @@ enum {
 	RDMA_RQSIZE,
 	RDMA_INLINE,
 	RDMA_IOMAPSIZE,
-	RDMA_ROUTE
+	RDMA_ROUTE,
+	RDMA_SRQSIZE,
+	RDMA_BUSY_POLL_US,
+	RDMA_BUSY_POLL_STATS,
+	RDMA_STATS
+};
+
+struct rdma_busy_poll_stats {
+	uint64_t	spins;		/* waits completed while busy polling */
+	uint64_t	wakeups;	/* waits which blocked on an event */
+	uint64_t	misses;		/* busy poll budget expired */
+	uint32_t	budget_us;	/* current busy poll budget */
+	uint32_t	avg_wait_us;	/* average time spent waiting */
+};
+
+struct rdma_stats {
+	uint64_t	bytes_sent;	/* data written to the remote side */
+	uint64_t	bytes_recv;	/* data returned to the application */
+	uint64_t	writes;		/* data transfers posted */
+	uint64_t	inline_writes;	/* data transfers sent inline */
+	uint64_t	iomap_writes;	/* riowrite transfers posted */
+	uint64_t	ctrl_sent;	/* control messages sent */
+	uint64_t	ctrl_recv;	/* control messages received */
+	uint64_t	credit_stalls;	/* sends waiting on the remote side */
+	uint64_t	send_stalls;	/* sends waiting on local resources */
+	uint64_t	cq_polls;	/* completion queue polls */
+	uint64_t	cq_entries;	/* completions processed */
+	uint64_t	resizes;	/* receive buffer changes */
 };
 
 int rsetsockopt(int socket, int level, int optname,
@@ -92,6 +121,23 @@ off_t riomap(int socket, void *buf, size_t len, int prot, int flags, off_t offse
 int riounmap(int socket, void *buf, size_t len);
 size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int flags);
 
+ssize_t rrecv_zc(int socket, void **buf, size_t len, int flags);
+int rrecv_release(int socket, void *buf, size_t len);
+
+struct mmsghdr;
+struct timespec;
+int rsendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+int rrecvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	      int flags, struct timespec *timeout);
+
+struct epoll_event;
+int repoll_create(int size);
+int repoll_create1(int flags);
+int repoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int repoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+int repoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+		 int timeout, const sigset_t *sigmask);
+
 #ifdef __cplusplus
 }
 #endif
@@ -36,6 +36,7 @@ cdef extern from '<rdma/rdma_cma.h>':
         RAI_NUMERICHOST
         RAI_NOROUTE
         RAI_FAMILY
+        RAI_POOL
 
     cpdef enum rdma_cm_join_mc_attr_mask:
         RDMA_CM_JOIN_MC_ATTR_ADDRESS
@@ -616,7 +616,9 @@ fi
 %{_bindir}/rdma_xserver
 %{_bindir}/riostream
 %{_bindir}/rping
+%{_bindir}/rscale
 %{_bindir}/rstream
+%{_bindir}/rsyscall
 %{_bindir}/ucmatose
 %{_bindir}/udaddy
 %{_bindir}/udpong
@@ -629,7 +631,9 @@ fi
 %{_mandir}/man1/rdma_xserver.*
 %{_mandir}/man1/riostream.*
 %{_mandir}/man1/rping.*
+%{_mandir}/man1/rscale.*
 %{_mandir}/man1/rstream.*
+%{_mandir}/man1/rsyscall.*
 %{_mandir}/man1/ucmatose.*
 %{_mandir}/man1/udaddy.*
 %{_mandir}/man1/udpong.*